@@ -0,0 +1,86 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * getpid.c -- round trip cost of an intercepted syscall
+ *
+ * Calls getpid in a tight loop and prints the average time of one call.
+ * Run it once plainly and once with LD_PRELOAD pointing to
+ * libbench_getpid_hook.so, the difference is the cost of going through
+ * the patch, the context save and the hook. The glibc getpid wrapper
+ * is not cached, every call goes to the kernel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define DEFAULT_ITERATIONS 1000000L
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+int
+main(int argc, char **argv)
+{
+	long iterations = DEFAULT_ITERATIONS;
+	long sum = 0;
+
+	if (argc > 1)
+		iterations = atol(argv[1]);
+
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	double start = now_ns();
+
+	for (long i = 0; i < iterations; ++i)
+		sum += syscall(SYS_getpid);
+
+	double end = now_ns();
+
+	printf("getpid: %ld calls, %.1f ns/call (%ld)\n", iterations,
+		(end - start) / (double)iterations, sum / iterations);
+
+	return EXIT_SUCCESS;
+}
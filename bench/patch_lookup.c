@@ -0,0 +1,229 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * patch_lookup.c -- the cost of finding the patch_desc of a patch
+ *
+ * Compares the nested scan over every patch of every object, which was
+ * used by detect_cur_patch() before, with the site table indexed by the
+ * per-site prologues (see get_cur_patch() in intercept.c). Objects are
+ * filled with fake patches, the scan gets the same three candidates
+ * asm_entry_point used to pass on (MID, SML and GW return addresses),
+ * only one of them belongs to the patch.
+ *
+ * Usage: bench_patch_lookup [patches per object]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "intercept.h"
+
+#define LOOKUPS		(1 << 18)
+#define DEFAULT_PATCHES	64
+
+static struct intercept_desc *objs;
+static unsigned objs_count;
+
+static struct patch_desc **sites;
+static uint32_t sites_count;
+
+struct keys {
+	uint64_t mid, sml, gw;
+	uint32_t site_idx;
+};
+
+/*
+ * The old way: walk all objects and all their patches once per candidate.
+ */
+static struct patch_desc *
+scan_lookup(const struct keys *k)
+{
+	uint64_t ret_addrs[3] = {k->mid, k->sml, k->gw};
+	int16_t types[3] = {TYPE_MID, 0, TYPE_GW};
+
+	for (unsigned ra_idx = 0; ra_idx < 3; ++ra_idx) {
+		for (unsigned o = 0; o < objs_count; ++o) {
+			for (unsigned p = 0; p < objs[o].count; ++p) {
+				struct patch_desc *patch = objs[o].items + p;
+
+				if ((uint64_t)patch->return_address !=
+				    ret_addrs[ra_idx])
+					continue;
+
+				if (types[ra_idx] >= 0 ?
+				    patch->syscall_num >= 0 :
+				    patch->syscall_num == types[ra_idx])
+					return patch;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The new way: the index of the patch is known, only check its bounds.
+ */
+static struct patch_desc *
+site_lookup(const struct keys *k)
+{
+	if (k->site_idx >= sites_count)
+		return NULL;
+
+	return sites[k->site_idx];
+}
+
+/*
+ * Objects are laid out like shared libraries, every one in its own
+ * address range, with patches a few hundred bytes apart.
+ */
+static void
+make_objs(unsigned count, unsigned patches_per_obj)
+{
+	objs = calloc(count, sizeof(*objs));
+	objs_count = count;
+	sites = calloc((size_t)count * patches_per_obj, sizeof(*sites));
+	sites_count = 0;
+
+	for (unsigned o = 0; o < count; ++o) {
+		uintptr_t addr = 0x7f0000000000 + (uintptr_t)o * 0x1000000;
+
+		objs[o].count = patches_per_obj;
+		objs[o].items = calloc(patches_per_obj,
+					sizeof(*objs[o].items));
+
+		for (unsigned p = 0; p < patches_per_obj; ++p) {
+			struct patch_desc *patch = objs[o].items + p;
+
+			addr += 0x100 + (rand() % 0x400) * 2;
+			patch->return_address = (const uint8_t *)addr;
+			patch->syscall_num = (int16_t)(p % 3) - 2;
+			patch->site_idx = sites_count;
+			sites[sites_count++] = patch;
+		}
+	}
+}
+
+static void
+free_objs(void)
+{
+	for (unsigned o = 0; o < objs_count; ++o)
+		free(objs[o].items);
+	free(objs);
+	free(sites);
+}
+
+/*
+ * Fill in the three candidates the same way asm_entry_point would see
+ * them: the ones not belonging to the patch hold some other value.
+ */
+static void
+make_keys(struct keys *keys, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		unsigned o = (unsigned)rand() % objs_count;
+		struct patch_desc *patch =
+			objs[o].items + (unsigned)rand() % objs[o].count;
+		uint64_t ra = (uint64_t)patch->return_address;
+		uint64_t junk = (uint64_t)rand();
+
+		keys[i].mid = patch->syscall_num == TYPE_MID ? ra : junk;
+		keys[i].sml = patch->syscall_num >= 0 ? ra : junk;
+		keys[i].gw = patch->syscall_num == TYPE_GW ? ra : junk;
+		keys[i].site_idx = patch->site_idx;
+	}
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const unsigned objs_counts[] = {1, 10, 100};
+	unsigned patches = DEFAULT_PATCHES;
+	struct keys *keys = malloc(LOOKUPS * sizeof(*keys));
+
+	if (argc > 1)
+		patches = (unsigned)atoi(argv[1]);
+
+	if (keys == NULL || patches == 0)
+		return 1;
+
+	srand(1);
+
+	printf("%8s %8s %14s %14s\n",
+		"objects", "patches", "scan ns/call", "sites ns/call");
+
+	for (size_t i = 0; i < sizeof(objs_counts) / sizeof(*objs_counts);
+			++i) {
+		uintptr_t sink = 0;
+		double start, scan_ns, sites_ns;
+
+		make_objs(objs_counts[i], patches);
+		make_keys(keys, LOOKUPS);
+
+		start = now_ns();
+		for (size_t k = 0; k < LOOKUPS; ++k)
+			sink += (uintptr_t)scan_lookup(keys + k);
+		scan_ns = (now_ns() - start) / LOOKUPS;
+
+		start = now_ns();
+		for (size_t k = 0; k < LOOKUPS; ++k)
+			sink -= (uintptr_t)site_lookup(keys + k);
+		sites_ns = (now_ns() - start) / LOOKUPS;
+
+		/* both must have found the very same patches */
+		if (sink != 0) {
+			fprintf(stderr, "scan and site lookups differ\n");
+			return 1;
+		}
+
+		printf("%8u %8u %14.1f %14.1f\n", objs_count,
+			objs_count * patches, scan_ns, sites_ns);
+
+		free_objs();
+	}
+
+	free(keys);
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * thread_storm.c -- cost of creating threads
+ *
+ * Starts a few creator threads, each of them creates and joins short-lived
+ * threads in a loop, and prints the average time of one thread. Every
+ * pthread_create goes through the clone path of asm_entry_point, run it
+ * once plainly and once with LD_PRELOAD pointing to libsyscall_intercept.so
+ * to see the overhead, and with a growing number of creators to see how it
+ * scales.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_CREATORS 4L
+#define DEFAULT_THREADS 10000L
+
+static long threads_per_creator = DEFAULT_THREADS;
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void *
+worker(void *arg)
+{
+	return arg;
+}
+
+static void *
+creator(void *arg)
+{
+	for (long i = 0; i < threads_per_creator; ++i) {
+		pthread_t t;
+
+		if (pthread_create(&t, NULL, worker, NULL) != 0) {
+			fputs("pthread_create failed\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_join(t, NULL);
+	}
+
+	return arg;
+}
+
+int
+main(int argc, char **argv)
+{
+	long creators = DEFAULT_CREATORS;
+
+	if (argc > 1)
+		creators = atol(argv[1]);
+	if (argc > 2)
+		threads_per_creator = atol(argv[2]);
+
+	if (creators <= 0 || threads_per_creator <= 0) {
+		fprintf(stderr, "usage: %s [creators] [threads per creator]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	pthread_t *t = calloc((size_t)creators, sizeof(*t));
+	if (t == NULL)
+		return EXIT_FAILURE;
+
+	double start = now_ns();
+
+	for (long i = 0; i < creators; ++i) {
+		if (pthread_create(&t[i], NULL, creator, NULL) != 0) {
+			fputs("pthread_create failed\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (long i = 0; i < creators; ++i)
+		pthread_join(t[i], NULL);
+
+	double end = now_ns();
+
+	long total = creators * threads_per_creator;
+
+	printf("thread_storm: %ld creators, %ld threads, %.1f ns/thread\n",
+		creators, total, (end - start) / (double)total);
+
+	free(t);
+
+	return EXIT_SUCCESS;
+}
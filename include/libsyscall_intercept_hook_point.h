@@ -33,6 +33,7 @@
 #ifndef LIBSYSCALL_INTERCEPT_HOOK_POINT_H
 #define LIBSYSCALL_INTERCEPT_HOOK_POINT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /*
@@ -64,9 +65,92 @@ extern int (*intercept_hook_point)(long syscall_number,
 			long arg4, long arg5,
 			long *result);
 
+/*
+ * struct intercept_ctx - the syscall being intercepted, passed to
+ * intercept_hook_ctx. It points to the registers saved on the stack by
+ * libsyscall_intercept, thus it is only valid during the hook call.
+ *
+ * args, a6 and nr hold the registers a0-a7, changing them changes the
+ * syscall executed after the hook. When the hook takes over the syscall,
+ * args[0] and args[1] are the results (a0/a1) returned to libc.
+ * site_id identifies the patched syscall instruction, lib is the path of
+ * the object containing it. timestamp is the time counter (rdtime) read
+ * right before the hook call. user is a pointer kept per thread for the
+ * hook, NULL in a new thread, the value stored to it is passed back with
+ * the next syscall of the same thread.
+ */
+struct intercept_ctx {
+	long args[6];
+	long a6;
+	long nr;
+	long site_id;
+	const char *lib;
+	uint64_t timestamp;
+	void *user;
+};
+
+/*
+ * intercept_hook_ctx - an alternative to intercept_hook_point, called
+ * instead of it when set. The return value has the same meaning.
+ */
+extern int (*intercept_hook_ctx)(struct intercept_ctx *ctx);
+
+/*
+ * intercept_register_syscall_hook - set a hook for the syscall number nr
+ *
+ * The hook is called with the user pointer given here, and only for the
+ * syscall nr, before intercept_hook_ctx/intercept_hook_point. The return value
+ * has the same meaning as theirs, a non-zero value passes the syscall on to
+ * them. A syscall with a registered hook always reaches it, even if it is not
+ * selected by intercept_set_syscall_mask, thus an empty mask leaves only the
+ * registered syscalls to the hooks. A NULL fn removes the hook of nr.
+ * Registering again replaces the hook, other threads might still call the
+ * previous one in the meantime.
+ * Returns 0 on success, -1 if nr is out of range (more than 511).
+ */
+typedef int (*intercept_syscall_hook_fn)(struct intercept_ctx *ctx,
+					void *user);
+
+int intercept_register_syscall_hook(long nr, intercept_syscall_hook_fn fn,
+					void *user);
+
+/*
+ * intercept_add_hook - add a hook to the hook chain
+ *
+ * The hooks of the chain are called for every syscall, with their user
+ * pointer, after the hook registered for the syscall number and before
+ * intercept_hook_ctx/intercept_hook_point. They are called in increasing
+ * order of priority, and in the order they were added for the same priority.
+ * A hook can pass the syscall to the next one (non-zero return value), take
+ * it over (zero, the rest are not called), or rewrite it in ctx and pass.
+ * Hooks can be added and removed at any time, from any thread, without
+ * stopping the threads in the middle of a syscall: those keep using the
+ * chain they started with.
+ * Returns 0 on success, -1 if fn is NULL.
+ */
+int intercept_add_hook(intercept_syscall_hook_fn fn, void *user, int priority);
+
+/*
+ * intercept_remove_hook - remove a hook added with the same fn and user
+ * Returns 0 on success, -1 if there is no such hook.
+ */
+int intercept_remove_hook(intercept_syscall_hook_fn fn, void *user);
+
 extern void (*intercept_hook_point_clone_child)(void);
 extern void (*intercept_hook_point_clone_parent)(long pid);
 
+/*
+ * intercept_hook_point_post - called after libsyscall_intercept executed a
+ * syscall the hook let through (or every syscall, if there is no
+ * intercept_hook_point), with the syscall number, its arguments, the result
+ * stored in a0, and the duration of the syscall in ticks of the RISC-V time
+ * counter (rdtime). For clones creating a thread with a separate stack, it is
+ * called in both threads and cycles is zero. Not called for the syscalls the
+ * hook took over, nor for SYS_rt_sigreturn.
+ */
+extern void (*intercept_hook_point_post)(long syscall_number,
+			const long args[6], long result, uint64_t cycles);
+
 /*
  * syscall_no_intercept - syscall without interception
  *
@@ -94,6 +178,39 @@ syscall_error_code(long result)
 	return 0;
 }
 
+/*
+ * intercept_set_syscall_mask - select the syscalls passed to the hooks
+ *
+ * Bit N of the bitmap (bitmap[N / 64] >> (N % 64) & 1) set means syscall
+ * number N is passed to intercept_hook_point, the first nbits bits are used.
+ * Any other syscall is executed directly, without calling any hook and
+ * without logging it, which is much cheaper. The clone syscalls are always
+ * passed to the hooks. A NULL bitmap passes every syscall to the hooks again.
+ * That is also the default, unless the hooks of intercept_register_syscall_hook
+ * are the only hooks in use (no hook pointer assigned, no hook chain, no log)
+ * when one is registered: then only their syscalls are passed. A client
+ * assigning a hook pointer after that calls this with a NULL bitmap. Can be
+ * called at any time, even before syscall_intercept is initialized.
+ */
+void intercept_set_syscall_mask(const uint64_t *bitmap, size_t nbits);
+
+/*
+ * intercept_set_patch_syscall_mask - select the syscalls to patch
+ *
+ * The same bitmap as above, but used while hotpatching: syscall instructions
+ * with a statically known syscall number that is not selected are left
+ * untouched, thus cost nothing. Syscall instructions with a syscall number
+ * known only at runtime are patched, and filtered by the same bitmap set
+ * with intercept_set_syscall_mask. See also the INTERCEPT_SYSCALLS and
+ * INTERCEPT_SKIP_SYSCALLS environment variables.
+ *
+ * Has to be called before syscall_intercept patches the process, e.g. from
+ * .preinit_array of an executable, or from a constructor with a priority
+ * (__attribute__((constructor(101)))) in an object linked with the static
+ * syscall_intercept library. Returns 0 on success, -1 if it is too late.
+ */
+int intercept_set_patch_syscall_mask(const uint64_t *bitmap, size_t nbits);
+
 /*
  * The syscall intercepting library checks for the
  * INTERCEPT_HOOK_CMDLINE_FILTER environment variable, with which one can
@@ -0,0 +1,589 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * analysis_cache.c -- the results of find_syscalls() stored on disk
+ *
+ * Finding the syscalls of an object means reading its ELF tables and
+ * disassembling its whole text section, in every process. With the
+ * INTERCEPT_CACHE_DIR environment variable set, the results are stored in
+ * that directory, one file per object, and the next process using the same
+ * object only reads them back.
+ *
+ * A cache file is identified by the device, inode, size and modification
+ * time of the object, a changed object is simply a miss. Addresses are
+ * stored relative to the base address of the object. Besides the
+ * surrounding instructions of each syscall, only the jump destinations
+ * among them are stored, as nothing else of the jump table is used by
+ * prepare_patches(). The relocated instructions are not stored, they depend on
+ * where the trampoline and syscall_intercept itself are mapped, and
+ * generating them is cheap.
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "analysis_cache.h"
+#include "intercept.h"
+#include "disasm_wrapper.h"
+#include "intercept_util.h"
+#include "rv_decode.h"
+
+/*
+ * For simplicity, declare syscall_no_intercept() with return value 'long'
+ * because nothing in this TU needs the a1 register, only a0 is checked.
+ */
+extern long
+syscall_no_intercept(long syscall_number, ...);
+
+/* bump this when the layout or the meaning of anything below changes */
+#define CACHE_VERSION	4
+
+#define CACHE_NULL	UINT64_MAX
+
+enum cache_instr_flags {
+	CACHE_IS_SET = 1 << 0,
+	CACHE_IS_SYSCALL = 1 << 1,
+	CACHE_HAS_IP_RELATIVE_OPR = 1 << 2,
+	CACHE_IS_ABS_JUMP = 1 << 3,
+	CACHE_IS_A7_MODIFIED = 1 << 4,
+	CACHE_IS_JUMP_DESTINATION = 1 << 5
+};
+
+struct cache_instr {
+	/* offsets from base_addr, or CACHE_NULL */
+	uint64_t address;
+	uint64_t rip_ref_addr;
+	int32_t rip_disp;
+	uint32_t length;
+	uint32_t regs_read;
+	uint32_t regs_written;
+	int16_t a7_set;
+	uint8_t reg_set;
+	uint8_t flags;
+	char mnemonic[16];
+};
+
+struct cache_patch {
+	uint32_t syscall_idx;
+	uint32_t reserved;
+	struct cache_instr instrs[SURROUNDING_INSTRS_NUM];
+};
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+
+	/* the key, see cache_key_matches() */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_sec;
+	uint64_t mtime_nsec;
+
+	/* the text section */
+	uint64_t text_offset;
+	uint64_t text_addr;
+	uint64_t text_size;
+
+	/* the stub islands in the padding follow the patches, as offsets */
+	uint32_t island_count;
+	uint32_t reserved;
+};
+
+static const char cache_magic[8] = "SCICACHE";
+
+/*
+ * get_cache_path - the path of the cache file of the object opened as fd,
+ * the key is part of the name as well. Returns false without a cache dir.
+ */
+static bool
+get_cache_path(const struct intercept_desc *desc, int fd,
+		struct cache_header *header, char *path, size_t size)
+{
+	const char *dir = getenv("INTERCEPT_CACHE_DIR");
+	struct stat st;
+
+	if (dir == NULL || dir[0] == '\0')
+		return false;
+
+	if (syscall_no_intercept(SYS_fstat, fd, &st) != 0)
+		return false;
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, cache_magic, sizeof(header->magic));
+	header->version = CACHE_VERSION;
+	header->dev = (uint64_t)st.st_dev;
+	header->ino = (uint64_t)st.st_ino;
+	header->size = (uint64_t)st.st_size;
+	header->mtime_sec = (uint64_t)st.st_mtim.tv_sec;
+	header->mtime_nsec = (uint64_t)st.st_mtim.tv_nsec;
+
+	const char *name = strrchr(desc->path, '/');
+	name = (name == NULL) ? desc->path : name + 1;
+
+	int len = snprintf_no_intercept(path, size,
+			"%s/%s-%lx-%lx-%lx-%lx.%lx", dir, name,
+			(unsigned long)header->dev, (unsigned long)header->ino,
+			(unsigned long)header->size,
+			(unsigned long)header->mtime_sec,
+			(unsigned long)header->mtime_nsec);
+
+	return len > 0 && (size_t)len < size;
+}
+
+static bool
+cache_key_matches(const struct cache_header *a, const struct cache_header *b)
+{
+	return memcmp(a->magic, b->magic, sizeof(a->magic)) == 0 &&
+		a->version == b->version &&
+		a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+static bool
+read_all(int fd, void *buffer, size_t size)
+{
+	while (size > 0) {
+		long r = syscall_no_intercept(SYS_read, fd, buffer, size);
+
+		if (r <= 0)
+			return false;
+
+		buffer = (char *)buffer + r;
+		size -= (size_t)r;
+	}
+
+	return true;
+}
+
+static bool
+write_all(int fd, const void *buffer, size_t size)
+{
+	while (size > 0) {
+		long r = syscall_no_intercept(SYS_write, fd, buffer, size);
+
+		if (r <= 0)
+			return false;
+
+		buffer = (const char *)buffer + r;
+		size -= (size_t)r;
+	}
+
+	return true;
+}
+
+static uint64_t
+to_offset(const struct intercept_desc *desc, const unsigned char *address)
+{
+	if (address == NULL)
+		return CACHE_NULL;
+
+	return (uint64_t)(address - desc->base_addr);
+}
+
+static const unsigned char *
+from_offset(const struct intercept_desc *desc, uint64_t offset)
+{
+	if (offset == CACHE_NULL)
+		return NULL;
+
+	return desc->base_addr + offset;
+}
+
+static void
+store_instr(const struct intercept_desc *desc, struct cache_instr *dst,
+		const struct intercept_disasm_result *src)
+{
+	memset(dst, 0, sizeof(*dst));
+
+	dst->address = to_offset(desc, src->address);
+	dst->rip_ref_addr = to_offset(desc, src->rip_ref_addr);
+	dst->rip_disp = src->rip_disp;
+	dst->length = src->length;
+	dst->regs_read = src->regs_read;
+	dst->regs_written = src->regs_written;
+	dst->a7_set = src->a7_set;
+	dst->reg_set = src->reg_set;
+
+	if (src->is_set)
+		dst->flags |= CACHE_IS_SET;
+	if (src->is_syscall)
+		dst->flags |= CACHE_IS_SYSCALL;
+	if (src->has_ip_relative_opr)
+		dst->flags |= CACHE_HAS_IP_RELATIVE_OPR;
+	if (src->is_abs_jump)
+		dst->flags |= CACHE_IS_ABS_JUMP;
+	if (src->is_a7_modified)
+		dst->flags |= CACHE_IS_A7_MODIFIED;
+	if (src->address != NULL && has_jump(desc, src->address))
+		dst->flags |= CACHE_IS_JUMP_DESTINATION;
+
+#ifndef NDEBUG
+	memcpy(dst->mnemonic, src->mnemonic, sizeof(dst->mnemonic));
+#endif
+}
+
+static void
+load_instr(const struct intercept_desc *desc,
+		struct intercept_disasm_result *dst, const struct cache_instr *src)
+{
+	memset(dst, 0, sizeof(*dst));
+
+	dst->address = from_offset(desc, src->address);
+	dst->rip_ref_addr = from_offset(desc, src->rip_ref_addr);
+	dst->rip_disp = src->rip_disp;
+	dst->length = src->length;
+	dst->regs_read = src->regs_read;
+	dst->regs_written = src->regs_written;
+	dst->a7_set = src->a7_set;
+	dst->reg_set = src->reg_set;
+	dst->is_set = (src->flags & CACHE_IS_SET) != 0;
+	dst->is_syscall = (src->flags & CACHE_IS_SYSCALL) != 0;
+	dst->has_ip_relative_opr = (src->flags & CACHE_HAS_IP_RELATIVE_OPR) != 0;
+	dst->is_abs_jump = (src->flags & CACHE_IS_ABS_JUMP) != 0;
+	dst->is_a7_modified = (src->flags & CACHE_IS_A7_MODIFIED) != 0;
+
+#ifndef NDEBUG
+	memcpy(dst->mnemonic, src->mnemonic, sizeof(dst->mnemonic));
+	dst->mnemonic[sizeof(dst->mnemonic) - 1] = '\0';
+#endif
+}
+
+/*
+ * The addresses in a cache file decide where jumps are written into the
+ * text, so nothing in it is trusted: a file rewritten in place can keep
+ * the key, or two keys can collide. Everything is checked against the
+ * loaded object before any of it is used, and any mismatch is a miss.
+ */
+
+/*
+ * check_text - the text section must be in the executable segment, at the
+ * same offset from its start in memory as in the file
+ */
+static bool
+check_text(const struct intercept_desc *desc, const struct cache_header *header)
+{
+	for (Elf64_Half i = 0; i < desc->phnum; ++i) {
+		const Elf64_Phdr *segment = desc->phdrs + i;
+
+		if (segment->p_type != PT_LOAD ||
+		    (segment->p_flags & PF_X) == 0)
+			continue;
+
+		if (header->text_addr >= segment->p_vaddr &&
+		    header->text_size <= segment->p_filesz &&
+		    header->text_addr - segment->p_vaddr <=
+		    segment->p_filesz - header->text_size &&
+		    header->text_offset - segment->p_offset ==
+		    header->text_addr - segment->p_vaddr)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * check_instrs - the instructions around a syscall must be in the text, in
+ * order, decode to what is cached about them, and the syscall must be an
+ * ecall.
+ */
+static bool
+check_instrs(const struct intercept_disasm_result *surr, uint32_t syscall_idx,
+		const unsigned char *text_start, const unsigned char *text_end)
+{
+	const unsigned char *next = text_start;
+
+	if (syscall_idx >= SURROUNDING_INSTRS_NUM ||
+	    !surr[syscall_idx].is_set || !surr[syscall_idx].is_syscall)
+		return false;
+
+	for (unsigned i = 0; i < SURROUNDING_INSTRS_NUM; ++i) {
+		const struct intercept_disasm_result *ins = surr + i;
+		struct intercept_disasm_result decoded = {
+			.address = ins->address,
+			.a7_set = -1
+		};
+
+		if (!ins->is_set)
+			continue;
+
+		if (ins->address < next || ins->address > text_end)
+			return false;
+
+		if (rv_decode(&decoded, ins->address,
+				(size_t)(text_end - ins->address + 1)) == 0)
+			return false;
+
+		if (decoded.length != ins->length ||
+		    decoded.is_syscall != ins->is_syscall ||
+		    decoded.has_ip_relative_opr != ins->has_ip_relative_opr ||
+		    decoded.is_abs_jump != ins->is_abs_jump ||
+		    decoded.rip_disp != ins->rip_disp ||
+		    decoded.rip_ref_addr != ins->rip_ref_addr ||
+		    decoded.a7_set != ins->a7_set ||
+		    decoded.is_a7_modified != ins->is_a7_modified ||
+		    decoded.reg_set != ins->reg_set ||
+		    decoded.regs_read != ins->regs_read ||
+		    decoded.regs_written != ins->regs_written)
+			return false;
+
+		next = ins->address + ins->length;
+	}
+
+	return true;
+}
+
+/*
+ * is_padding - an island found in the padding starts with a run of nops or
+ * c.nops, see add_padding_island() in intercept_desc.c. The last one may
+ * end after the island.
+ */
+static bool
+is_padding(const unsigned char *address, const unsigned char *end,
+		const unsigned char *text_end)
+{
+	while (address < end) {
+		if (text_end - address >= RVC_INS_SIZE - 1 &&
+		    address[0] == 0x01 && address[1] == 0x00)
+			address += RVC_INS_SIZE;
+		else if (text_end - address >= RV_INS_SIZE - 1 &&
+		    address[0] == 0x13 && address[1] == 0x00 &&
+		    address[2] == 0x00 && address[3] == 0x00)
+			address += RV_INS_SIZE;
+		else
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * check_records - every record, and every island of a cache file read into
+ * memory
+ */
+static bool
+check_records(const struct intercept_desc *desc,
+		const struct cache_header *header,
+		const struct cache_patch *records, const uint64_t *islands)
+{
+	const unsigned char *text_start = desc->base_addr + header->text_addr;
+	const unsigned char *text_end = text_start + header->text_size - 1;
+
+	for (uint32_t i = 0; i < header->count; ++i) {
+		struct intercept_disasm_result surr[SURROUNDING_INSTRS_NUM];
+
+		for (unsigned j = 0; j < SURROUNDING_INSTRS_NUM; ++j)
+			load_instr(desc, surr + j, records[i].instrs + j);
+
+		if (!check_instrs(surr, records[i].syscall_idx,
+				text_start, text_end))
+			return false;
+	}
+
+	for (uint32_t i = 0; i < header->island_count; ++i) {
+		if (islands[i] < header->text_addr ||
+		    islands[i] - header->text_addr > header->text_size ||
+		    header->text_size - (islands[i] - header->text_addr) <
+		    ISLAND_SIZE + 1)
+			return false;
+
+		const unsigned char *island = desc->base_addr + islands[i];
+
+		if (!is_padding(island, island + ISLAND_SIZE, text_end))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * load_analysis_cache - see analysis_cache.h
+ *
+ * The whole file is read and checked first, desc is only filled in on a hit.
+ */
+bool
+load_analysis_cache(struct intercept_desc *desc, int fd)
+{
+	struct cache_header key;
+	struct cache_header header;
+	char path[0x1000];
+
+	if (!get_cache_path(desc, fd, &key, path, sizeof(path)))
+		return false;
+
+	int cache_fd = (int)syscall_no_intercept(SYS_openat, AT_FDCWD, path,
+							O_RDONLY | O_CLOEXEC);
+	if (cache_fd < 0)
+		return false;
+
+	struct stat st;
+	size_t records_size = 0;
+	size_t body_size = 0;
+	bool is_hit = read_all(cache_fd, &header, sizeof(header)) &&
+			cache_key_matches(&header, &key) &&
+			header.text_size != 0 &&
+			syscall_no_intercept(SYS_fstat, cache_fd, &st) == 0;
+
+	if (is_hit) {
+		records_size = header.count * sizeof(struct cache_patch);
+		body_size = records_size +
+			header.island_count * sizeof(uint64_t);
+		is_hit = (uint64_t)st.st_size == sizeof(header) + body_size &&
+			check_text(desc, &header);
+	}
+
+	void *body = NULL;
+
+	if (is_hit && body_size != 0) {
+		body = xmmap_anon(body_size);
+		is_hit = read_all(cache_fd, body, body_size);
+	}
+
+	syscall_no_intercept(SYS_close, cache_fd);
+
+	const struct cache_patch *records = body;
+	const uint64_t *islands =
+		(const uint64_t *)((const char *)body + records_size);
+
+	if (is_hit)
+		is_hit = check_records(desc, &header, records, islands);
+
+	if (is_hit) {
+		desc->text_offset = header.text_offset;
+		desc->text_start = desc->base_addr + header.text_addr;
+		desc->text_end = desc->text_start + header.text_size - 1;
+		allocate_jump_table(desc);
+	}
+
+	for (uint32_t i = 0; is_hit && i < header.count; ++i) {
+		struct intercept_disasm_result surr[SURROUNDING_INSTRS_NUM];
+
+		for (unsigned j = 0; j < SURROUNDING_INSTRS_NUM; ++j) {
+			load_instr(desc, surr + j, records[i].instrs + j);
+
+			if (records[i].instrs[j].flags &
+			    CACHE_IS_JUMP_DESTINATION)
+				mark_jump(desc, surr[j].address);
+		}
+
+		fill_up_patch(desc, add_new_patch(desc), surr,
+				(uint8_t)records[i].syscall_idx);
+	}
+
+	for (uint32_t i = 0; is_hit && i < header.island_count; ++i) {
+		uint8_t *island = desc->base_addr + islands[i];
+
+		mark_jump(desc, island);
+		add_island(desc, island);
+	}
+
+	if (body != NULL)
+		xmunmap(body, body_size);
+
+	debug_dump("analysis cache %s: %s\n", is_hit ? "hit" : "miss", path);
+
+	return is_hit;
+}
+
+/*
+ * store_analysis_cache - see analysis_cache.h
+ */
+void
+store_analysis_cache(const struct intercept_desc *desc, int fd)
+{
+	struct cache_header header;
+	char path[0x1000];
+	char tmp_path[0x1000 + 0x20];
+
+	if (!get_cache_path(desc, fd, &header, path, sizeof(path)))
+		return;
+
+	header.count = desc->count;
+	header.text_offset = desc->text_offset;
+	header.text_addr = (uint64_t)(desc->text_start - desc->base_addr);
+	header.text_size = (uint64_t)(desc->text_end - desc->text_start + 1);
+
+	for (const struct stub_island *island = desc->islands; island != NULL;
+	    island = island->next)
+		++header.island_count;
+
+	/* written under a unique name, then renamed, readers see whole files */
+	snprintf_no_intercept(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path,
+			syscall_no_intercept(SYS_getpid));
+
+	int cache_fd = (int)syscall_no_intercept(SYS_openat, AT_FDCWD, tmp_path,
+				O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (cache_fd < 0)
+		return;
+
+	bool ok = write_all(cache_fd, &header, sizeof(header));
+
+	for (unsigned i = 0; ok && i < desc->count; ++i) {
+		const struct patch_desc *patch = desc->items + i;
+		struct cache_patch record = {.syscall_idx = patch->syscall_idx};
+
+		for (unsigned j = 0; j < SURROUNDING_INSTRS_NUM; ++j)
+			store_instr(desc, record.instrs + j,
+					patch->surrounding_instrs + j);
+
+		ok = write_all(cache_fd, &record, sizeof(record));
+	}
+
+	for (const struct stub_island *island = desc->islands;
+	    ok && island != NULL; island = island->next) {
+		uint64_t offset =
+			(uint64_t)(island->gw.dst_jmp_patch - desc->base_addr);
+
+		ok = write_all(cache_fd, &offset, sizeof(offset));
+	}
+
+	syscall_no_intercept(SYS_close, cache_fd);
+
+	if (ok)
+		ok = syscall_no_intercept(SYS_renameat2, AT_FDCWD, tmp_path,
+						AT_FDCWD, path, 0) == 0;
+
+	if (!ok)
+		syscall_no_intercept(SYS_unlinkat, AT_FDCWD, tmp_path, 0);
+
+	debug_dump("analysis cache %s: %s\n", ok ? "stored" : "not stored",
+			path);
+}
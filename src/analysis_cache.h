@@ -0,0 +1,60 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * analysis_cache.h - the results of find_syscalls() stored on disk, see
+ * INTERCEPT_CACHE_DIR
+ */
+
+#ifndef INTERCEPT_ANALYSIS_CACHE_H
+#define INTERCEPT_ANALYSIS_CACHE_H
+
+#include <stdbool.h>
+
+struct intercept_desc;
+
+/*
+ * load_analysis_cache - fill in desc from the cache, fd is the object file
+ *
+ * On a hit, the text section, the patches and the jump table are ready for
+ * prepare_patches(), as if find_syscalls() did all its work. Returns false
+ * on a miss, or without INTERCEPT_CACHE_DIR, desc is left untouched then.
+ */
+bool load_analysis_cache(struct intercept_desc *desc, int fd);
+
+/*
+ * store_analysis_cache - store the results of find_syscalls() in the cache
+ * Failing to store them is not an error, the next process tries again.
+ */
+void store_analysis_cache(const struct intercept_desc *desc, int fd);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * analysis_workers.c -- finding the syscalls of the loaded objects on
+ * several threads
+ *
+ * With INTERCEPT_ALL_OBJS, a process can have a hundred or more objects to
+ * analyze, and the analysis of one object does not depend on the others:
+ * find_syscalls() and prepare_patches() write nothing but the object's own
+ * intercept_desc. The objects are handed out one by one to a few threads,
+ * relocating and activating the patches stays serial in intercept().
+ *
+ * The workers are raw clones (clone_worker in util.S) that share the TLS of
+ * the thread running the constructor, thus the analysis must not call libc
+ * functions that use TLS, e.g. malloc. They run with all signals blocked.
+ * The debug output and the messages of the analysis are formatted with
+ * snprintf_no_intercept() for the same reason.
+ * Capstone allocates with malloc, so when it cross-checks the decoder
+ * (USE_CAPSTONE), the objects are analyzed on the calling thread only.
+ */
+
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "analysis_workers.h"
+#include "intercept.h"
+#include "intercept_stats.h"
+#include "intercept_util.h"
+#include "libsyscall_intercept_hook_point.h"
+
+/*
+ * The analysis keeps nothing big on the stack, the ELF tables are parsed
+ * in the mapped object file (intercept_desc.c).
+ */
+#define WORKER_STACK_SIZE ((size_t)0x40000)
+
+long clone_worker(void *stack_top, int *child_tid,
+		void (*fn)(void *), void *arg);
+
+struct analysis_job {
+	struct intercept_desc *objs;
+	unsigned count;
+
+	/* the next object to analyze, taken by any of the threads */
+	unsigned next;
+};
+
+struct analysis_worker {
+	/* set by the kernel when started, cleared when it exits */
+	int tid;
+	void *stack;
+};
+
+/*
+ * analyze_next_objects -- the loop of each thread, until no object is left
+ */
+static void
+analyze_next_objects(void *arg)
+{
+	struct analysis_job *job = arg;
+	unsigned i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	    job->count) {
+		find_syscalls(job->objs + i);
+
+		uint64_t start = intercept_stats_time();
+		prepare_patches(job->objs + i);
+		intercept_stats_phase(STATS_PREPARE_PATCHES, start);
+	}
+}
+
+/*
+ * get_thread_count -- the number of threads analyzing the objects,
+ * including the calling one
+ */
+static unsigned
+get_thread_count(unsigned objs_count)
+{
+#ifdef USE_CAPSTONE
+	(void) objs_count;
+	return 1;
+#else
+	const char *e = getenv("INTERCEPT_ANALYSIS_THREADS");
+	long count;
+
+	if (e != NULL)
+		count = atol(e);
+	else
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (count < 1)
+		count = 1;
+
+	if ((unsigned long)count > objs_count)
+		count = objs_count;
+
+	return (unsigned)count;
+#endif
+}
+
+/*
+ * join_worker -- wait for the kernel to clear the tid of the worker
+ */
+static void
+join_worker(struct analysis_worker *worker)
+{
+	int tid;
+
+	while ((tid = __atomic_load_n(&worker->tid, __ATOMIC_ACQUIRE)) != 0)
+		syscall_no_intercept(SYS_futex, &worker->tid, FUTEX_WAIT,
+					tid, NULL);
+
+	xmunmap(worker->stack, WORKER_STACK_SIZE);
+}
+
+void
+analyze_objects(struct intercept_desc *objs, unsigned count)
+{
+	struct analysis_job job = {
+		.objs = objs,
+		.count = count,
+		.next = 0
+	};
+	unsigned thread_count = get_thread_count(count);
+	struct analysis_worker *workers;
+
+	if (thread_count <= 1) {
+		analyze_next_objects(&job);
+		return;
+	}
+
+	size_t workers_size = (thread_count - 1) * sizeof(*workers);
+	unsigned started = 0;
+
+	workers = xmmap_anon(workers_size);
+
+	/* the workers inherit the blocked signals */
+	uint64_t all_signals = ~(uint64_t)0;
+	uint64_t orig_signals;
+
+	syscall_no_intercept(SYS_rt_sigprocmask, SIG_SETMASK, &all_signals,
+				&orig_signals, sizeof(all_signals));
+
+	while (started < thread_count - 1) {
+		struct analysis_worker *worker = workers + started;
+
+		worker->stack = xmmap_anon(WORKER_STACK_SIZE);
+
+		char *stack_top = (char *)worker->stack + WORKER_STACK_SIZE;
+		long tid = clone_worker(stack_top, &worker->tid,
+					analyze_next_objects, &job);
+
+		if (syscall_error_code(tid) != 0) {
+			/* fewer threads do the same work */
+			xmunmap(worker->stack, WORKER_STACK_SIZE);
+			break;
+		}
+
+		++started;
+	}
+
+	syscall_no_intercept(SYS_rt_sigprocmask, SIG_SETMASK,
+				&orig_signals, NULL, sizeof(orig_signals));
+
+	analyze_next_objects(&job);
+
+	for (unsigned i = 0; i < started; ++i)
+		join_worker(workers + i);
+
+	xmunmap(workers, workers_size);
+
+	debug_dump("analyzed %u objects on %u threads\n", count, started + 1);
+}
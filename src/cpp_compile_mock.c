@@ -47,6 +47,11 @@ int (*intercept_hook_point)(long syscall_number,
 			long arg4, long arg5,
 			long *result);
 
+int (*intercept_hook_ctx)(struct intercept_ctx *ctx);
+
+void (*intercept_hook_point_post)(long syscall_number,
+			const long args[6], long result, uint64_t cycles);
+
 struct wrapper_ret
 syscall_no_intercept(long syscall_number, ...)
 {
@@ -59,3 +64,45 @@ syscall_hook_in_process_allowed(void)
 {
 	return 0;
 }
+
+void
+intercept_set_syscall_mask(const uint64_t *bitmap, size_t nbits)
+{
+	(void) bitmap;
+	(void) nbits;
+}
+
+int
+intercept_set_patch_syscall_mask(const uint64_t *bitmap, size_t nbits)
+{
+	(void) bitmap;
+	(void) nbits;
+	return 0;
+}
+
+int
+intercept_register_syscall_hook(long nr, intercept_syscall_hook_fn fn,
+				void *user)
+{
+	(void) nr;
+	(void) fn;
+	(void) user;
+	return 0;
+}
+
+int
+intercept_add_hook(intercept_syscall_hook_fn fn, void *user, int priority)
+{
+	(void) fn;
+	(void) user;
+	(void) priority;
+	return 0;
+}
+
+int
+intercept_remove_hook(intercept_syscall_hook_fn fn, void *user)
+{
+	(void) fn;
+	(void) user;
+	return 0;
+}
@@ -37,6 +37,13 @@
 int main()
 {
 	intercept_hook_point = nullptr;
+	intercept_hook_ctx = nullptr;
+	intercept_hook_point_post = nullptr;
 	(void) syscall_no_intercept(0);
 	(void) syscall_hook_in_process_allowed();
+	intercept_set_syscall_mask(nullptr, 0);
+	(void) intercept_set_patch_syscall_mask(nullptr, 0);
+	(void) intercept_register_syscall_hook(0, nullptr, nullptr);
+	(void) intercept_add_hook(nullptr, nullptr, 0);
+	(void) intercept_remove_hook(nullptr, nullptr);
 }
@@ -32,29 +32,37 @@
  */
 
 /*
- * disasm_wrapper.c -- connecting the interceptor code
- * to the disassembler code from the capstone project.
+ * disasm_wrapper.c -- connecting the interceptor code to the disassembler.
  *
- * See:
+ * The instructions are decoded by the built-in decoder in rv_decode.c.
+ * When built with USE_CAPSTONE, every instruction is also disassembled by
+ * capstone and any disagreement between the two is reported in the debug
+ * dump. See:
  * http://www.capstone-engine.org/lang_c.html
  */
 
 #include "intercept.h"
 #include "intercept_util.h"
 #include "disasm_wrapper.h"
+#include "rv_decode.h"
 
 #include <assert.h>
 #include <string.h>
 #include <syscall.h>
+#ifdef USE_CAPSTONE
 #include "capstone_wrapper.h"
+#endif
 
 struct intercept_disasm_context {
+#ifdef USE_CAPSTONE
 	csh handle;
 	cs_insn *insn;
+#endif
 	const unsigned char *begin;
 	const unsigned char *end;
 };
 
+#ifdef USE_CAPSTONE
 #ifdef __clang__
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wstrict-prototypes"
@@ -78,23 +86,11 @@ nop_vsnprintf()
 #endif
 
 /*
- * intercept_disasm_init -- should be called before disassembling a region of
- * code. The context created contains the context capstone needs ( or generally
- * the underlying disassembling library, if something other than capstone might
- * be used ).
- *
- * One must pass this context pointer to intercept_disasm_destroy following
- * a disassembling loop.
+ * capstone_init -- sets up capstone for disassembling RV64(C) with details.
  */
-struct intercept_disasm_context *
-intercept_disasm_init(const unsigned char *begin, const unsigned char *end)
+static void
+capstone_init(struct intercept_disasm_context *context)
 {
-	struct intercept_disasm_context *context;
-
-	context = xmmap_anon(sizeof(*context));
-	context->begin = begin;
-	context->end = end;
-
 #ifdef __riscv_c
 	cs_mode disasm_rv = CS_MODE_RISCV64 | CS_MODE_RISCVC;
 #else
@@ -131,19 +127,6 @@ intercept_disasm_init(const unsigned char *begin, const unsigned char *end)
 
 	if ((context->insn = cs_malloc(context->handle)) == NULL)
 		xabort("cs_malloc");
-
-	return context;
-}
-
-/*
- * intercept_disasm_destroy -- see comments for above routine
- */
-void
-intercept_disasm_destroy(struct intercept_disasm_context *context)
-{
-	cs_free(context->insn, 1);
-	cs_close(&context->handle);
-	xmunmap(context, sizeof(*context));
 }
 
 /*
@@ -179,27 +162,6 @@ get_a7(struct intercept_disasm_result *result, struct cs_insn *insn)
 	}
 }
 
-/*
- * In asm_entry_point (intercept_irq_entry.S), ra is being used for jumping
- * back and forth between executing preceding and following instrs, so it
- * gets overwritten. That is why it's important to check if any patched instr
- * uses ra. If they do (currently there is no such case), the original ra value
- * is restored before executing the patched instrs.
- */
-static inline void
-check_ra(struct intercept_disasm_result *result, struct cs_insn *insn)
-{
-	uint8_t op_c = insn->detail->riscv.op_count;
-	cs_riscv_op *ops = insn->detail->riscv.operands;
-
-	for (uint8_t i = 0; i < op_c; ++i) {
-		if (ops[i].type == RISCV_OP_REG && ops[i].reg == RISCV_REG_RA) {
-			result->is_ra_used = true;
-			return;
-		}
-	}
-}
-
 /*
  * This helps only the TYPE_SML patch when there is a register which gets set
  * immediately after ecall. In these situations (which are quite frequent) the
@@ -245,17 +207,15 @@ check_jump(struct intercept_disasm_result *result, struct cs_insn *insn,
 }
 
 /*
- * intercept_disasm_next_instruction - Examines a single instruction
- * in a text section. This is only a wrapper around capstone specific code,
- * collecting data that can be used later to make decisions about patching.
+ * capstone_next_instruction - the same as intercept_disasm_next_instruction,
+ * using capstone instead of the built-in decoder.
  */
-struct intercept_disasm_result
-intercept_disasm_next_instruction(struct intercept_disasm_context *context,
-					const uint8_t *code)
+static struct intercept_disasm_result
+capstone_next_instruction(struct intercept_disasm_context *context,
+				const uint8_t *code)
 {
 	struct intercept_disasm_result result = {
 		.address = code,
-		// syscall can be 0 so set it to -1 initially
 		.a7_set = -1
 	};
 	const unsigned char *start = code;
@@ -269,25 +229,12 @@ intercept_disasm_next_instruction(struct intercept_disasm_context *context,
 
 	result.length = context->insn->size;
 
-	assert(result.length != 0);
-
 	get_a7(&result, context->insn);
-	check_ra(&result, context->insn);
 	check_reg_set(&result, context->insn);
 
-	/*
-	 * auipc could be patched and relocated, but the absolute addr would
-	 * have to be loaded into the register in the relocation space which
-	 * is costly.
-	 * For now just skip it unless it becomes needed in the future...
-	 */
 	result.has_ip_relative_opr = (context->insn->id == RISCV_INS_AUIPC);
 	result.is_syscall = (context->insn->id == RISCV_INS_ECALL);
 
-#ifndef NDEBUG
-	strncpy(result.mnemonic, context->insn->mnemonic,
-		sizeof(result.mnemonic) - 1);
-#endif
 	uint8_t grp_count = context->insn->detail->groups_count;
 	for (uint8_t i = 0; i < grp_count; ++i) {
 		switch (context->insn->detail->groups[i]) {
@@ -305,3 +252,97 @@ grp_done:
 
 	return result;
 }
+
+/*
+ * capstone_cross_check - compares the result of the built-in decoder with
+ * what capstone says about the same instruction. The reg_set member is left
+ * out on purpose, the built-in decoder does not report a register that is
+ * also read by the instruction (e.g. ld a0, 8(a0)), capstone does.
+ */
+static void
+capstone_cross_check(struct intercept_disasm_context *context,
+			const struct intercept_disasm_result *result)
+{
+	struct intercept_disasm_result cs =
+		capstone_next_instruction(context, result->address);
+
+	// capstone knows nothing about e.g. the vector extension
+	if (!cs.is_set)
+		return;
+
+	if (cs.length != result->length ||
+	    cs.is_syscall != result->is_syscall ||
+	    cs.is_abs_jump != result->is_abs_jump ||
+	    cs.has_ip_relative_opr != result->has_ip_relative_opr ||
+	    cs.rip_disp != result->rip_disp ||
+	    cs.a7_set != result->a7_set ||
+	    cs.is_a7_modified != result->is_a7_modified)
+		debug_dump("disasm mismatch at %p: length %u vs %u (capstone)\n",
+			(void *)result->address, result->length, cs.length);
+}
+#endif /* USE_CAPSTONE */
+
+/*
+ * intercept_disasm_init -- should be called before disassembling a region of
+ * code. The context created contains the context capstone needs, when
+ * capstone is used for cross-checking the built-in decoder.
+ *
+ * One must pass this context pointer to intercept_disasm_destroy following
+ * a disassembling loop.
+ */
+struct intercept_disasm_context *
+intercept_disasm_init(const unsigned char *begin, const unsigned char *end)
+{
+	struct intercept_disasm_context *context;
+
+	context = xmmap_anon(sizeof(*context));
+	context->begin = begin;
+	context->end = end;
+
+#ifdef USE_CAPSTONE
+	capstone_init(context);
+#endif
+
+	return context;
+}
+
+/*
+ * intercept_disasm_destroy -- see comments for above routine
+ */
+void
+intercept_disasm_destroy(struct intercept_disasm_context *context)
+{
+#ifdef USE_CAPSTONE
+	cs_free(context->insn, 1);
+	cs_close(&context->handle);
+#endif
+	xmunmap(context, sizeof(*context));
+}
+
+/*
+ * intercept_disasm_next_instruction - Examines a single instruction
+ * in a text section, collecting data that can be used later to make
+ * decisions about patching.
+ */
+struct intercept_disasm_result
+intercept_disasm_next_instruction(struct intercept_disasm_context *context,
+					const uint8_t *code)
+{
+	struct intercept_disasm_result result = {
+		.address = code,
+		// syscall can be 0 so set it to -1 initially
+		.a7_set = -1
+	};
+	size_t size = (size_t)(context->end - code + 1);
+
+	if (rv_decode(&result, code, size) == 0)
+		return result;
+
+	result.is_set = true;
+
+#ifdef USE_CAPSTONE
+	capstone_cross_check(context, &result);
+#endif
+
+	return result;
+}
@@ -71,9 +71,17 @@ struct intercept_disasm_result {
 
 	int16_t a7_set;
 	bool is_a7_modified;
-	bool is_ra_used;
 	uint8_t reg_set;
 
+	/*
+	 * The integer registers read and written, one bit per register
+	 * number. The reads may include registers that are not read, the
+	 * writes only the ones certainly written (a liveness pass relies on
+	 * this, see find_dead_register() in patcher.c).
+	 */
+	uint32_t regs_read;
+	uint32_t regs_written;
+
 #ifndef NDEBUG
 	/*
 	 * Switched to char array instead of pointer because capstone doesn't
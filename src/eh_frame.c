@@ -0,0 +1,483 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * eh_frame.c -- function boundaries and landing pads from the unwind tables
+ *
+ * The symbol tables name only some of the functions of an object: .symtab
+ * is stripped from most libraries, and .dynsym only lists the exported
+ * ones. The unwind tables describe every function compiled with unwind
+ * information, which is the default on Linux, and they are in a loaded
+ * segment, so they are found even when the file can not be read.
+ *
+ * PT_GNU_EH_FRAME points to .eh_frame_hdr, that holds a table of the first
+ * address of each function, and the address of its FDE (Frame Description
+ * Entry) in .eh_frame. The FDE has the size of the function, and when the
+ * function has cleanups, or catches exceptions, the address of its LSDA
+ * (Language Specific Data Area) in .gcc_except_table. The call site table
+ * of the LSDA lists the landing pads, the addresses where the unwinder
+ * resumes the function. No branch in the code points to a landing pad, so
+ * these are not found by crawl_text.
+ *
+ * Only the pointer encodings emitted by GCC and LLVM are handled. Anything
+ * else ends the parsing of the entry (or of the whole table), which means
+ * fewer jump destinations are known, as without this file. All reads are
+ * checked against the end of the loaded segment they start in.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "eh_frame.h"
+#include "intercept.h"
+#include "intercept_util.h"
+
+/* the pointer encodings, see the LSB, Exception Frames */
+#define DW_EH_PE_absptr		0x00
+#define DW_EH_PE_uleb128	0x01
+#define DW_EH_PE_udata2		0x02
+#define DW_EH_PE_udata4		0x03
+#define DW_EH_PE_udata8		0x04
+#define DW_EH_PE_sleb128	0x09
+#define DW_EH_PE_sdata2		0x0a
+#define DW_EH_PE_sdata4		0x0b
+#define DW_EH_PE_sdata8		0x0c
+#define DW_EH_PE_pcrel		0x10
+#define DW_EH_PE_datarel	0x30
+#define DW_EH_PE_indirect	0x80
+#define DW_EH_PE_omit		0xff
+
+#define DW_EH_PE_FORMAT_MASK	0x0f
+#define DW_EH_PE_APPL_MASK	0x70
+
+/* the only table encoding in .eh_frame_hdr used by the linkers */
+#define EH_FRAME_HDR_TABLE_ENC	(DW_EH_PE_datarel | DW_EH_PE_sdata4)
+
+/* the longest augmentation string handled, e.g. "zPLR" */
+#define AUGMENTATION_MAX	8
+
+struct eh_reader {
+	const uint8_t *pos;
+	const uint8_t *end;
+	bool failed;
+};
+
+static void
+reader_init(struct eh_reader *reader, const struct intercept_desc *desc,
+		const uint8_t *pos)
+{
+	reader->pos = pos;
+	reader->end = get_segment_end(desc, pos);
+	reader->failed = reader->end == NULL;
+}
+
+static const uint8_t *
+read_bytes(struct eh_reader *reader, size_t size)
+{
+	if (reader->failed || (size_t)(reader->end - reader->pos) < size) {
+		reader->failed = true;
+		return NULL;
+	}
+
+	const uint8_t *bytes = reader->pos;
+
+	reader->pos += size;
+	return bytes;
+}
+
+/* an unsigned little endian value */
+static uint64_t
+read_fixed(struct eh_reader *reader, size_t size)
+{
+	const uint8_t *bytes = read_bytes(reader, size);
+	uint64_t value = 0;
+
+	if (bytes == NULL)
+		return 0;
+
+	for (size_t i = size; i > 0; --i)
+		value = (value << 8) | bytes[i - 1];
+
+	return value;
+}
+
+/*
+ * read_leb128 - both forms of LEB128, the signed one is sign extended from
+ * the last bit read
+ */
+static uint64_t
+read_leb128(struct eh_reader *reader, bool is_signed)
+{
+	uint64_t value = 0;
+	unsigned shift = 0;
+	const uint8_t *byte;
+
+	do {
+		if ((byte = read_bytes(reader, 1)) == NULL)
+			return 0;
+
+		if (shift < 64)
+			value |= (uint64_t)(*byte & 0x7f) << shift;
+
+		shift += 7;
+	} while (*byte & 0x80);
+
+	if (is_signed && shift < 64 && (*byte & 0x40))
+		value |= ~(uint64_t)0 << shift;
+
+	return value;
+}
+
+/*
+ * read_encoded - a pointer, or an offset, in the given encoding. The
+ * indirect flag is left to the caller, datarel is the base of
+ * DW_EH_PE_datarel, which is only used in .eh_frame_hdr.
+ */
+static uint64_t
+read_encoded(struct eh_reader *reader, uint8_t encoding,
+		const uint8_t *datarel)
+{
+	const uint8_t *pos = reader->pos;
+	uint64_t value;
+
+	switch (encoding & DW_EH_PE_FORMAT_MASK) {
+	case DW_EH_PE_absptr:
+	case DW_EH_PE_udata8:
+	case DW_EH_PE_sdata8:
+		value = read_fixed(reader, 8);
+		break;
+	case DW_EH_PE_uleb128:
+		value = read_leb128(reader, false);
+		break;
+	case DW_EH_PE_sleb128:
+		value = read_leb128(reader, true);
+		break;
+	case DW_EH_PE_udata2:
+		value = read_fixed(reader, 2);
+		break;
+	case DW_EH_PE_sdata2:
+		value = (uint64_t)(int16_t)read_fixed(reader, 2);
+		break;
+	case DW_EH_PE_udata4:
+		value = read_fixed(reader, 4);
+		break;
+	case DW_EH_PE_sdata4:
+		value = (uint64_t)(int32_t)read_fixed(reader, 4);
+		break;
+	default:
+		reader->failed = true;
+		return 0;
+	}
+
+	switch (encoding & DW_EH_PE_APPL_MASK) {
+	case DW_EH_PE_absptr:
+		break;
+	case DW_EH_PE_pcrel:
+		value += (uintptr_t)pos;
+		break;
+	case DW_EH_PE_datarel:
+		if (datarel == NULL)
+			reader->failed = true;
+		value += (uintptr_t)datarel;
+		break;
+	default:
+		reader->failed = true;
+	}
+
+	return value;
+}
+
+/* the parts of a CIE (Common Information Entry) needed to read its FDEs */
+struct cie_info {
+	const uint8_t *address;
+	bool is_valid;
+	bool has_augmentation_data;
+	uint8_t fde_encoding;
+	uint8_t lsda_encoding;
+};
+
+static bool
+parse_cie(const struct intercept_desc *desc, struct cie_info *cie)
+{
+	struct eh_reader reader;
+	char augmentation[AUGMENTATION_MAX];
+	size_t length = 0;
+
+	reader_init(&reader, desc, cie->address);
+
+	uint32_t size = (uint32_t)read_fixed(&reader, 4);
+
+	/* the 64 bit format is not emitted for .eh_frame */
+	if (size == 0 || size == UINT32_MAX)
+		return false;
+
+	if (read_fixed(&reader, 4) != 0)
+		return false; /* not a CIE */
+
+	uint8_t version = (uint8_t)read_fixed(&reader, 1);
+
+	do {
+		const uint8_t *c = read_bytes(&reader, 1);
+
+		if (c == NULL || length == AUGMENTATION_MAX)
+			return false;
+
+		augmentation[length++] = (char)*c;
+	} while (augmentation[length - 1] != '\0');
+
+	read_leb128(&reader, false); /* code alignment factor */
+	read_leb128(&reader, true); /* data alignment factor */
+
+	/* the return address register */
+	if (version == 1)
+		read_fixed(&reader, 1);
+	else
+		read_leb128(&reader, false);
+
+	cie->has_augmentation_data = augmentation[0] == 'z';
+	cie->fde_encoding = DW_EH_PE_absptr;
+	cie->lsda_encoding = DW_EH_PE_omit;
+
+	if (!cie->has_augmentation_data)
+		return !reader.failed && augmentation[0] == '\0';
+
+	read_leb128(&reader, false); /* the size of the augmentation data */
+
+	for (const char *c = augmentation + 1; *c != '\0'; ++c) {
+		uint8_t encoding;
+
+		switch (*c) {
+		case 'R':
+			cie->fde_encoding = (uint8_t)read_fixed(&reader, 1);
+			break;
+		case 'L':
+			cie->lsda_encoding = (uint8_t)read_fixed(&reader, 1);
+			break;
+		case 'P':
+			/* the personality routine, not needed here */
+			encoding = (uint8_t)read_fixed(&reader, 1);
+			read_encoded(&reader, encoding, NULL);
+			break;
+		case 'S':
+		case 'B':
+			break;
+		default:
+			/* the data of an unknown letter has unknown size */
+			return false;
+		}
+	}
+
+	return !reader.failed;
+}
+
+/*
+ * find_landing_pads - marks the landing pads listed in the call site table
+ * of an LSDA. Returns their number.
+ */
+static unsigned
+find_landing_pads(const struct intercept_desc *desc, const uint8_t *lsda,
+		const unsigned char *func_start)
+{
+	struct eh_reader reader;
+	unsigned count = 0;
+
+	reader_init(&reader, desc, lsda);
+
+	uint8_t lpstart_encoding = (uint8_t)read_fixed(&reader, 1);
+	uintptr_t lpstart = (uintptr_t)func_start;
+
+	if (lpstart_encoding != DW_EH_PE_omit)
+		lpstart = read_encoded(&reader, lpstart_encoding, NULL);
+
+	/* the type table, used for catch clauses */
+	if ((uint8_t)read_fixed(&reader, 1) != DW_EH_PE_omit)
+		read_leb128(&reader, false);
+
+	uint8_t cs_encoding = (uint8_t)read_fixed(&reader, 1);
+	uint64_t cs_table_size = read_leb128(&reader, false);
+
+	/* the call sites are offsets, not pointers */
+	if (reader.failed || (cs_encoding & DW_EH_PE_APPL_MASK) != 0 ||
+	    cs_table_size > (uint64_t)(reader.end - reader.pos))
+		return 0;
+
+	const uint8_t *cs_table_end = reader.pos + cs_table_size;
+
+	while (!reader.failed && reader.pos < cs_table_end) {
+		read_encoded(&reader, cs_encoding, NULL); /* call site start */
+		read_encoded(&reader, cs_encoding, NULL); /* its length */
+		uint64_t landing_pad = read_encoded(&reader, cs_encoding, NULL);
+		read_leb128(&reader, false); /* the action */
+
+		if (reader.failed || landing_pad == 0)
+			continue; /* no landing pad for this call site */
+
+		mark_jump(desc, (const unsigned char *)(lpstart + landing_pad));
+		++count;
+	}
+
+	return count;
+}
+
+/*
+ * parse_fde - marks the function described by an FDE, and its landing pads.
+ * The CIE parsed last is kept in cie, as most FDEs of an object share one.
+ * Returns false if the FDE can not be read.
+ */
+static bool
+parse_fde(struct intercept_desc *desc, const uint8_t *fde,
+		const unsigned char *func_start, struct cie_info *cie,
+		unsigned *landing_pads)
+{
+	struct eh_reader reader;
+
+	reader_init(&reader, desc, fde);
+
+	uint32_t size = (uint32_t)read_fixed(&reader, 4);
+	const uint8_t *cie_pointer = reader.pos;
+	uint32_t cie_offset = (uint32_t)read_fixed(&reader, 4);
+
+	if (reader.failed || size == 0 || size == UINT32_MAX || cie_offset == 0)
+		return false;
+
+	if (cie->address != cie_pointer - cie_offset) {
+		cie->address = cie_pointer - cie_offset;
+		cie->is_valid = parse_cie(desc, cie);
+	}
+
+	if (!cie->is_valid || (cie->fde_encoding & DW_EH_PE_indirect) != 0)
+		return false;
+
+	uint64_t pc_begin = read_encoded(&reader, cie->fde_encoding, NULL);
+	uint64_t pc_range = read_encoded(&reader,
+			cie->fde_encoding & DW_EH_PE_FORMAT_MASK, NULL);
+
+	/* the table in .eh_frame_hdr is sorted by pc_begin */
+	if (reader.failed || pc_begin != (uintptr_t)func_start)
+		return false;
+
+	if (func_start < desc->text_start || func_start > desc->text_end)
+		return true;
+
+	mark_jump(desc, func_start);
+	add_func_start(desc, func_start);
+
+	/* the function's end, as with the symbols */
+	if (pc_range != 0)
+		mark_jump(desc, func_start + pc_range);
+
+	if (!cie->has_augmentation_data ||
+	    cie->lsda_encoding == DW_EH_PE_omit ||
+	    (cie->lsda_encoding & DW_EH_PE_indirect) != 0)
+		return true;
+
+	read_leb128(&reader, false); /* the size of the augmentation data */
+
+	uint64_t lsda = read_encoded(&reader, cie->lsda_encoding, NULL);
+
+	if (!reader.failed && lsda != 0)
+		*landing_pads += find_landing_pads(desc,
+				(const uint8_t *)(uintptr_t)lsda, func_start);
+
+	return true;
+}
+
+/*
+ * find_eh_frame_hdr - the .eh_frame_hdr section of the loaded object, or
+ * NULL without PT_GNU_EH_FRAME
+ */
+static const uint8_t *
+find_eh_frame_hdr(const struct intercept_desc *desc)
+{
+	for (Elf64_Half i = 0; i < desc->phnum; ++i) {
+		const Elf64_Phdr *segment = desc->phdrs + i;
+
+		if (segment->p_type == PT_GNU_EH_FRAME)
+			return desc->base_addr + segment->p_vaddr;
+	}
+
+	return NULL;
+}
+
+void
+find_jumps_in_eh_frame(struct intercept_desc *desc)
+{
+	const uint8_t *hdr = find_eh_frame_hdr(desc);
+	struct eh_reader reader;
+
+	if (hdr == NULL) {
+		debug_dump("%s: no .eh_frame_hdr\n", desc->path);
+		return;
+	}
+
+	reader_init(&reader, desc, hdr);
+
+	uint8_t version = (uint8_t)read_fixed(&reader, 1);
+	uint8_t eh_frame_ptr_encoding = (uint8_t)read_fixed(&reader, 1);
+	uint8_t fde_count_encoding = (uint8_t)read_fixed(&reader, 1);
+	uint8_t table_encoding = (uint8_t)read_fixed(&reader, 1);
+
+	read_encoded(&reader, eh_frame_ptr_encoding, hdr);
+
+	uint64_t fde_count = 0;
+
+	if (fde_count_encoding != DW_EH_PE_omit)
+		fde_count = read_encoded(&reader, fde_count_encoding, hdr);
+
+	/* every entry of the table is two sdata4 values */
+	if (reader.failed || version != 1 ||
+	    table_encoding != EH_FRAME_HDR_TABLE_ENC ||
+	    fde_count > (uint64_t)(reader.end - reader.pos) / 8) {
+		debug_dump("%s: unsupported .eh_frame_hdr\n", desc->path);
+		return;
+	}
+
+	struct cie_info cie = {.address = NULL, .is_valid = false};
+	unsigned landing_pads = 0;
+	size_t functions = 0;
+
+	for (uint64_t i = 0; i < fde_count; ++i) {
+		const unsigned char *func_start = (const unsigned char *)
+			(uintptr_t)read_encoded(&reader, table_encoding, hdr);
+		const uint8_t *fde = (const uint8_t *)
+			(uintptr_t)read_encoded(&reader, table_encoding, hdr);
+
+		if (parse_fde(desc, fde, func_start, &cie, &landing_pads))
+			++functions;
+	}
+
+	debug_dump("%s: %zu of %zu functions in .eh_frame, "
+	    "%u landing pads\n", desc->path, functions, (size_t)fde_count,
+	    landing_pads);
+}
@@ -55,12 +55,17 @@
 #include <sys/auxv.h>
 #include <linux/sched.h>
 
+#include "analysis_workers.h"
 #include "intercept.h"
 #include "intercept_log.h"
+#include "intercept_stats.h"
 #include "intercept_util.h"
 #include "libsyscall_intercept_hook_point.h"
 #include "disasm_wrapper.h"
 #include "magic_syscalls.h"
+#include "proc_maps.h"
+#include "syscall_hooks.h"
+#include "syscall_mask.h"
 
 /*
  * Unhandled syscalls: syscalls that are not handled in this TU, but
@@ -72,6 +77,9 @@
  * - UNH_GENERIC can be any syscall that this library cannot or should not
  *   intercept. Currently, only SYS_rt_sigreturn.
  * - UNH_CLONE all clones that have allocated stack space for a child process.
+ * - UNH_FORWARD syscalls the hook let through to the kernel. The ecall is
+ *   executed by intercept_irq_entry with the saved context, which is cheaper
+ *   than syscall_no_intercept (no variadic call and return to this TU).
  *
  * Values are chosen based on the syscall's error code convention and the
  * unlikeliness of colliding with actual syscall return values.
@@ -85,6 +93,7 @@
 #define UNH_SYSCALL	((int64_t)-0x1000)
 #define UNH_GENERIC	((int64_t)-0x1001)
 #define UNH_CLONE	((int64_t)-0x1002)
+#define UNH_FORWARD	((int64_t)-0x1003)
 
 int (*intercept_hook_point)(long syscall_number,
 			long arg0, long arg1,
@@ -97,6 +106,30 @@ void (*intercept_hook_point_clone_child)(void)
 	__attribute__((visibility("default")));
 void (*intercept_hook_point_clone_parent)(long)
 	__attribute__((visibility("default")));
+int (*intercept_hook_ctx)(struct intercept_ctx *ctx)
+	__attribute__((visibility("default")));
+
+void (*intercept_hook_point_post)(long syscall_number, const long args[6],
+			long result, uint64_t cycles)
+	__attribute__((visibility("default")));
+
+/* the user pointer of struct intercept_ctx, kept per thread */
+static __thread void *ctx_user __attribute__((tls_model("initial-exec")));
+
+/*
+ * read_time_counter -- reads the time CSR, which counts at a constant rate
+ * (timebase-frequency in the device tree). Unlike the cycle CSR, Linux allows
+ * reading it in user mode.
+ */
+static inline uint64_t
+read_time_counter(void)
+{
+	uint64_t t;
+
+	__asm__ volatile("rdtime %0" : "=r"(t));
+
+	return t;
+}
 
 bool debug_dumps_on;
 
@@ -109,8 +142,9 @@ debug_dump(const char *fmt, ...)
 	if (!debug_dumps_on)
 		return;
 
+	/* called on the analysis workers too, which must not call libc */
 	va_start(ap, fmt);
-	len = vsnprintf(NULL, 0, fmt, ap);
+	len = vsnprintf_no_intercept(NULL, 0, fmt, ap);
 	va_end(ap);
 
 	if (len <= 0)
@@ -119,7 +153,7 @@ debug_dump(const char *fmt, ...)
 	char buf[len + 1];
 
 	va_start(ap, fmt);
-	len = vsprintf(buf, fmt, ap);
+	len = vsnprintf_no_intercept(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
 
 	syscall_no_intercept(SYS_write, 2, buf, len);
@@ -140,6 +174,14 @@ static bool patch_all_objs;
 static struct intercept_desc *objs;
 static unsigned objs_count;
 
+/*
+ * The site table, every patch of every object has its own index here. The
+ * per-site prologue in the relocation space passes this index on, so the
+ * patch is found without searching for it.
+ */
+static struct patch_desc **sites;
+static uint32_t sites_count;
+
 /* was libc found while looking for loaded objects? */
 static bool libc_found;
 
@@ -197,54 +239,27 @@ str_match(const char *name, size_t name_len,
  * Tries to find the path of an object file loaded at a specific
  * address.
  *
- * The paths found are stored in BSS, in the paths variable. The
- * returned pointer points into this variable. The next_path
- * pointer keeps track of the already "allocated" space inside
- * the paths array.
+ * The paths found are copied to BSS, into the paths variable, as the
+ * snapshot in proc_maps.c can be read again later. The returned pointer
+ * points into this variable. The next_path pointer keeps track of the
+ * already "allocated" space inside the paths array.
  */
 static const char *
 get_name_from_proc_maps(uintptr_t addr)
 {
 	static char paths[0x10000];
 	static char *next_path = paths;
-	const char *path = NULL;
-
-	char line[0x2000];
-	FILE *maps;
-
-	if ((next_path >= paths + sizeof(paths) - sizeof(line)))
-		return NULL; /* No more space left */
 
-	if ((maps = fopen("/proc/self/maps", "r")) == NULL)
+	const struct vma *vma = proc_maps_find(addr);
+	if (vma == NULL || vma->path[0] == '\0')
 		return NULL;
 
-	while ((fgets(line, sizeof(line), maps)) != NULL) {
-		unsigned char *start;
-		unsigned char *end;
-
-		/* Read the path into next_path */
-		if (sscanf(line, "%p-%p %*s %*x %*x:%*x %*u %s",
-		    (void **)&start, (void **)&end, next_path) != 3)
-			continue;
-
-		if (addr < (uintptr_t)start)
-			break;
-
-		if ((uintptr_t)start <= addr && addr < (uintptr_t)end) {
-			/*
-			 * Object found, setting the return value.
-			 * Adjusting the next_path pointer to point past the
-			 * string found just now, to the unused space behind it.
-			 * The next string found (if this routine is called
-			 * again) will be stored there.
-			 */
-			path = next_path;
-			next_path += strlen(next_path) + 1;
-			break;
-		}
-	}
+	size_t len = strlen(vma->path) + 1;
+	if (len > (size_t)(paths + sizeof(paths) - next_path))
+		return NULL; /* No more space left */
 
-	fclose(maps);
+	const char *path = memcpy(next_path, vma->path, len);
+	next_path += len;
 
 	return path;
 }
@@ -334,7 +349,9 @@ should_patch_object(uintptr_t addr, const char *path)
 
 	static const char libc[] = "libc";
 	static const char pthr[] = "libpthread";
+#ifdef USE_CAPSTONE
 	static const char caps[] = "libcapstone";
+#endif
 
 	if (is_vdso(addr, path)) {
 		debug_dump(" - skipping: is_vdso\n");
@@ -352,10 +369,12 @@ should_patch_object(uintptr_t addr, const char *path)
 		return false;
 	}
 
+#ifdef USE_CAPSTONE
 	if (str_match(name, len, caps)) {
 		debug_dump(" - skipping: matches capstone\n");
 		return false;
 	}
+#endif
 
 	if (str_match(name, len, libc)) {
 		debug_dump(" - libc found\n");
@@ -377,8 +396,9 @@ should_patch_object(uintptr_t addr, const char *path)
 
 /*
  * analyze_object
- * Look at a library loaded into the current process, and determine as much as
- * possible about it. The disassembling, allocations are initiated here.
+ * Look at a library loaded into the current process, and decide whether it
+ * is patched. The disassembling is done later for all the objects found,
+ * by analyze_objects() (analysis_workers.c).
  *
  * This is a callback function, passed to dl_iterate_phdr(3).
  * data and size are just unused callback arguments.
@@ -418,7 +438,8 @@ analyze_object(struct dl_phdr_info *info, size_t size, void *data)
 
 	patches->base_addr = (unsigned char *)info->dlpi_addr;
 	patches->path = path;
-	find_syscalls(patches);
+	patches->phdrs = info->dlpi_phdr;
+	patches->phnum = info->dlpi_phnum;
 
 	return 0;
 }
@@ -453,14 +474,41 @@ write_enable_asm_relocation_space(bool enable_write)
 	} else {
 		prot = PROT_READ | PROT_EXEC;
 		err_msg = "asm_relocation_space write disable";
+
+		uint64_t start = intercept_stats_time();
 		__builtin___clear_cache((char *)asm_relocation_space,
 					(char *)(asm_relocation_space + asm_relocation_space_size));
+		intercept_stats_phase(STATS_CLEAR_CACHE, start);
 	}
 
 	mprotect_no_intercept(asm_relocation_space, asm_relocation_space_size,
 				prot, err_msg);
 }
 
+/*
+ * init_sites - give every patch its index in the site table, this must
+ * be done before create_patch() generates the per-site prologues.
+ */
+static void
+init_sites(void)
+{
+	for (unsigned o = 0; o < objs_count; ++o)
+		sites_count += objs[o].count;
+
+	if (sites_count == 0)
+		return;
+
+	sites = xmmap_anon(sites_count * sizeof(sites[0]));
+
+	uint32_t site_idx = 0;
+	for (unsigned o = 0; o < objs_count; ++o) {
+		for (unsigned p = 0; p < objs[o].count; ++p) {
+			objs[o].items[p].site_idx = site_idx;
+			sites[site_idx++] = objs[o].items + p;
+		}
+	}
+}
+
 /*
  * intercept - This is where the highest level logic of hotpatching
  * is described. Upon startup, this routine looks for libc, and libpthread.
@@ -477,23 +525,38 @@ intercept(int argc, char **argv)
 {
 	(void) argc;
 	cmdline = argv[0];
-	extern void init_tls_offset_table(void);
 
 	if (!syscall_hook_in_process_allowed())
 		return;
 
+	intercept_stats_setup(getenv("INTERCEPT_STATS"));
+
+	uint64_t total_start = intercept_stats_time();
+	uint64_t start;
+
 	vdso_addr = (void *)(uintptr_t)getauxval(AT_SYSINFO_EHDR);
 	debug_dumps_on = getenv("INTERCEPT_DEBUG_DUMP") != NULL;
 	patch_all_objs = (getenv("INTERCEPT_ALL_OBJS") != NULL);
 	intercept_setup_log(getenv("INTERCEPT_LOG"),
 			getenv("INTERCEPT_LOG_TRUNC"));
 	log_header();
+	init_syscall_masks();
 
+	start = intercept_stats_time();
 	dl_iterate_phdr(analyze_object, NULL);
+	intercept_stats_phase(STATS_DL_ITERATE_PHDR, start);
 	if (!libc_found)
 		xabort("libc not found");
 
-	init_tls_offset_table();
+	start = intercept_stats_time();
+	analyze_objects(objs, objs_count);
+	intercept_stats_phase(STATS_ANALYSIS, start);
+
+	init_sites();
+
+	/* the analysis mapped memory since the paths were looked up */
+	proc_maps_load();
+
 	write_enable_asm_relocation_space(true);
 
 	for (uint32_t i = 0; i < objs_count; ++i) {
@@ -502,14 +565,30 @@ intercept(int argc, char **argv)
 		else if (is_asm_relocation_space_full())
 			xabort("not enough space in relocation space");
 
+		place_missing_islands(objs + i);
+
+		start = intercept_stats_time();
 		allocate_trampoline(objs + i);
+		intercept_stats_phase(STATS_ALLOCATE_TRAMPOLINE, start);
+
+		start = intercept_stats_time();
 		create_patch(objs + i, &cur_asm_relocation_space);
+		intercept_stats_phase(STATS_CREATE_PATCH, start);
 	}
 
+	intercept_stats_add(STATS_RELOCATION_BYTES,
+			(uint64_t)(cur_asm_relocation_space -
+				asm_relocation_space));
+
 	write_enable_asm_relocation_space(false);
 
+	start = intercept_stats_time();
 	for (unsigned i = 0; i < objs_count; ++i)
 		activate_patches(objs + i);
+	intercept_stats_phase(STATS_ACTIVATE_PATCHES, start);
+
+	intercept_stats_phase(STATS_TOTAL, total_start);
+	intercept_stats_report(objs, objs_count);
 }
 
 /*
@@ -592,91 +671,28 @@ xabort_on_syserror(long syscall_result, const char *msg)
 		xabort_errno(syscall_error_code(syscall_result), msg);
 }
 
-/*
- * When patch comes to asm_entry_point (intercept_irq_entry.S), one of
- * the first thing it does is finding "identity" of a patch by using
- * it's uniqe return address.
- */
-struct wrapper_ret
-detect_cur_patch(uint64_t MID_ret_addr, uint64_t SML_ret_addr,
-			uint64_t GW_ret_addr)
+static struct patch_desc *
+get_cur_patch(int64_t site_idx)
 {
-	struct patch_desc *patch = NULL;
-	// sign-extend syscall_num to register size
-	int64_t syscall_num = INT64_MIN;
-	uint64_t reloc_addr = 0;
-	uint64_t ret_addrs[3] = {MID_ret_addr, SML_ret_addr, GW_ret_addr};
-	uint8_t ra_idx = 0;
-
-	for (; ra_idx < sizeof(ret_addrs); ++ra_idx) {
-		for (uint32_t o = 0; o < objs_count; ++o) {
-			for (uint32_t p = 0; p < objs[o].count; ++p) {
-
-				patch = objs[o].items + p;
-				uint64_t ret_addr = (uint64_t)patch->return_address;
-				syscall_num = patch->syscall_num;
-				reloc_addr = (uint64_t)patch->relocation_address;
-
-				if (ret_addr == ret_addrs[ra_idx]) {
-					switch (syscall_num) {
-					case TYPE_GW:
-						if (ra_idx == 2)
-							goto ret_to_irq_entry;
-						break;
-					case TYPE_MID:
-						if (ra_idx == 0)
-							goto ret_to_irq_entry;
-						break;
-					default: // TYPE_SML
-						if (ra_idx == 1)
-							goto ret_to_irq_entry;
-						break;
-					}
-				}
-			}
-		}
-	}
-ret_to_irq_entry:
-
-	if (ra_idx >= sizeof(ret_addrs))
+	if ((uint64_t)site_idx >= sites_count)
 		xabort("Failed to identify patch");
 
-	return (struct wrapper_ret){.a0 = syscall_num, .a1 = reloc_addr};
+	return sites[site_idx];
 }
 
-static struct patch_desc *
-get_cur_patch(int64_t return_address)
+void
+intercept_post_clone_log_syscall(struct intercept_ctx *ctx)
 {
-	struct patch_desc *patch = NULL;
-
-	for (uint32_t o = 0; o < objs_count; ++o) {
-		for (uint32_t p = 0; p < objs[o].count; ++p) {
-			patch = objs[o].items + p;
-			if ((int64_t)patch->return_address == return_address)
-				break;
-		}
-	}
+	struct patch_desc *patch = get_cur_patch(ctx->site_id);
+	struct syscall_desc *desc = (struct syscall_desc *)ctx;
 
-	return patch;
-}
+	intercept_log_syscall(patch, desc, KNOWN, desc->args[0]);
 
-void
-intercept_post_clone_log_syscall(int64_t a0, int64_t a1, int64_t a2, int64_t a3,
-			int64_t a4, int64_t a5, int64_t a6, int64_t a7)
-{
-	struct patch_desc *patch = get_cur_patch(a6);
-
-	struct syscall_desc desc = {
-		.nr = (int)a7, /* ignore higher 32 bits */
-		.args[0] = a0,
-		.args[1] = a1,
-		.args[2] = a2,
-		.args[3] = a3,
-		.args[4] = a4,
-		.args[5] = a5
-	};
-
-	intercept_log_syscall(patch, &desc, KNOWN, a0);
+	/* the ecall was executed in asm, its duration is not measured */
+	void (*post)(long, const long *, long, uint64_t) =
+		intercept_hook_point_post;
+	if (post != NULL)
+		post(desc->nr, desc->args, desc->args[0], 0);
 }
 
 
@@ -704,68 +720,75 @@ intercept_routine_post_clone(int64_t a0)
  * if one is present.
  *
  * Arguments:
- * nr, arg0 - arg 5 -- syscall number
- *
- * For logging ( debugging, validating ):
- *
- * syscall_offset -- the offset of the original syscall
- *  instruction in the shared object
- * libpath -- the path of the .so being intercepted,
- *  e.g.: "/usr/lib/libc.so.6"
+ * ctx -- the context saved by asm_entry_point, starting with the syscall
+ *  number and arguments (a0-a7) and the index of the patch, see
+ *  struct intercept_ctx
  *
- * For returning to libc:
- * return_to_asm_wrapper_syscall, return_to_asm_wrapper -- the
- *  address to jump to, when this function is done. The function
- *  is called with a faked return address on the stack ( to aid
- *  stack unwinding ). So, instead of just returning from this
- *  function, one must jump to one of these addresses. The first
- *  one triggers the execution of the syscall after restoring all
- *  registers, and before actually jumping back to the subject library.
- *
- * clone_wrapper -- the address to call in the special case of thread
- *  creation using clone.
- *
- * rsp_in_asm_wrapper -- the stack pointer to restore after returning
- *  from this function.
+ * Returns the results of the syscall (a0/a1), or the UNH_* values for the
+ * syscalls left to asm_entry_point.
  */
 struct wrapper_ret
-intercept_routine(int64_t a0, int64_t a1, int64_t a2, int64_t a3,
-			int64_t a4, int64_t a5, int64_t a6, int64_t a7)
+intercept_routine(struct intercept_ctx *ctx)
 {
-	struct wrapper_ret result = {.a0 = a0, .a1 = a1};
-	int forward_to_kernel = true;
-	struct patch_desc *patch = get_cur_patch(a6);
 	/*
-	 * The RISC-V version of this library doesn't rely on offsets, instead
-	 * ecall args get passed directly. It's more straightforward, and
-	 * manually arranging the layout is likely to "offset" a programmer.
+	 * The syscall arguments are used in place, from the context saved by
+	 * intercept_irq_entry.S, thus any change made by the hooks taking
+	 * struct intercept_ctx is seen by the ecall that follows.
 	 */
-	struct syscall_desc desc = {
-		.nr = (int)a7, /* ignore higher 32 bits */
-		.args[0] = a0,
-		.args[1] = a1,
-		.args[2] = a2,
-		.args[3] = a3,
-		.args[4] = a4,
-		.args[5] = a5
-	};
-
-	if (handle_magic_syscalls(&desc, &result.a0) == 0)
+	struct syscall_desc *desc = (struct syscall_desc *)ctx;
+	struct wrapper_ret result = {.a0 = desc->args[0], .a1 = desc->args[1]};
+	int forward_to_kernel = true;
+	int (*hook_ctx)(struct intercept_ctx *) = intercept_hook_ctx;
+	void (*post)(long, const long *, long, uint64_t) =
+		intercept_hook_point_post;
+	// the index of the patch, see copy_site_prologue() in patcher.c
+	struct patch_desc *patch = get_cur_patch(ctx->site_id);
+
+	if (handle_magic_syscalls(desc, &result.a0) == 0)
 		return result;
 
-	intercept_log_syscall(patch, &desc, UNKNOWN, 0);
+	intercept_log_syscall(patch, desc, UNKNOWN, 0);
+
+	const struct syscall_hook *syscall_hook = get_syscall_hook(desc->nr);
+	bool chain = has_hook_chain();
+
+	/*
+	 * The hooks taking struct intercept_ctx, in this order: the hook of
+	 * this syscall number, the hook chain, intercept_hook_ctx.
+	 */
+	if (syscall_hook != NULL || chain || hook_ctx != NULL) {
+		ctx->lib = patch->containing_lib_path;
+		ctx->timestamp = read_time_counter();
+		ctx->user = ctx_user;
+
+		if (syscall_hook != NULL)
+			forward_to_kernel = syscall_hook->fn(ctx,
+						syscall_hook->user);
+
+		if (forward_to_kernel && chain)
+			forward_to_kernel = run_hook_chain(ctx);
 
-	if (intercept_hook_point != NULL)
-		forward_to_kernel = intercept_hook_point(desc.nr,
-					desc.args[0],
-					desc.args[1],
-					desc.args[2],
-					desc.args[3],
-					desc.args[4],
-					desc.args[5],
+		if (forward_to_kernel && hook_ctx != NULL)
+			forward_to_kernel = hook_ctx(ctx);
+
+		ctx_user = ctx->user;
+		result.a0 = desc->args[0];
+		result.a1 = desc->args[1];
+	}
+
+	if (forward_to_kernel && hook_ctx == NULL &&
+			intercept_hook_point != NULL) {
+		forward_to_kernel = intercept_hook_point(desc->nr,
+					desc->args[0],
+					desc->args[1],
+					desc->args[2],
+					desc->args[3],
+					desc->args[4],
+					desc->args[5],
 					&result.a0);
+	}
 
-	if (desc.nr == SYS_rt_sigreturn) {
+	if (desc->nr == SYS_rt_sigreturn) {
 		/* can't handle these syscalls the normal way */
 		return (struct wrapper_ret){.a0 = UNH_SYSCALL, .a1 = UNH_GENERIC};
 	}
@@ -783,26 +806,45 @@ intercept_routine(int64_t a0, int64_t a1, int64_t a2, int64_t a3,
 		 * the clone_child_intercept_routine instead, executing
 		 * it on the new child threads stack, then returns to libc.
 		 */
-		if (desc.nr == SYS_clone && (desc.args[1] != 0 ||
-				desc.args[0] & CLONE_VFORK)) {
+		if (desc->nr == SYS_clone && (desc->args[1] != 0 ||
+				desc->args[0] & CLONE_VFORK)) {
 			return (struct wrapper_ret){.a0 = UNH_SYSCALL,
 							.a1 = UNH_CLONE};
 		}
 #ifdef SYS_clone3
-		else if (desc.nr == SYS_clone3 &&
-				((struct clone_args *)desc.args[0])->stack != 0) {
+		else if (desc->nr == SYS_clone3 &&
+				((struct clone_args *)desc->args[0])->stack != 0) {
 			return (struct wrapper_ret){.a0 = UNH_SYSCALL,
 							.a1 = UNH_CLONE};
 		}
 #endif
+		/*
+		 * Nothing is left to do after the ecall unless it must be
+		 * logged, passed to the post hook, or it's a clone (post clone
+		 * hooks below).
+		 */
+		else if (desc->nr != SYS_clone &&
+#ifdef SYS_clone3
+				desc->nr != SYS_clone3 &&
+#endif
+				post == NULL && !intercept_log_is_enabled()) {
+			return (struct wrapper_ret){.a0 = UNH_SYSCALL,
+							.a1 = UNH_FORWARD};
+		}
 		else {
-			result = syscall_no_intercept(desc.nr,
-					desc.args[0],
-					desc.args[1],
-					desc.args[2],
-					desc.args[3],
-					desc.args[4],
-					desc.args[5]);
+			uint64_t start = post != NULL ? read_time_counter() : 0;
+
+			result = syscall_no_intercept(desc->nr,
+					desc->args[0],
+					desc->args[1],
+					desc->args[2],
+					desc->args[3],
+					desc->args[4],
+					desc->args[5]);
+
+			if (post != NULL)
+				post(desc->nr, desc->args, result.a0,
+					read_time_counter() - start);
 		}
 
 		/*
@@ -812,15 +854,15 @@ intercept_routine(int64_t a0, int64_t a1, int64_t a2, int64_t a3,
 		 * (fork) and the 'KNOWN' logging is done here successfully
 		 * after the clone syscall (syscall_no_intercept).
 		 */
-		if (desc.nr == SYS_clone)
+		if (desc->nr == SYS_clone)
 			intercept_routine_post_clone(result.a0);
 #ifdef SYS_clone3
-		else if (desc.nr == SYS_clone3)
+		else if (desc->nr == SYS_clone3)
 			intercept_routine_post_clone(result.a0);
 #endif
 	}
 
-	intercept_log_syscall(patch, &desc, KNOWN, result.a0);
+	intercept_log_syscall(patch, desc, KNOWN, result.a0);
 
 	return result;
 }
@@ -45,6 +45,7 @@
 #include <link.h>
 
 #include "disasm_wrapper.h"
+#include "intercept_util.h"
 #include "rv_encode.h"
 
 extern bool debug_dumps_on;
@@ -58,9 +59,14 @@ __attribute__((noreturn)) void xabort(const char *msg);
 
 void xabort_on_syserror(long syscall_result, const char *msg);
 
+/*
+ * The layout of a0-a7 in struct intercept_ctx, i.e., in the context saved by
+ * intercept_irq_entry.S, which intercept_routine uses in place.
+ */
 struct syscall_desc {
-	int nr;
 	long args[6];
+	long a6;
+	long nr;
 };
 
 /*
@@ -77,11 +83,32 @@ struct syscall_desc {
 struct patch_desc {
 	/* the address to jump back to */
 	const uint8_t *return_address;
-	/* the address where the relocated patches are */
+	/*
+	 * the address where the relocated patches are, starting with the
+	 * per-site prologue that jumps to asm_entry_point
+	 */
 	const uint8_t *relocation_address;
 	/* holds the a7 value found before ecall or -1 for MID a7, -2 for GW */
 	int16_t syscall_num;
 
+	/* index of this patch in the site table, see get_cur_patch() */
+	uint32_t site_idx;
+
+	/*
+	 * GW:      where the GW jumps to (directly or through the trampoline),
+	 *          the dispatch that finds out which patch went through the GW
+	 * MID/SML: the GW patch used to reach the relocation space
+	 */
+	const uint8_t *dispatch_address;
+	struct patch_desc *gateway;
+
+	/*
+	 * The statically known syscall number is not selected (see
+	 * syscall_mask.c), the site is left untouched. A skipped site that
+	 * is needed as a GW by another patch is patched anyway.
+	 */
+	bool is_skipped;
+
 	/* the original syscall instruction */
 	const uint8_t *syscall_addr;
 
@@ -96,6 +123,8 @@ struct patch_desc {
 	 * MID: address of the GW's patch, skipping MODIFY_SP_INS_SIZE
 	 *      because TYPE_MID already reduced the stack pointer
 	 * SML: address of the GW's first byte overwritten in the code
+	 * Until find_GW() the start of the site itself for all three, see
+	 * get_patch_start() in patcher.c.
 	 */
 	uint8_t *dst_jmp_patch;
 	uint8_t patch_size_bytes;
@@ -115,9 +144,36 @@ struct patch_desc {
 	 */
 	struct intercept_disasm_result *surrounding_instrs;
 	uint8_t syscall_idx;
-	bool is_ra_used_before;
-	bool is_ra_used_after;
 	uint8_t return_register;
+
+	/*
+	 * A temporary register that is dead around the site, a TYPE_GW patch
+	 * placed here can link with it instead of ra, without a stack frame.
+	 * Zero if there is none, see find_dead_register() in patcher.c.
+	 */
+	uint8_t dead_register;
+
+	/*
+	 * The temporary registers dead at the targets of all the branches and
+	 * jumps that can be relocated with the patch, see
+	 * is_copiable_after_syscall() in patcher.c.
+	 */
+	uint32_t branch_dead_regs;
+};
+
+/*
+ * A stub island is a GW entry without a syscall, written where nothing is
+ * executed: in the padding between two functions, or in a page mapped
+ * within JAL reach of the text. TYPE_SML and TYPE_MID patches jump to it
+ * just like to a TYPE_GW patch, so a site needs no room for a GW of its
+ * own, nor one nearby. The gw member describes it as a TYPE_GW patch,
+ * is_skipped until a patch uses it.
+ */
+struct stub_island {
+	struct patch_desc gw;
+	/* the TYPE_SML patches placed there, see claim_island() */
+	unsigned users;
+	struct stub_island *next;
 };
 
 /*
@@ -136,10 +192,9 @@ struct section_list {
 
 struct intercept_desc {
 	/*
-	 * uses_trampoline_table - For now this is decided runtime
-	 * to make it easy to compare the operation of the library
-	 * with and without it. If it is OK, we can remove this
-	 * flag, and just always use the trampoline table.
+	 * uses_trampoline - the relocation space is out of the 2GB reach
+	 * of the text section, the GWs jump through a trampoline, see
+	 * allocate_trampoline().
 	 */
 	bool uses_trampoline;
 
@@ -152,6 +207,10 @@ struct intercept_desc {
 	/* where the object is in fs */
 	const char *path;
 
+	/* the program headers of the loaded object, see dl_iterate_phdr(3) */
+	const Elf64_Phdr *phdrs;
+	Elf64_Half phnum;
+
 	/*
 	 * Some sections of the library from which information
 	 * needs to be extracted.
@@ -180,18 +239,67 @@ struct intercept_desc {
 	struct patch_desc *items;
 	unsigned count;
 
+	/*
+	 * The surrounding_instrs of the patches, released once
+	 * prepare_patches() has no more use for them.
+	 */
+	struct xarena surr_arena;
+
 	uint8_t *jump_table;
 
-	/* the RISC-V version only needs one trampoline per patched library */
+	/*
+	 * Entry points of the functions in the text section, where
+	 * crawl_text() can start decoding. Collected from the symbol tables,
+	 * only needed until the crawl is done.
+	 */
+	const unsigned char **func_starts;
+	size_t func_start_count;
+
+	/*
+	 * The stub islands found in the padding by crawl_text(), and the
+	 * ones mapped later, allocated from island_arena.
+	 */
+	struct stub_island *islands;
+	struct xarena island_arena;
+
+	/*
+	 * The trampoline table, every TYPE_GW gets its own TRAMPOLINE_SIZE
+	 * bytes long trampoline, jumping to the GW's dispatch. Part of a
+	 * pool shared with other objects nearby.
+	 */
 	uint8_t *trampoline_address;
+	size_t trampoline_size;
 };
 
 bool has_jump(const struct intercept_desc *desc, const uint8_t *addr);
 void mark_jump(const struct intercept_desc *desc, const unsigned char *addr);
+void add_func_start(struct intercept_desc *desc, const unsigned char *address);
+const uint8_t *get_segment_end(const struct intercept_desc *desc,
+		const void *addr);
+void allocate_jump_table(struct intercept_desc *desc);
+
+struct patch_desc *add_new_patch(struct intercept_desc *desc);
+void fill_up_patch(struct intercept_desc *desc, struct patch_desc *patch,
+		struct intercept_disasm_result surr[], uint8_t syscall_idx);
+
+struct stub_island *add_island(struct intercept_desc *desc, uint8_t *address);
+uint8_t *map_island(const uint8_t *near);
 
 void allocate_trampoline(struct intercept_desc *desc);
 void find_syscalls(struct intercept_desc *desc);
 
+/*
+ * Decide the type and the place of each patch, this only looks at the
+ * object's own desc, so the objects can be prepared in parallel.
+ */
+void prepare_patches(struct intercept_desc *desc);
+
+/*
+ * Map stub islands for the patches prepare_patches() found no GW for,
+ * done on one thread, after the analysis.
+ */
+void place_missing_islands(struct intercept_desc *desc);
+
 void create_patch(struct intercept_desc *desc, unsigned char **dst);
 
 /*
@@ -218,15 +326,31 @@ void activate_patches(struct intercept_desc *desc);
 				STORE_LOAD_INS_SIZE + \
 				MODIFY_SP_INS_SIZE)
 
-#define TRAMPOLINE_SIZE 	(STORE_LOAD_INS_SIZE + \
-				JUMP_ABS_INS_SIZE)
+#define ISLAND_SIZE		TYPE_GW_SIZE
+
+/*
+ * A TYPE_GW patch linking with its dead_register is just the jump, it has no
+ * stack frame to set up, and no other patch can go through it.
+ */
+static inline bool
+is_frameless_GW(const struct patch_desc *patch)
+{
+	return patch->syscall_num == TYPE_GW && patch->return_register != REG_RA;
+}
+
 /*
- * When the trampoline is not used, the GW jumps directly to asm_entry_point
- * to store its ra in 24(sp) (first instruction in asm_entry_point). Trampoline
- * already stored GW's ra in 24(sp), so it has to skip that by jumping with a
- * small offset (TRAMPOLINE_JUMP_OFFSET).
+ * The trampoline stores the GW's ra at UNUSED_OFF1(sp) before overwriting it,
+ * the GW's dispatch loads it back (only needed when other patches use the GW).
+ * The trampoline of a frameless GW overwrites its link register instead.
+ * The address of the dispatch is loaded from the literal at
+ * TRAMPOLINE_LITERAL_OFF, following the code: sd, auipc, ld, jr.
  */
-#define TRAMPOLINE_JUMP_OFFSET	STORE_LOAD_INS_SIZE
+#define TRAMPOLINE_CODE_SIZE	(STORE_LOAD_INS_SIZE + \
+				AUIPC_INS_SIZE + \
+				RV_INS_SIZE + \
+				JALR_INS_SIZE)
+#define TRAMPOLINE_LITERAL_OFF	16
+#define TRAMPOLINE_SIZE 	(TRAMPOLINE_LITERAL_OFF + sizeof(uint64_t))
 
 extern const char *cmdline;
 
@@ -41,10 +41,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "analysis_cache.h"
 #include "intercept.h"
 #include "intercept_util.h"
+#include "intercept_stats.h"
 #include "disasm_wrapper.h"
+#include "eh_frame.h"
+#include "proc_maps.h"
 
 /*
  * For simplicity, declare syscall_no_intercept() with return value 'long'
@@ -64,17 +69,66 @@ syscall_no_intercept(long syscall_number, ...);
  * information about the file's sections, and the sections themselves might
  * only be present in the original file.
  * Note on naming: memory has segments, the object file has sections.
+ *
+ * Returns a negative error code if the file can not be opened, then only
+ * the loaded segments are used, see find_loaded_tables.
  */
 static int
 open_orig_file(const struct intercept_desc *desc)
 {
-	int fd;
+	return (int)syscall_no_intercept(SYS_openat, AT_FDCWD, desc->path,
+						O_RDONLY | O_CLOEXEC);
+}
 
-	fd = syscall_no_intercept(SYS_openat, AT_FDCWD, desc->path, O_RDONLY);
+/*
+ * The whole object file, mapped read-only. The headers and tables are
+ * parsed where they are, without copying them anywhere.
+ */
+struct elf_file {
+	const unsigned char *data;
+	size_t size;
+};
 
-	xabort_on_syserror(fd, __func__);
+/*
+ * map_orig_file
+ * The pages come from the page cache, and only the ones holding the
+ * headers and tables looked at are ever touched.
+ */
+static void
+map_orig_file(struct elf_file *file, int fd)
+{
+	struct stat st;
 
-	return fd;
+	xabort_on_syserror(syscall_no_intercept(SYS_fstat, fd, &st),
+				"fstat of object file");
+
+	file->size = (size_t)st.st_size;
+
+	long addr = syscall_no_intercept(SYS_mmap, NULL, file->size,
+					PROT_READ, MAP_PRIVATE, fd, (off_t)0);
+
+	xabort_on_syserror(addr, "mmap of object file");
+
+	file->data = (const unsigned char *)addr;
+}
+
+static void
+unmap_orig_file(struct elf_file *file)
+{
+	xmunmap((void *)file->data, file->size);
+}
+
+/*
+ * get_file_range -- a pointer to size bytes at offset in the file, making
+ * sure all of them are in the file
+ */
+static const void *
+get_file_range(const struct elf_file *file, uint64_t offset, uint64_t size)
+{
+	if (offset > file->size || size > file->size - offset)
+		xabort("object file truncated");
+
+	return file->data + offset;
 }
 
 static void
@@ -110,31 +164,34 @@ add_text_info(struct intercept_desc *desc, const Elf64_Shdr *header,
  * See: man elf
  */
 static void
-find_sections(struct intercept_desc *desc, int fd)
+find_sections(struct intercept_desc *desc, const struct elf_file *file)
 {
-	Elf64_Ehdr elf_header;
+	const Elf64_Ehdr *elf_header =
+		get_file_range(file, 0, sizeof(Elf64_Ehdr));
 
 	desc->symbol_tables.count = 0;
 	desc->rela_tables.count = 0;
 
-	xread(fd, &elf_header, sizeof(elf_header));
+	if (elf_header->e_shstrndx >= elf_header->e_shnum)
+		xabort("section name string table not found");
 
-	Elf64_Shdr sec_headers[elf_header.e_shnum];
+	const Elf64_Shdr *sec_headers = get_file_range(file,
+		elf_header->e_shoff, elf_header->e_shnum * sizeof(Elf64_Shdr));
 
-	xlseek(fd, elf_header.e_shoff, SEEK_SET);
-	xread(fd, sec_headers, elf_header.e_shnum * sizeof(Elf64_Shdr));
+	const Elf64_Shdr *strtab_header = &sec_headers[elf_header->e_shstrndx];
 
-	char sec_string_table[sec_headers[elf_header.e_shstrndx].sh_size];
-
-	xlseek(fd, sec_headers[elf_header.e_shstrndx].sh_offset, SEEK_SET);
-	xread(fd, sec_string_table,
-	    sec_headers[elf_header.e_shstrndx].sh_size);
+	const char *sec_string_table = get_file_range(file,
+		strtab_header->sh_offset, strtab_header->sh_size);
 
 	bool text_section_found = false;
 
-	for (Elf64_Half i = 0; i < elf_header.e_shnum; ++i) {
+	for (Elf64_Half i = 0; i < elf_header->e_shnum; ++i) {
 		const Elf64_Shdr *section = &sec_headers[i];
-		char *name = sec_string_table + section->sh_name;
+
+		if (section->sh_name >= strtab_header->sh_size)
+			continue;
+
+		const char *name = sec_string_table + section->sh_name;
 
 		debug_dump("looking at section: \"%s\" type: %ld\n",
 		    name, (long)section->sh_type);
@@ -161,7 +218,7 @@ find_sections(struct intercept_desc *desc, int fd)
  * Allocates a bitmap, where each bit represents a unique address in
  * the text section.
  */
-static void
+void
 allocate_jump_table(struct intercept_desc *desc)
 {
 	/* How many bytes need to be addressed? */
@@ -222,6 +279,74 @@ mark_jump(const struct intercept_desc *desc, const unsigned char *addr)
 		set_bit(desc->jump_table, (uint64_t)(addr - desc->text_start));
 }
 
+/*
+ * get_segment_end - the end of the readable loaded segment containing addr,
+ * or NULL if there is none. Data found through pointers in the object, e.g.
+ * in the unwind tables, or in a jump table, is only read up to there.
+ */
+const uint8_t *
+get_segment_end(const struct intercept_desc *desc, const void *addr)
+{
+	for (Elf64_Half i = 0; i < desc->phnum; ++i) {
+		const Elf64_Phdr *segment = desc->phdrs + i;
+		const uint8_t *start = desc->base_addr + segment->p_vaddr;
+
+		if (segment->p_type != PT_LOAD ||
+		    (segment->p_flags & PF_R) == 0)
+			continue;
+
+		if ((const uint8_t *)addr >= start &&
+		    (const uint8_t *)addr < start + segment->p_memsz)
+			return start + segment->p_memsz;
+	}
+
+	return NULL;
+}
+
+/*
+ * has_pow2_count
+ * Checks if the positive number of elements in an array, that is grown
+ * by doubling its size, is a power of two or not.
+ */
+static bool
+has_pow2_count(size_t count)
+{
+#ifdef __riscv_zbb
+	bool ret;
+	__asm__ volatile (
+		"cpop %0, %1\n\t"
+		"sltiu %0, %0, 2\n\t"
+		: "=r" (ret)
+		: "r" (count)
+	);
+	return ret;
+#else
+	return (count & (count - 1)) == 0;
+#endif
+}
+
+/*
+ * add_func_start
+ * Remembers the entry point of a function in the text section, see
+ * crawl_text(). The array is sorted once all symbol tables, and the unwind
+ * tables (eh_frame.c) are read, duplicates are harmless.
+ */
+void
+add_func_start(struct intercept_desc *desc, const unsigned char *address)
+{
+	size_t elem_size = sizeof(desc->func_starts[0]);
+
+	if (desc->func_start_count == 0) {
+		desc->func_starts = xmmap_anon(elem_size);
+	} else if (has_pow2_count(desc->func_start_count)) {
+		size_t size = desc->func_start_count * elem_size;
+
+		desc->func_starts = xmremap(desc->func_starts, size, 2 * size);
+	}
+
+	desc->func_starts[desc->func_start_count++] = address;
+}
+
 /*
  * find_jumps_in_section_syms
  *
@@ -245,26 +370,28 @@ mark_jump(const struct intercept_desc *desc, const unsigned char *addr)
  * } Elf64_Sym;
  *
  * The field st_value is offset of the symbol in the object file.
+ *
+ * The entry points are also remembered as the places where crawl_text()
+ * can start decoding instructions.
+ *
+ * The table is used where it is, in the mapped object file, or in memory
+ * (.dynsym) when the file is not readable. In the latter case, the index
+ * of the text section is not known (SHN_UNDEF), any defined function is
+ * taken, mark_jump() ignores the addresses outside of the text anyway.
  */
 static void
-find_jumps_in_section_syms(struct intercept_desc *desc, Elf64_Shdr *section,
-				int fd)
+find_jumps_in_section_syms(struct intercept_desc *desc, const Elf64_Sym *syms,
+				size_t sym_count)
 {
-	assert(section->sh_type == SHT_SYMTAB ||
-		section->sh_type == SHT_DYNSYM);
-
-	size_t sym_count = section->sh_size / sizeof(Elf64_Sym);
-
-	Elf64_Sym syms[sym_count];
-
-	xlseek(fd, section->sh_offset, SEEK_SET);
-	xread(fd, &syms, section->sh_size);
-
 	for (size_t i = 0; i < sym_count; ++i) {
 		if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC)
 			continue; /* it is not a function */
 
-		if (syms[i].st_shndx != desc->text_section_index)
+		if (syms[i].st_shndx == SHN_UNDEF)
+			continue; /* it is defined in another object */
+
+		if (desc->text_section_index != SHN_UNDEF &&
+		    syms[i].st_shndx != desc->text_section_index)
 			continue; /* it is not in the text section */
 
 		debug_dump("jump target: %lx\n",
@@ -274,6 +401,7 @@ find_jumps_in_section_syms(struct intercept_desc *desc, Elf64_Shdr *section,
 
 		/* a function entry point in .text, mark it */
 		mark_jump(desc, address);
+		add_func_start(desc, address);
 
 		/* a function's end in .text, mark it */
 		if (syms[i].st_size != 0)
@@ -287,6 +415,11 @@ find_jumps_in_section_syms(struct intercept_desc *desc, Elf64_Shdr *section,
  * The constant SHT_RELA refers to "Relocation entries with addends" -- see the
  * elf.h header file.
  *
+ * An R_RISCV_RELATIVE relocation stores the base address plus the addend
+ * somewhere in the data. When that points into the text, it is a function
+ * pointer, or some other code address taken, e.g. an entry of an absolute
+ * jump table, which can be jumped to from anywhere.
+ *
  * The format of the entries:
  *
  * typedef struct
@@ -298,22 +431,12 @@ find_jumps_in_section_syms(struct intercept_desc *desc, Elf64_Shdr *section,
  *
  */
 static void
-find_jumps_in_section_rela(struct intercept_desc *desc, Elf64_Shdr *section,
-				int fd)
+find_jumps_in_section_rela(struct intercept_desc *desc, const Elf64_Rela *syms,
+				size_t sym_count)
 {
-	assert(section->sh_type == SHT_RELA);
-
-	size_t sym_count = section->sh_size / sizeof(Elf64_Rela);
-
-	Elf64_Rela syms[sym_count];
-
-	xlseek(fd, section->sh_offset, SEEK_SET);
-	xread(fd, &syms, section->sh_size);
-
 	for (size_t i = 0; i < sym_count; ++i) {
 		switch (ELF64_R_TYPE(syms[i].r_info)) {
-			case R_X86_64_RELATIVE:
-			case R_X86_64_RELATIVE64:
+			case R_RISCV_RELATIVE:
 				/* Relocation type: "Adjust by program base" */
 
 				debug_dump("jump target: %lx\n",
@@ -329,34 +452,12 @@ find_jumps_in_section_rela(struct intercept_desc *desc, Elf64_Shdr *section,
 	}
 }
 
-/*
- * has_pow2_count
- * Checks if the positive number of patches in a struct intercept_desc
- * is a power of two or not.
- */
-static bool
-has_pow2_count(const struct intercept_desc *desc)
-{
-#ifdef __riscv_zbb
-	bool ret;
-	__asm__ volatile (
-		"cpop %0, %1\n\t"
-		"sltiu %0, %0, 2\n\t"
-		: "=r" (ret)
-		: "r" (desc->count)
-	);
-	return ret;
-#else
-	return (desc->count & (desc->count - 1)) == 0;
-#endif
-}
-
 /*
  * add_new_patch
  * Acquires a new patch entry, and allocates memory for it if
  * needed.
  */
-static struct patch_desc *
+struct patch_desc *
 add_new_patch(struct intercept_desc *desc)
 {
 	if (desc->count == 0) {
@@ -364,7 +465,7 @@ add_new_patch(struct intercept_desc *desc)
 		/* initial allocation */
 		desc->items = xmmap_anon(sizeof(desc->items[0]));
 
-	} else if (has_pow2_count(desc)) {
+	} else if (has_pow2_count(desc->count)) {
 
 		/* if count is a power of two, double the allocate space */
 		size_t size = desc->count * sizeof(desc->items[0]);
@@ -375,7 +476,7 @@ add_new_patch(struct intercept_desc *desc)
 	return &(desc->items[desc->count++]);
 }
 
-static void
+void
 fill_up_patch(struct intercept_desc *desc, struct patch_desc *patch,
 		struct intercept_disasm_result surr[], uint8_t syscall_idx)
 {
@@ -385,13 +486,11 @@ fill_up_patch(struct intercept_desc *desc, struct patch_desc *patch,
 	patch->containing_lib_path = desc->path;
 
 	/*
-	 * Using malloc/free should be safe when used before patching any
-	 * library (including glibc), which happens in activate_patches()
-	 * (patcher.c). If it is unsafe, SYS_brk or mmap can be used instead.
-	 * This gets freed in create_patch(), patcher.c.
+	 * Not malloc, this runs on the analysis workers (analysis_workers.c),
+	 * which can't use libc. The arena is released all at once at the end
+	 * of prepare_patches(), patcher.c.
 	 */
-	patch->surrounding_instrs =
-		(struct intercept_disasm_result *)malloc(surr_size);
+	patch->surrounding_instrs = xarena_alloc(&desc->surr_arena, surr_size);
 	memcpy(patch->surrounding_instrs, surr, surr_size);
 
 	patch->syscall_addr = surr[syscall_idx].address;
@@ -406,96 +505,648 @@ fill_up_patch(struct intercept_desc *desc, struct patch_desc *patch,
 }
 
 /*
- * crawl_text
- * Crawl the text section, disassembling it all.
- * This routine collects information about potential addresses to patch.
+ * add_island
+ * Describes a stub island at address as a TYPE_GW patch. Its return
+ * address is right after its jalr, as copy_GW() in patcher.c writes it.
+ * The islands are not moved once added, patches point to them.
+ */
+struct stub_island *
+add_island(struct intercept_desc *desc, uint8_t *address)
+{
+	struct stub_island *island =
+		xarena_alloc(&desc->island_arena, sizeof(*island));
+
+	memset(island, 0, sizeof(*island));
+
+	island->gw.syscall_num = TYPE_GW;
+	island->gw.return_register = REG_RA;
+	island->gw.is_skipped = true;
+	island->gw.containing_lib_path = desc->path;
+	island->gw.dst_jmp_patch = address;
+	island->gw.patch_size_bytes = ISLAND_SIZE;
+	island->gw.return_address = address + MODIFY_SP_INS_SIZE +
+					STORE_LOAD_INS_SIZE + JUMP_2GB_INS_SIZE;
+
+	island->next = desc->islands;
+	desc->islands = island;
+
+	return island;
+}
+
+/*
+ * is_nop - nop or c.nop, as the assembler pads the code with
+ */
+static bool
+is_nop(const struct intercept_disasm_result *ins)
+{
+	const unsigned char *c = ins->address;
+
+	if (ins->length == RVC_INS_SIZE)
+		return c[0] == 0x01 && c[1] == 0x00;
+
+	return ins->length == RV_INS_SIZE &&
+		c[0] == 0x13 && c[1] == 0x00 && c[2] == 0x00 && c[3] == 0x00;
+}
+
+/*
+ * is_unconditional_jump - j, jr (ret) or their compressed forms, the code
+ * right after them is not reached by falling through
+ */
+static bool
+is_unconditional_jump(const struct intercept_disasm_result *ins)
+{
+	const unsigned char *c = ins->address;
+
+	if (ins->length == RVC_INS_SIZE) {
+		uint16_t i = (uint16_t)(c[0] | c[1] << 8);
+
+		/* c.j, or c.jr with rs1 other than zero */
+		return (i & 0xe003) == 0xa001 ||
+			((i & 0xf07f) == 0x8002 && (i & 0x0f80) != 0);
+	}
+
+	uint32_t i = (uint32_t)c[0] | (uint32_t)c[1] << 8 |
+			(uint32_t)c[2] << 16 | (uint32_t)c[3] << 24;
+
+	/* jal or jalr with rd zero */
+	return ((i & 0x7f) == 0x6f || (i & 0x707f) == 0x67) &&
+		(i & 0xf80) == 0;
+}
+
+/*
+ * add_padding_island - a run of nops after an unconditional jump, ending at
+ * a jump destination (usually the next function), is only padding. When
+ * there is room for an island, it is marked as a jump destination, so no
+ * patch reaches into it.
+ */
+static void
+add_padding_island(struct intercept_desc *desc,
+		const unsigned char *start, const unsigned char *end)
+{
+	if (end - start < ISLAND_SIZE || !has_jump(desc, end))
+		return;
+
+	mark_jump(desc, start);
+	add_island(desc, (uint8_t *)start);
+}
+
+/*
+ * drop_unsafe_islands - a jump into the padding means it is executed after
+ * all, e.g. nops aligning a loop. The jump table is complete only once the
+ * crawl is done.
+ */
+static void
+drop_unsafe_islands(struct intercept_desc *desc)
+{
+	struct stub_island **link = &desc->islands;
+	unsigned count = 0;
+
+	while (*link != NULL) {
+		const uint8_t *start = (*link)->gw.dst_jmp_patch;
+		bool is_safe = true;
+
+		for (const uint8_t *addr = start + RVC_INS_SIZE;
+		    addr < start + ISLAND_SIZE; addr += RVC_INS_SIZE)
+			is_safe = is_safe && !has_jump(desc, addr);
+
+		if (is_safe) {
+			link = &(*link)->next;
+			++count;
+		} else {
+			*link = (*link)->next;
+		}
+	}
+
+	debug_dump("%s: %u stub islands in the padding\n", desc->path, count);
+}
+
+/*
+ * The encoding of ecall. There is no compressed form of it, and it starts at
+ * any 2-byte aligned address when the code uses the C extension.
+ */
+#define ECALL_ENCODING		0x00000073u
+#define ECALL_ENCODING_LOW	0x0073u
+
+static inline bool
+is_ecall_encoding(const unsigned char *address)
+{
+	uint32_t word;
+
+	memcpy(&word, address, sizeof(word));
+
+	return word == ECALL_ENCODING;
+}
+
+/*
+ * find_ecall_encoding
+ * Returns the first 2-byte aligned address in [code, last] where the 4 bytes
+ * of an ecall start, or NULL. This is only a candidate: it can also be data,
+ * or the middle of some other instruction, decoding decides that.
  *
- * The addresses of all syscall instructions are stored, together with
- * a description of the preceding, and following instructions.
+ * The text is read 8 bytes at a time. XORing a word with the low halfword of
+ * ecall in each lane turns every matching halfword to zero, and the usual
+ * "has a zero lane" bit trick finds them. Most words contain no match, so the
+ * halfwords are only looked at one by one in the rare words that do.
+ */
+static const unsigned char *
+find_ecall_encoding(const unsigned char *code, const unsigned char *last)
+{
+	const uint64_t lanes_one = 0x0001000100010001ull;
+	const uint64_t lanes_high = 0x8000800080008000ull;
+	const uint64_t lanes_ecall = lanes_one * ECALL_ENCODING_LOW;
+
+	while (code <= last && ((uintptr_t)code % sizeof(uint64_t)) != 0) {
+		if (is_ecall_encoding(code))
+			return code;
+		code += 2;
+	}
+
+	/* the last lane of a word is the start of a 4 byte candidate too */
+	while (last - code >= 6) {
+		uint64_t word;
+
+		memcpy(&word, code, sizeof(word));
+		word ^= lanes_ecall;
+
+		if (((word - lanes_one) & ~word & lanes_high) != 0) {
+			for (unsigned i = 0; i < sizeof(word); i += 2) {
+				if (is_ecall_encoding(code + i))
+					return code + i;
+			}
+		}
+
+		code += sizeof(word);
+	}
+
+	while (code <= last) {
+		if (is_ecall_encoding(code))
+			return code;
+		code += 2;
+	}
+
+	return NULL;
+}
+
+/*
+ * sift_down -- the usual heap sort step, moves the element at root down
+ * into its place in the max heap of the first count elements.
+ */
+static void
+sift_down(const unsigned char **heap, size_t root, size_t count)
+{
+	const unsigned char *elem = heap[root];
+
+	while (2 * root + 1 < count) {
+		size_t child = 2 * root + 1;
+
+		if (child + 1 < count && heap[child + 1] > heap[child])
+			++child;
+
+		if (heap[child] <= elem)
+			break;
+
+		heap[root] = heap[child];
+		root = child;
+	}
+
+	heap[root] = elem;
+}
+
+/*
+ * sort_func_starts
+ * Sorts the function entry points collected from the symbol tables. The
+ * same function is usually found in both .symtab and .dynsym, these
+ * duplicates are harmless for find_window().
+ * Not qsort(3), which might call malloc, and this runs on the analysis
+ * workers (analysis_workers.c).
+ */
+static void
+sort_func_starts(struct intercept_desc *desc)
+{
+	const unsigned char **starts = desc->func_starts;
+	size_t count = desc->func_start_count;
+
+	for (size_t i = count / 2; i > 0; --i)
+		sift_down(starts, i - 1, count);
+
+	while (count > 1) {
+		const unsigned char *max = starts[0];
+
+		--count;
+		starts[0] = starts[count];
+		starts[count] = max;
+		sift_down(starts, 0, count);
+	}
+}
+
+/*
+ * release_func_starts -- they are not needed after crawl_text()
+ */
+static void
+release_func_starts(struct intercept_desc *desc)
+{
+	size_t count = desc->func_start_count;
+	size_t size = sizeof(desc->func_starts[0]);
+
+	if (count == 0)
+		return;
+
+	/* the array was doubled each time count reached a power of two */
+	while (!has_pow2_count(count))
+		count &= count - 1;
+	if (count < desc->func_start_count)
+		count *= 2;
+
+	xmunmap(desc->func_starts, count * size);
+	desc->func_starts = NULL;
+	desc->func_start_count = 0;
+}
+
+/*
+ * find_window
+ * The part of the text section to decode around a candidate ecall: from the
+ * closest function entry point at or before it, to the next one after it.
+ * Both are instruction boundaries, and both are marked as jump destinations,
+ * so no patch can extend beyond them anyway.
+ */
+static void
+find_window(const struct intercept_desc *desc, const unsigned char *candidate,
+		const unsigned char **begin, const unsigned char **stop)
+{
+	size_t low = 0;
+	size_t high = desc->func_start_count;
+
+	/* the first entry point after the candidate */
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		if (desc->func_starts[mid] <= candidate)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == 0)
+		*begin = desc->text_start;
+	else
+		*begin = desc->func_starts[low - 1];
+
+	if (low == desc->func_start_count)
+		*stop = desc->text_end + 1;
+	else
+		*stop = desc->func_starts[low];
+}
+
+/*
+ * The instructions seen last while crawling, in a ring buffer indexed by a
+ * running counter, so adding one is a single store instead of shifting the
+ * whole window. The ring is a power of two larger than the window, the
+ * instruction being decoded goes to the slot after the window, and becomes
+ * part of it only when it turns out to be a valid one.
+ */
+#define SURR_RING_SIZE 16
+
+struct surr_ring {
+	struct intercept_disasm_result instrs[SURR_RING_SIZE];
+	/* the number of instructions added so far */
+	uint32_t head;
+};
+
+_Static_assert(SURR_RING_SIZE > SURROUNDING_INSTRS_NUM &&
+	(SURR_RING_SIZE & (SURR_RING_SIZE - 1)) == 0, "bad surr_ring size");
+
+/* the instruction at index i of the window, the oldest is at 0 */
+static inline struct intercept_disasm_result *
+surr_ring_at(struct surr_ring *ring, uint8_t i)
+{
+	uint32_t pos = ring->head - SURROUNDING_INSTRS_NUM + i;
+
+	return &ring->instrs[pos & (SURR_RING_SIZE - 1)];
+}
+
+/* the slot following the window */
+static inline struct intercept_disasm_result *
+surr_ring_next(struct surr_ring *ring)
+{
+	return &ring->instrs[ring->head & (SURR_RING_SIZE - 1)];
+}
+
+/* copy the window, starting at index first, to a plain array */
+static void
+surr_ring_copy(struct surr_ring *ring, uint8_t first,
+		struct intercept_disasm_result *dst)
+{
+	for (uint8_t i = first; i < SURROUNDING_INSTRS_NUM; ++i)
+		dst[i - first] = *surr_ring_at(ring, i);
+}
+
+/*
+ * A switch is compiled to an indirect jump through a table of the cases,
+ * e.g.:
  *
- * A lookup table of all addresses which appear as jump destination is
- * generated, to help determine later, whether an instruction is suitable
- * for being overwritten -- of course, if an instruction is a jump destination,
- * it can not be merged with the preceding instruction to create a
- * new larger one.
+ *	lla	a5, .Ltable	(auipc a5, ... ; addi a5, a5, ...)
+ *	slli	a0, a0, 2
+ *	add	a0, a0, a5
+ *	lw	a0, 0(a0)
+ *	add	a0, a0, a5
+ *	jr	a0
  *
- * Note: The actual patching can not yet be done in this disassembling phase,
- * as it is not known in advance, which addresses are jump destinations.
+ * No branch points to the cases, so the addresses computed with auipc, or
+ * with lui in code that is not position independent, are followed in the
+ * registers, and at an indirect jump that is not a return, the entries of
+ * the tables any of them point to are marked as jump destinations. An
+ * entry is the offset of a case from the table, or its 32 or 64 bit
+ * address, a table ends at the first entry pointing outside the function
+ * being decoded. Marking too much only makes patches smaller.
  */
+#define JUMP_TABLE_MAX_ENTRIES	0x400
+
 static void
-crawl_text(struct intercept_desc *desc)
+track_addresses(const unsigned char **reg_addrs,
+		const struct intercept_disasm_result *ins)
+{
+	const unsigned char *value = NULL;
+	uint32_t raw = 0;
+
+	if (ins->length == RV_INS_SIZE)
+		memcpy(&raw, ins->address, sizeof(raw));
+
+	uint8_t rd = (raw >> 7) & 0x1f;
+	uint8_t rs1 = (raw >> 15) & 0x1f;
+
+	if ((raw & 0x7f) == 0x17) /* auipc */
+		value = ins->address + (int32_t)(raw & 0xfffff000);
+	else if ((raw & 0x7f) == 0x37) /* lui */
+		value = (const unsigned char *)(intptr_t)
+			(int32_t)(raw & 0xfffff000);
+	else if ((raw & 0x707f) == 0x13 && reg_addrs[rs1] != NULL) /* addi */
+		value = reg_addrs[rs1] + ((int32_t)raw >> 20);
+
+	for (uint8_t reg = 1; reg < 32; ++reg) {
+		if (ins->regs_written & (1u << reg))
+			reg_addrs[reg] = NULL;
+	}
+
+	if (value != NULL && rd != 0)
+		reg_addrs[rd] = value;
+}
+
+static unsigned
+mark_table_entries(const struct intercept_desc *desc,
+		const unsigned char *table, size_t entry_size, bool is_relative,
+		const unsigned char *begin, const unsigned char *stop)
+{
+	const uint8_t *end = get_segment_end(desc, table);
+	unsigned count = 0;
+
+	if (end == NULL)
+		return 0;
+
+	for (const unsigned char *entry = table;
+	    (size_t)(end - entry) >= entry_size &&
+	    count < JUMP_TABLE_MAX_ENTRIES; entry += entry_size) {
+		const unsigned char *target;
+		int32_t offset;
+		uint32_t address32;
+		uint64_t address64;
+
+		if (entry_size == sizeof(address64)) {
+			memcpy(&address64, entry, sizeof(address64));
+			target = (const unsigned char *)(uintptr_t)address64;
+		} else if (is_relative) {
+			memcpy(&offset, entry, sizeof(offset));
+			target = table + offset;
+		} else {
+			memcpy(&address32, entry, sizeof(address32));
+			target = (const unsigned char *)(uintptr_t)address32;
+		}
+
+		if (target < begin || target >= stop ||
+		    ((uintptr_t)target & 1) != 0)
+			break;
+
+		mark_jump(desc, target);
+		++count;
+	}
+
+	return count;
+}
+
+static void
+mark_indirect_targets(const struct intercept_desc *desc,
+		const unsigned char **reg_addrs,
+		const struct intercept_disasm_result *ins,
+		const unsigned char *begin, const unsigned char *stop)
+{
+	/* jr, not a ret, nor a call */
+	if (!ins->is_abs_jump || ins->regs_written != 0 ||
+	    ins->regs_read == 1u << REG_RA)
+		return;
+
+	for (uint8_t reg = 1; reg < 32; ++reg) {
+		const unsigned char *table = reg_addrs[reg];
+
+		if (table == NULL)
+			continue;
+
+		/* jumping to the address itself */
+		if (ins->regs_read & (1u << reg))
+			mark_jump(desc, table);
+
+		if (mark_table_entries(desc, table, 4, true,
+				begin, stop) == 0 &&
+		    mark_table_entries(desc, table, 4, false,
+				begin, stop) == 0)
+			mark_table_entries(desc, table, 8, false, begin, stop);
+	}
+}
+
+/*
+ * crawl_range
+ * Disassembles the code from begin, and collects the syscall instructions
+ * found before stop. Decoding goes on for a few instructions after stop, so
+ * that the last syscalls have all their following instructions described.
+ * The range is a function, or the whole text, the targets of the jump tables
+ * found are in it.
+ *
+ * The addresses of all syscall instructions are stored, together with
+ * a description of the preceding, and following instructions.
+ * Returns the number of instructions decoded.
+ */
+static size_t
+crawl_range(struct intercept_desc *desc,
+		struct intercept_disasm_context *context,
+		const unsigned char *begin, const unsigned char *stop)
 {
-	unsigned char *code = desc->text_start;
+	const unsigned char *code = begin;
+	size_t decoded = 0;
 
 	uint8_t instrs_num = SURROUNDING_INSTRS_NUM;
 
-	/*
-	 * Remember the previous three instructions, while
-	 * disassembling the code instruction by instruction in the
-	 * while loop below.
-	 */
-	struct intercept_disasm_result surr[SURROUNDING_INSTRS_NUM] = {{0}};
+	/* instructions to decode after stop, see below */
+	uint8_t past_stop = SURROUNDING_INSTRS_NUM - SYSCALL_IDX - 1;
 
 	/*
-	 * How many previous instructions were decoded before this one,
-	 * and stored in the surr array. Usually three, except for the
-	 * beginning of the text section -- the first instruction naturally
-	 * has no previous instruction.
+	 * Remember the previous instructions, while disassembling the code
+	 * instruction by instruction in the while loop below. The syscall
+	 * at SYSCALL_IDX is recorded once all the instructions following it
+	 * are decoded.
 	 */
-	struct intercept_disasm_context *context =
-	    intercept_disasm_init(desc->text_start, desc->text_end);
+	struct surr_ring ring = {0};
+	struct intercept_disasm_result surr[SURROUNDING_INSTRS_NUM];
+
+	/* nops following an unconditional jump, see add_padding_island */
+	const unsigned char *nop_run = NULL;
+	bool after_jump = false;
+
+	/* the addresses known to be in the registers, see track_addresses */
+	const unsigned char *reg_addrs[32] = {NULL};
 
 	while (code <= desc->text_end) {
-		struct intercept_disasm_result result;
+		struct intercept_disasm_result *result = surr_ring_next(&ring);
+
+		if (code >= stop && past_stop-- == 0)
+			break;
 
-		result = intercept_disasm_next_instruction(context, code);
+		*result = intercept_disasm_next_instruction(context, code);
 
-		if (result.length == 0) {
+		if (result->length == 0) {
+			nop_run = NULL;
+			after_jump = false;
 			++code;
 			continue;
 		}
 
-		if (result.has_ip_relative_opr)
-			mark_jump(desc, result.rip_ref_addr);
+		++decoded;
+
+		if (result->has_ip_relative_opr)
+			mark_jump(desc, result->rip_ref_addr);
+
+		mark_indirect_targets(desc, reg_addrs, result, begin, stop);
+		track_addresses(reg_addrs, result);
+
+		if (is_nop(result)) {
+			if (nop_run == NULL && after_jump && code < stop)
+				nop_run = code;
+		} else {
+			if (nop_run != NULL)
+				add_padding_island(desc, nop_run, code);
 
-		if (surr[SYSCALL_IDX].is_syscall) {
+			nop_run = NULL;
+			after_jump = is_unconditional_jump(result);
+		}
+
+		if (surr_ring_at(&ring, SYSCALL_IDX)->is_syscall) {
 			struct patch_desc *patch = add_new_patch(desc);
+
+			surr_ring_copy(&ring, 0, surr);
 			fill_up_patch(desc, patch, surr, SYSCALL_IDX);
 		}
 
-		// shift each element to the left (decrement), FIFO
-		memmove(surr, surr + 1, (instrs_num - 1) *
-			sizeof(struct intercept_disasm_result));
-		surr[instrs_num - 1] = result;
-
-		code += result.length;
+		code += result->length;
+		++ring.head;
 	}
 
 	/*
-	 * Last instrs in .text (from SYSCALL_IDX to the end of .text)
-	 * could not be checked for ecall before, so it is done here
+	 * Last instrs (from SYSCALL_IDX to the end of the range) could not be
+	 * checked for ecall before, so it is done here, each of them is moved
+	 * to SYSCALL_IDX, without instructions after the last one.
 	 */
 	for (uint8_t i = SYSCALL_IDX; i < instrs_num; ++i) {
-		if (!surr[i].is_syscall)
+		const struct intercept_disasm_result *ins =
+			surr_ring_at(&ring, i);
+
+		if (!ins->is_syscall || ins->address >= stop)
 			continue;
 
 		uint8_t offset = i - SYSCALL_IDX;
 
-		if (offset > 0) {
-			// centralize ecall
-			memmove(surr, surr + offset, (instrs_num - offset) *
-				sizeof(struct intercept_disasm_result));
-
-			// unset redundant last surr instrs
-			memset(surr + (instrs_num - offset), 0, offset *
-				sizeof(struct intercept_disasm_result));
-		}
+		surr_ring_copy(&ring, offset, surr);
+		memset(surr + (instrs_num - offset), 0, offset *
+			sizeof(struct intercept_disasm_result));
 
 		struct patch_desc *patch = add_new_patch(desc);
-		fill_up_patch(desc, patch, surr, i);
+		fill_up_patch(desc, patch, surr, SYSCALL_IDX);
+	}
+
+	return decoded;
+}
+
+/*
+ * crawl_text
+ * Crawl the text section, disassembling the parts of it that contain
+ * syscall instructions.
+ * This routine collects information about potential addresses to patch.
+ *
+ * The text is first scanned for the encoding of ecall, which is cheap, and
+ * only the functions around such candidates are disassembled. A function is
+ * decoded from its entry point (see find_window), so the instruction
+ * boundaries are right, and all branches within it are seen.
+ *
+ * A lookup table of addresses which appear as jump destination is
+ * generated, to help determine later, whether an instruction is suitable
+ * for being overwritten -- of course, if an instruction is a jump destination,
+ * it can not be merged with the preceding instruction to create a
+ * new larger one. The table is only complete in the functions that were
+ * decoded, which are the only ones patched. Jumps into the middle of a
+ * function from another one are not seen this way, which hand written
+ * assembly might do. With INTERCEPT_FULL_CRAWL the whole text section is
+ * disassembled, as before.
+ *
+ * Note: The actual patching can not yet be done in this disassembling phase,
+ * as it is not known in advance, which addresses are jump destinations.
+ */
+static void
+crawl_text(struct intercept_desc *desc)
+{
+	struct intercept_disasm_context *context =
+	    intercept_disasm_init(desc->text_start, desc->text_end);
+
+	const char *e = getenv("INTERCEPT_FULL_CRAWL");
+
+	if (e != NULL && e[0] != '0') {
+		intercept_stats_add(STATS_DECODED_INSTRS,
+		    crawl_range(desc, context, desc->text_start,
+				desc->text_end + 1));
+		intercept_stats_add(STATS_DECODED_BYTES,
+		    (uint64_t)(desc->text_end - desc->text_start) + 1);
+		intercept_disasm_destroy(context);
+		drop_unsafe_islands(desc);
+		return;
+	}
+
+	sort_func_starts(desc);
+
+	const unsigned char *code = desc->text_start;
+	const unsigned char *last = desc->text_end - 3;
+	const unsigned char *candidate;
+	size_t decoded_bytes = 0;
+	size_t decoded_instrs = 0;
+	unsigned windows = 0;
+
+	while (code <= last &&
+	    (candidate = find_ecall_encoding(code, last)) != NULL) {
+		const unsigned char *begin;
+		const unsigned char *stop;
+
+		find_window(desc, candidate, &begin, &stop);
+		decoded_instrs += crawl_range(desc, context, begin, stop);
+
+		decoded_bytes += (size_t)(stop - begin);
+		++windows;
+
+		code = stop;
 	}
 
+	debug_dump("%s: decoded %zu of %zu bytes of text in %u windows\n",
+	    desc->path, decoded_bytes,
+	    (size_t)(desc->text_end - desc->text_start + 1), windows);
+
+	intercept_stats_add(STATS_DECODED_BYTES, decoded_bytes);
+	intercept_stats_add(STATS_DECODED_INSTRS, decoded_instrs);
+
 	intercept_disasm_destroy(context);
+	drop_unsafe_islands(desc);
 }
 
 /*
@@ -533,26 +1184,91 @@ get_min_address(void)
 }
 
 /*
- * allocate_trampoline_table
- * Allocates memory close to a text section (close enough
- * to be reachable with 32 bit displacements in jmp instructions).
- * Using mmap syscall with MAP_FIXED flag.
+ * is_in_2GB_reach - can every instruction of the text section reach every
+ * address in [start, end) with auipc and jalr
  */
-void
-allocate_trampoline(struct intercept_desc *desc)
+static bool
+is_in_2GB_reach(const struct intercept_desc *desc,
+		const uint8_t *start, const uint8_t *end)
 {
-	char *e = getenv("INTERCEPT_NO_TRAMPOLINE");
+	intptr_t max_delta = (intptr_t)((uintptr_t)end -
+				(uintptr_t)desc->text_start);
+	intptr_t min_delta = (intptr_t)((uintptr_t)start -
+				(uintptr_t)desc->text_end);
 
-	/* Use the extra trampoline table by default */
-	desc->uses_trampoline = (e == NULL) || (e[0] == '0');
+	return max_delta <= JUMP_2GB_POS_REACH &&
+		min_delta >= JUMP_2GB_NEG_REACH;
+}
 
-	if (!desc->uses_trampoline) {
-		desc->trampoline_address = NULL;
-		return;
+/*
+ * The trampolines of all the objects are allocated from a few pools, an
+ * object takes its trampolines from the first pool within its reach. Objects
+ * are usually loaded close to each other, thus they share the same pages.
+ */
+struct trampoline_pool {
+	uint8_t *start;
+	size_t size;
+	size_t used;
+};
+
+#define TRAMPOLINE_POOLS_MAX 0x40
+
+static struct trampoline_pool trampoline_pools[TRAMPOLINE_POOLS_MAX];
+static unsigned trampoline_pool_count;
+
+/*
+ * map_near
+ * Maps size bytes of executable memory between lowest and highest,
+ * using mmap syscall with MAP_FIXED_NOREPLACE flag. Returns NULL if there
+ * is no gap that large there.
+ */
+static uint8_t *
+map_near(uintptr_t lowest, uintptr_t highest, size_t size)
+{
+	if (lowest < get_min_address())
+		lowest = get_min_address();
+
+	/*
+	 * The first gap in the snapshot of the mappings (proc_maps.c) that
+	 * is large enough. The snapshot might miss some mappings made since
+	 * it was read, MAP_FIXED_NOREPLACE does not overwrite them, in that
+	 * case the snapshot is read again and the search repeated.
+	 */
+	for (int attempt = 0; ; ++attempt) {
+		uintptr_t gap = proc_maps_find_gap(lowest, size);
+
+		if (gap + size > highest || gap + size < gap)
+			return NULL; /* Too far away */
+
+		long addr = syscall_no_intercept(SYS_mmap, gap, size,
+					PROT_READ | PROT_WRITE | PROT_EXEC,
+					MAP_FIXED_NOREPLACE | MAP_PRIVATE |
+					MAP_ANON, -1, (off_t)0);
+
+		if ((uintptr_t)addr == gap) {
+			proc_maps_add(gap, gap + size);
+			return (uint8_t *)gap;
+		}
+
+		/* kernels before 4.17 take it as a hint, and map elsewhere */
+		if ((unsigned long)addr < -4095UL)
+			xmunmap((void *)addr, size);
+
+		if (attempt > 0)
+			xabort("unable to map memory near the text");
+
+		proc_maps_load();
 	}
+}
 
-	FILE *maps;
-	char line[0x2000];
+/*
+ * map_trampoline_pool
+ * Allocates memory close to a text section (close enough
+ * to be reachable with 32 bit displacements in jmp instructions).
+ */
+static uint8_t *
+map_trampoline_pool(const struct intercept_desc *desc, size_t size)
+{
 	unsigned char *guess; /* Where we would like to allocate the table */
 
 	if ((uintptr_t)desc->text_end < INT32_MAX) {
@@ -570,54 +1286,255 @@ allocate_trampoline(struct intercept_desc *desc)
 				& ~((uintptr_t)(0xfff))) + 0x1000;
 	}
 
-	if ((uintptr_t)guess < get_min_address())
-		guess = (void *)get_min_address();
+	uint8_t *pool = map_near((uintptr_t)guess,
+			(uintptr_t)desc->text_start + JUMP_2GB_POS_REACH, size);
 
-	if ((maps = fopen("/proc/self/maps", "r")) == NULL)
-		xabort("fopen /proc/self/maps");
+	if (pool == NULL || !is_in_2GB_reach(desc, pool, pool + size))
+		xabort("unable to find place for trampoline");
 
-	while ((fgets(line, sizeof(line), maps)) != NULL) {
-		unsigned char *start;
-		unsigned char *end;
+	return pool;
+}
 
-		if (sscanf(line, "%p-%p", (void **)&start, (void **)&end) != 2)
-			xabort("sscanf from /proc/self/maps");
+/*
+ * map_island
+ * Maps a page for a stub island within JAL reach of near, the jal of a
+ * patch. Returns NULL if there is no room for it.
+ */
+uint8_t *
+map_island(const uint8_t *near)
+{
+	uintptr_t lowest = 0;
+	uintptr_t reach = JAL_AVG_REACH - ISLAND_SIZE;
 
-		/*
-		 * Let's see if an existing mapping overlaps
-		 * with the guess!
-		 */
-		if (end < guess)
-			continue; /* No overlap, let's see the next mapping */
+	if ((uintptr_t)near > reach)
+		lowest = ((uintptr_t)near - reach + PAGE_SIZE - 1) &
+				~(PAGE_SIZE - 1);
 
-		if (start >= guess + TRAMPOLINE_SIZE) {
-			/* The rest of the mappings can't possibly overlap */
-			break;
+	return map_near(lowest, (uintptr_t)near + reach, PAGE_SIZE);
+}
+
+/*
+ * get_trampoline_pool - a pool within the reach of the text section, with
+ * size bytes left in it
+ */
+static struct trampoline_pool *
+get_trampoline_pool(const struct intercept_desc *desc, size_t size)
+{
+	struct trampoline_pool *pool;
+
+	for (unsigned i = 0; i < trampoline_pool_count; ++i) {
+		pool = trampoline_pools + i;
+
+		if (pool->size - pool->used >= size &&
+		    is_in_2GB_reach(desc, pool->start + pool->used,
+				pool->start + pool->used + size))
+			return pool;
+	}
+
+	if (trampoline_pool_count < TRAMPOLINE_POOLS_MAX) {
+		pool = trampoline_pools + trampoline_pool_count++;
+	} else {
+		/* forget the pool with the least space left in it */
+		pool = trampoline_pools;
+		for (unsigned i = 1; i < TRAMPOLINE_POOLS_MAX; ++i) {
+			struct trampoline_pool *other = trampoline_pools + i;
+
+			if (other->size - other->used <
+			    pool->size - pool->used)
+				pool = other;
 		}
+	}
 
-		/*
-		 * The next guess is the page following the mapping seen
-		 * just now.
-		 */
-		guess = end;
+	pool->size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	pool->start = map_trampoline_pool(desc, pool->size);
+	pool->used = 0;
+
+	return pool;
+}
+
+/*
+ * allocate_trampoline
+ * The GWs jump to their dispatch in the relocation space with auipc and
+ * jalr, when it is within 2GB of the text section. Otherwise every GW gets
+ * its own trampoline, close enough to the text section, that loads the
+ * address of the dispatch from a literal next to it (see copy_trampoline in
+ * patcher.c).
+ * With INTERCEPT_NO_TRAMPOLINE set, an object out of reach is an error.
+ */
+void
+allocate_trampoline(struct intercept_desc *desc)
+{
+	extern uint8_t asm_relocation_space[];
+	extern uint64_t asm_relocation_space_size;
+
+	desc->trampoline_address = NULL;
+	desc->trampoline_size = 0;
+	desc->uses_trampoline = !is_in_2GB_reach(desc, asm_relocation_space,
+			asm_relocation_space + asm_relocation_space_size);
+
+	if (!desc->uses_trampoline)
+		return;
+
+	char *e = getenv("INTERCEPT_NO_TRAMPOLINE");
+
+	if (e != NULL && e[0] != '0')
+		xabort("relocation space out of reach without trampoline");
+
+	for (unsigned i = 0; i < desc->count; ++i) {
+		const struct patch_desc *patch = desc->items + i;
+
+		if (patch->syscall_num == TYPE_GW && !patch->is_skipped)
+			desc->trampoline_size += TRAMPOLINE_SIZE;
+	}
+
+	for (const struct stub_island *island = desc->islands;
+	    island != NULL; island = island->next) {
+		if (!island->gw.is_skipped)
+			desc->trampoline_size += TRAMPOLINE_SIZE;
+	}
+
+	if (desc->trampoline_size == 0)
+		return;
+
+	struct trampoline_pool *pool =
+		get_trampoline_pool(desc, desc->trampoline_size);
+
+	desc->trampoline_address = pool->start + pool->used;
+	pool->used += desc->trampoline_size;
+
+	debug_dump("%s: %zu bytes of trampolines at 0x%016" PRIxPTR "\n",
+	    desc->path, desc->trampoline_size,
+	    (uintptr_t)desc->trampoline_address);
+}
+
+/*
+ * get_loaded_address -- the address of a d_ptr value in PT_DYNAMIC. The
+ * dynamic linker relocates these on most architectures, but not on RISC-V
+ * where the dynamic section is read-only, so both forms are handled.
+ */
+static const void *
+get_loaded_address(const struct intercept_desc *desc, Elf64_Addr value)
+{
+	if (value < (uintptr_t)desc->base_addr)
+		return desc->base_addr + value;
+
+	return (const void *)(uintptr_t)value;
+}
+
+/*
+ * count_gnu_hash_syms -- DT_GNU_HASH does not store the number of symbols,
+ * but no chain goes past the last symbol, and the last entry of a chain
+ * has its lowest bit set.
+ */
+static size_t
+count_gnu_hash_syms(const Elf64_Word *table)
+{
+	Elf64_Word bucket_count = table[0];
+	Elf64_Word first_sym = table[1];
+	Elf64_Word bloom_size = table[2];
+
+	/* the bloom filter is made of 64 bit words */
+	const Elf64_Word *buckets = table + 4 + 2 * bloom_size;
+	const Elf64_Word *chains = buckets + bucket_count;
+	Elf64_Word last_sym = 0;
+
+	for (Elf64_Word i = 0; i < bucket_count; ++i) {
+		if (buckets[i] > last_sym)
+			last_sym = buckets[i];
+	}
+
+	if (last_sym < first_sym)
+		return first_sym;
+
+	while ((chains[last_sym - first_sym] & 1) == 0)
+		++last_sym;
 
-		if (guess >= desc->text_start + JUMP_2GB_POS_REACH) {
-			/* Too far away */
-			xabort("unable to find place for trampoline");
+	return last_sym + 1;
+}
+
+/*
+ * find_loaded_tables
+ * When the object file can not be read, whatever is loaded of it is used:
+ * the executable PT_LOAD segment in place of the text section, and the
+ * .dynsym and relocations found through PT_DYNAMIC in place of the symbol
+ * and relocation tables. Without .symtab fewer functions are known from
+ * the symbols, the unwind tables are loaded however (eh_frame.c).
+ */
+static void
+find_loaded_tables(struct intercept_desc *desc)
+{
+	const Elf64_Dyn *dynamic = NULL;
+	bool text_found = false;
+
+	for (Elf64_Half i = 0; i < desc->phnum; ++i) {
+		const Elf64_Phdr *segment = desc->phdrs + i;
+
+		if (segment->p_type == PT_LOAD &&
+		    (segment->p_flags & PF_X) != 0 && !text_found) {
+			desc->text_offset = segment->p_offset;
+			desc->text_start = desc->base_addr + segment->p_vaddr;
+			desc->text_end =
+				desc->text_start + segment->p_filesz - 1;
+			text_found = true;
+		} else if (segment->p_type == PT_DYNAMIC) {
+			dynamic = (const Elf64_Dyn *)
+				(desc->base_addr + segment->p_vaddr);
 		}
 	}
 
-	fclose(maps);
+	if (!text_found)
+		xabort("executable segment not found");
 
-	desc->trampoline_address = mmap(guess, TRAMPOLINE_SIZE,
-					PROT_READ | PROT_WRITE | PROT_EXEC,
-					MAP_FIXED | MAP_PRIVATE | MAP_ANON,
-					-1, 0);
+	desc->text_section_index = SHN_UNDEF;
+	allocate_jump_table(desc);
+
+	if (dynamic == NULL)
+		return;
 
-	if (desc->trampoline_address == MAP_FAILED)
-		xabort("unable to allocate space for trampoline");
+	const Elf64_Sym *syms = NULL;
+	const Elf64_Word *hash = NULL;
+	const Elf64_Word *gnu_hash = NULL;
+	const Elf64_Rela *relas = NULL;
+	size_t relas_size = 0;
+
+	for (const Elf64_Dyn *entry = dynamic; entry->d_tag != DT_NULL;
+	    ++entry) {
+		switch (entry->d_tag) {
+		case DT_SYMTAB:
+			syms = get_loaded_address(desc, entry->d_un.d_ptr);
+			break;
+		case DT_HASH:
+			hash = get_loaded_address(desc, entry->d_un.d_ptr);
+			break;
+		case DT_GNU_HASH:
+			gnu_hash = get_loaded_address(desc, entry->d_un.d_ptr);
+			break;
+		case DT_RELA:
+			relas = get_loaded_address(desc, entry->d_un.d_ptr);
+			break;
+		case DT_RELASZ:
+			relas_size = entry->d_un.d_val;
+			break;
+		}
+	}
 
-	__builtin___clear_cache((char *)guess, (char *)(guess + TRAMPOLINE_SIZE));
+	size_t sym_count = 0;
+
+	/* the number of chains in DT_HASH is the number of symbols */
+	if (hash != NULL)
+		sym_count = hash[1];
+	else if (gnu_hash != NULL)
+		sym_count = count_gnu_hash_syms(gnu_hash);
+
+	debug_dump("%s: %zu dynamic symbols, %zu relocations\n", desc->path,
+	    sym_count, relas_size / sizeof(Elf64_Rela));
+
+	if (syms != NULL)
+		find_jumps_in_section_syms(desc, syms, sym_count);
+
+	if (relas != NULL)
+		find_jumps_in_section_rela(desc, relas,
+		    relas_size / sizeof(Elf64_Rela));
 }
 
 /*
@@ -628,6 +1545,8 @@ allocate_trampoline(struct intercept_desc *desc)
  * This code is intentionally independent of the disassembling library used,
  * such specific code is in wrapper functions in the disasm_wrapper.c source
  * file.
+ * With INTERCEPT_CACHE_DIR, the results are read from the analysis cache
+ * instead, if it has them (analysis_cache.c).
  */
 void
 find_syscalls(struct intercept_desc *desc)
@@ -638,26 +1557,73 @@ find_syscalls(struct intercept_desc *desc)
 	    (uintptr_t)desc->base_addr);
 
 	desc->count = 0;
+	desc->func_starts = NULL;
+	desc->func_start_count = 0;
+	desc->islands = NULL;
 
+	uint64_t start = intercept_stats_time();
 	int fd = open_orig_file(desc);
 
-	find_sections(desc, fd);
+	if (fd < 0) {
+		debug_dump("%s can not be opened (%d), using its segments\n",
+		    desc->path, -fd);
+		find_loaded_tables(desc);
+		find_jumps_in_eh_frame(desc);
+		intercept_stats_phase(STATS_FIND_SECTIONS, start);
+
+		start = intercept_stats_time();
+		crawl_text(desc);
+		release_func_starts(desc);
+		intercept_stats_phase(STATS_CRAWL_TEXT, start);
+		return;
+	}
+
+	if (load_analysis_cache(desc, fd)) {
+		syscall_no_intercept(SYS_close, fd);
+		intercept_stats_add(STATS_CACHED_OBJECTS, 1);
+		return;
+	}
+
+	struct elf_file file;
+
+	map_orig_file(&file, fd);
+
+	find_sections(desc, &file);
+	intercept_stats_phase(STATS_FIND_SECTIONS, start);
 	debug_dump(
 	    "%s .text mapped at 0x%016" PRIxPTR " - 0x%016" PRIxPTR " \n",
 	    desc->path,
 	    (uintptr_t)desc->text_start,
 	    (uintptr_t)desc->text_end);
+	start = intercept_stats_time();
 	allocate_jump_table(desc);
 
-	for (Elf64_Half i = 0; i < desc->symbol_tables.count; ++i)
+	for (Elf64_Half i = 0; i < desc->symbol_tables.count; ++i) {
+		const Elf64_Shdr *section = desc->symbol_tables.headers + i;
+
 		find_jumps_in_section_syms(desc,
-		    desc->symbol_tables.headers + i, fd);
+		    get_file_range(&file, section->sh_offset, section->sh_size),
+		    section->sh_size / sizeof(Elf64_Sym));
+	}
+
+	for (Elf64_Half i = 0; i < desc->rela_tables.count; ++i) {
+		const Elf64_Shdr *section = desc->rela_tables.headers + i;
 
-	for (Elf64_Half i = 0; i < desc->rela_tables.count; ++i)
 		find_jumps_in_section_rela(desc,
-		    desc->rela_tables.headers + i, fd);
+		    get_file_range(&file, section->sh_offset, section->sh_size),
+		    section->sh_size / sizeof(Elf64_Rela));
+	}
 
-	syscall_no_intercept(SYS_close, fd);
+	unmap_orig_file(&file);
+	find_jumps_in_eh_frame(desc);
+	intercept_stats_phase(STATS_MARK_JUMPS, start);
 
+	start = intercept_stats_time();
 	crawl_text(desc);
+	release_func_starts(desc);
+	intercept_stats_phase(STATS_CRAWL_TEXT, start);
+
+	store_analysis_cache(desc, fd);
+
+	syscall_no_intercept(SYS_close, fd);
 }
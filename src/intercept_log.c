@@ -950,6 +950,16 @@ intercept_log(const char *buffer, size_t len)
 		syscall_no_intercept(SYS_write, log_fd, buffer, len);
 }
 
+/*
+ * intercept_log_is_enabled
+ * Returns true if a log was opened, i.e. syscalls are logged.
+ */
+bool
+intercept_log_is_enabled(void)
+{
+	return log_fd >= 0;
+}
+
 /*
  * intercept_log_close
  * Closes the log, if one was open.
@@ -33,6 +33,7 @@
 #ifndef INTERCEPT_LOG_H
 #define INTERCEPT_LOG_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 struct patch_desc;
@@ -40,6 +41,7 @@ struct syscall_desc;
 
 void intercept_setup_log(const char *path_base, const char *trunc);
 void intercept_log(const char *buffer, size_t len);
+bool intercept_log_is_enabled(void);
 
 enum intercept_log_result { KNOWN, UNKNOWN };
 
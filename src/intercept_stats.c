@@ -0,0 +1,229 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * intercept_stats.c -- a summary of where the time goes in the constructor
+ *
+ * With INTERCEPT_STATS set, the phases of intercept() are timed with rdtime,
+ * and a summary is written to stderr once the patches are active. Each line
+ * of it is a list of key=value pairs, prefixed with "intercept_stats", e.g.:
+ *
+ * intercept_stats timebase_hz=10000000
+ * intercept_stats phase=crawl_text ticks=123456
+ * intercept_stats counter=decoded_instrs value=7890
+ * intercept_stats object=/lib/libc.so.6 sites=800 gw=120 mid=300 sml=380 ...
+ *
+ * The phases done per object on the analysis workers are summed over the
+ * threads, the analysis phase is the wall time of all of them. The time of
+ * the icache flushes is also part of the phase they are done in. For an
+ * object whose file can not be opened, find_sections includes marking the
+ * jumps, as both come from the loaded segments.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <syscall.h>
+
+#include "intercept.h"
+#include "intercept_stats.h"
+
+/*
+ * For simplicity, declare syscall_no_intercept() with return value 'long'
+ * because nothing in this TU needs the a1 register, only a0 is checked.
+ */
+extern long
+syscall_no_intercept(long syscall_number, ...);
+
+bool intercept_stats_on;
+
+static uint64_t phase_ticks[STATS_PHASE_COUNT];
+static uint64_t counters[STATS_COUNTER_COUNT];
+
+static const char *const phase_names[STATS_PHASE_COUNT] = {
+	[STATS_DL_ITERATE_PHDR] = "dl_iterate_phdr",
+	[STATS_FIND_SECTIONS] = "find_sections",
+	[STATS_MARK_JUMPS] = "mark_jumps",
+	[STATS_CRAWL_TEXT] = "crawl_text",
+	[STATS_PREPARE_PATCHES] = "prepare_patches",
+	[STATS_ANALYSIS] = "analysis",
+	[STATS_ALLOCATE_TRAMPOLINE] = "allocate_trampoline",
+	[STATS_CREATE_PATCH] = "create_patch",
+	[STATS_ACTIVATE_PATCHES] = "activate_patches",
+	[STATS_CLEAR_CACHE] = "clear_cache",
+	[STATS_TOTAL] = "total",
+};
+
+static const char *const counter_names[STATS_COUNTER_COUNT] = {
+	[STATS_CACHED_OBJECTS] = "cached_objects",
+	[STATS_DECODED_BYTES] = "decoded_bytes",
+	[STATS_DECODED_INSTRS] = "decoded_instrs",
+	[STATS_RELOCATION_BYTES] = "relocation_bytes",
+};
+
+void
+intercept_stats_setup(const char *env)
+{
+	intercept_stats_on = (env != NULL && env[0] != '0');
+}
+
+void
+intercept_stats_phase(enum intercept_stats_phase phase, uint64_t start)
+{
+	if (!intercept_stats_on)
+		return;
+
+	__atomic_fetch_add(phase_ticks + phase,
+			intercept_stats_time() - start, __ATOMIC_RELAXED);
+}
+
+void
+intercept_stats_add(enum intercept_stats_counter counter, uint64_t value)
+{
+	if (!intercept_stats_on)
+		return;
+
+	__atomic_fetch_add(counters + counter, value, __ATOMIC_RELAXED);
+}
+
+/*
+ * get_timebase_frequency -- the frequency of the rdtime counter, as found
+ * in the device tree, or zero if it is not there
+ */
+static uint64_t
+get_timebase_frequency(void)
+{
+	unsigned char cell[4];
+
+	long fd = syscall_no_intercept(SYS_openat, AT_FDCWD,
+			"/proc/device-tree/cpus/timebase-frequency",
+			O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return 0;
+
+	long r = syscall_no_intercept(SYS_read, fd, cell, sizeof(cell));
+
+	syscall_no_intercept(SYS_close, fd);
+
+	if (r != (long)sizeof(cell))
+		return 0;
+
+	/* device tree cells are big endian */
+	return ((uint64_t)cell[0] << 24) | ((uint64_t)cell[1] << 16) |
+		((uint64_t)cell[2] << 8) | (uint64_t)cell[3];
+}
+
+/*
+ * print_line -- write one line of the summary to stderr, the patches are
+ * active by now, so libc can not be used for writing it
+ */
+static void
+print_line(const char *buffer, int len)
+{
+	if (len <= 0)
+		return;
+
+	syscall_no_intercept(SYS_write, 2, buffer, (size_t)len);
+}
+
+void
+intercept_stats_report(const struct intercept_desc *objs, unsigned count)
+{
+	char line[0x1000];
+	int len;
+
+	if (!intercept_stats_on)
+		return;
+
+	len = snprintf(line, sizeof(line),
+			"intercept_stats timebase_hz=%" PRIu64 " objects=%u\n",
+			get_timebase_frequency(), count);
+	print_line(line, len);
+
+	for (int p = 0; p < STATS_PHASE_COUNT; ++p) {
+		len = snprintf(line, sizeof(line),
+				"intercept_stats phase=%s ticks=%" PRIu64 "\n",
+				phase_names[p], phase_ticks[p]);
+		print_line(line, len);
+	}
+
+	for (int c = 0; c < STATS_COUNTER_COUNT; ++c) {
+		len = snprintf(line, sizeof(line),
+				"intercept_stats counter=%s value=%" PRIu64 "\n",
+				counter_names[c], counters[c]);
+		print_line(line, len);
+	}
+
+	for (unsigned o = 0; o < count; ++o) {
+		const struct intercept_desc *desc = objs + o;
+		unsigned gw = 0, mid = 0, sml = 0, skipped = 0, islands = 0;
+		unsigned frameless = 0;
+		size_t text_size = 0;
+
+		for (unsigned i = 0; i < desc->count; ++i) {
+			const struct patch_desc *patch = desc->items + i;
+
+			if (patch->is_skipped)
+				++skipped;
+			else if (is_frameless_GW(patch))
+				++frameless;
+			else if (patch->syscall_num == TYPE_GW)
+				++gw;
+			else if (patch->syscall_num == TYPE_MID)
+				++mid;
+			else
+				++sml;
+		}
+
+		for (const struct stub_island *island = desc->islands;
+		    island != NULL; island = island->next) {
+			if (!island->gw.is_skipped)
+				++islands;
+		}
+
+		if (desc->text_start != NULL)
+			text_size = (size_t)(desc->text_end -
+						desc->text_start) + 1;
+
+		len = snprintf(line, sizeof(line),
+				"intercept_stats object=%s text_bytes=%zu "
+				"sites=%u gw=%u frameless=%u mid=%u sml=%u "
+				"skipped=%u islands=%u trampoline_bytes=%zu\n",
+				desc->path, text_size, desc->count,
+				gw, frameless, mid, sml, skipped, islands,
+				desc->trampoline_address != NULL ?
+				desc->trampoline_size : (size_t)0);
+		print_line(line, len);
+	}
+}
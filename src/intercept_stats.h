@@ -0,0 +1,96 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * intercept_stats.h - timing the phases of the hotpatching at startup,
+ * and counting what they did, see INTERCEPT_STATS
+ */
+
+#ifndef INTERCEPT_STATS_H
+#define INTERCEPT_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct intercept_desc;
+
+enum intercept_stats_phase {
+	STATS_DL_ITERATE_PHDR,
+	STATS_FIND_SECTIONS,
+	STATS_MARK_JUMPS,
+	STATS_CRAWL_TEXT,
+	STATS_PREPARE_PATCHES,
+	STATS_ANALYSIS,
+	STATS_ALLOCATE_TRAMPOLINE,
+	STATS_CREATE_PATCH,
+	STATS_ACTIVATE_PATCHES,
+	STATS_CLEAR_CACHE,
+	STATS_TOTAL,
+	STATS_PHASE_COUNT
+};
+
+/* what the objects can not tell afterwards, the rest is counted in them */
+enum intercept_stats_counter {
+	STATS_CACHED_OBJECTS,
+	STATS_DECODED_BYTES,
+	STATS_DECODED_INSTRS,
+	STATS_RELOCATION_BYTES,
+	STATS_COUNTER_COUNT
+};
+
+extern bool intercept_stats_on;
+
+static inline uint64_t
+intercept_stats_time(void)
+{
+	uint64_t time = 0;
+
+	if (intercept_stats_on)
+		__asm__ volatile("rdtime %0" : "=r"(time));
+
+	return time;
+}
+
+/*
+ * The routines below can be called from the analysis workers, the
+ * phases done on them are summed over the threads.
+ */
+void intercept_stats_phase(enum intercept_stats_phase phase, uint64_t start);
+void intercept_stats_add(enum intercept_stats_counter counter,
+				uint64_t value);
+
+void intercept_stats_setup(const char *env);
+void intercept_stats_report(const struct intercept_desc *objs,
+				unsigned count);
+
+#endif
@@ -38,8 +38,10 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include <fcntl.h>
 #include <syscall.h>
 #include <sys/mman.h>
@@ -102,6 +104,55 @@ xmunmap(void *addr, size_t len)
 	xabort_on_syserror(result, __func__);
 }
 
+/* the unit of the memory obtained from the kernel by an arena */
+#define XARENA_CHUNK_SIZE ((size_t)0x10000)
+
+struct xarena_chunk {
+	struct xarena_chunk *prev;
+	size_t size;
+	size_t used;
+	/* keeps the allocations following the header aligned */
+	unsigned char data[] __attribute__((aligned(16)));
+};
+
+void *
+xarena_alloc(struct xarena *arena, size_t size)
+{
+	struct xarena_chunk *chunk = arena->chunk;
+
+	size = (size + 15) & ~(size_t)15;
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunk_size = XARENA_CHUNK_SIZE;
+
+		if (size + sizeof(*chunk) > chunk_size)
+			chunk_size = (size + sizeof(*chunk) + PAGE_SIZE - 1) &
+					~(PAGE_SIZE - 1);
+
+		chunk = xmmap_anon(chunk_size);
+		chunk->prev = arena->chunk;
+		chunk->size = chunk_size - sizeof(*chunk);
+		chunk->used = 0;
+		arena->chunk = chunk;
+	}
+
+	void *result = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return result;
+}
+
+void
+xarena_release(struct xarena *arena)
+{
+	while (arena->chunk != NULL) {
+		struct xarena_chunk *chunk = arena->chunk;
+
+		arena->chunk = chunk->prev;
+		xmunmap(chunk, chunk->size + sizeof(*chunk));
+	}
+}
+
 long
 xlseek(long fd, unsigned long off, int whence)
 {
@@ -538,3 +589,174 @@ strerror_no_intercept(long errnum)
 
 	return error_strings[errnum];
 }
+
+/*
+ * The output of vsnprintf_no_intercept, truncated at size - 1 characters,
+ * while len counts all of them.
+ */
+struct format_out {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void
+format_char(struct format_out *out, char c)
+{
+	if (out->len + 1 < out->size)
+		out->buf[out->len] = c;
+
+	++out->len;
+}
+
+static void
+format_padded(struct format_out *out, const char *str, size_t len,
+		unsigned width, bool left, char pad)
+{
+	size_t padding = (width > len) ? width - len : 0;
+
+	/* the sign goes before the zeros */
+	if (pad == '0' && len > 0 && str[0] == '-') {
+		format_char(out, *str++);
+		--len;
+	}
+
+	for (; !left && padding > 0; --padding)
+		format_char(out, pad);
+
+	for (size_t i = 0; i < len; ++i)
+		format_char(out, str[i]);
+
+	for (; padding > 0; --padding)
+		format_char(out, ' ');
+}
+
+int
+vsnprintf_no_intercept(char *buf, size_t size, const char *fmt, va_list ap)
+{
+	struct format_out out = {.buf = buf, .size = size, .len = 0};
+
+	for (; *fmt != '\0'; ++fmt) {
+		if (*fmt != '%') {
+			format_char(&out, *fmt);
+			continue;
+		}
+
+		bool left = false;
+		char pad = ' ';
+		unsigned width = 0;
+		unsigned longs = 0;
+		bool is_size = false;
+
+		for (++fmt; *fmt == '-' || *fmt == '0'; ++fmt) {
+			if (*fmt == '-')
+				left = true;
+			else
+				pad = '0';
+		}
+
+		for (; *fmt >= '0' && *fmt <= '9'; ++fmt)
+			width = width * 10 + (unsigned)(*fmt - '0');
+
+		for (; *fmt == 'l' || *fmt == 'z'; ++fmt) {
+			if (*fmt == 'l')
+				++longs;
+			else
+				is_size = true;
+		}
+
+		if (left)
+			pad = ' ';
+
+		char digits[24];
+		char *end = digits + sizeof(digits);
+		char *start = end;
+		unsigned long long value;
+		unsigned base = 10;
+		bool is_negative = false;
+		const char *str;
+
+		switch (*fmt) {
+		case 'd':
+		case 'i':
+			if (is_size)
+				value = (unsigned long long)va_arg(ap, ssize_t);
+			else if (longs > 0)
+				value = (unsigned long long)va_arg(ap, long long);
+			else
+				value = (unsigned long long)va_arg(ap, int);
+
+			is_negative = (long long)value < 0;
+			if (is_negative)
+				value = -value;
+			break;
+		case 'u':
+		case 'x':
+		case 'p':
+			if (*fmt == 'p')
+				value = (uintptr_t)va_arg(ap, void *);
+			else if (is_size)
+				value = va_arg(ap, size_t);
+			else if (longs > 0)
+				value = va_arg(ap, unsigned long long);
+			else
+				value = va_arg(ap, unsigned);
+
+			if (*fmt != 'u')
+				base = 16;
+			break;
+		case 's':
+			str = va_arg(ap, const char *);
+			if (str == NULL)
+				str = "(null)";
+
+			format_padded(&out, str, strlen(str), width, left,
+					' ');
+			continue;
+		case 'c':
+			digits[0] = (char)va_arg(ap, int);
+			format_padded(&out, digits, 1, width, left, ' ');
+			continue;
+		case '%':
+			format_char(&out, '%');
+			continue;
+		default:
+			/* not supported, the rest of the format is left out */
+			goto out;
+		}
+
+		do {
+			*--start = "0123456789abcdef"[value % base];
+			value /= base;
+		} while (value != 0);
+
+		if (*fmt == 'p') {
+			*--start = 'x';
+			*--start = '0';
+		}
+
+		if (is_negative)
+			*--start = '-';
+
+		format_padded(&out, start, (size_t)(end - start), width, left,
+				pad);
+	}
+
+out:
+	if (size > 0)
+		buf[(out.len < size) ? out.len : size - 1] = '\0';
+
+	return (int)out.len;
+}
+
+int
+snprintf_no_intercept(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	int len = vsnprintf_no_intercept(buf, size, fmt, ap);
+	va_end(ap);
+
+	return len;
+}
@@ -33,6 +33,7 @@
 #ifndef INTERCEPT_UTIL_H
 #define INTERCEPT_UTIL_H
 
+#include <stdarg.h>
 #include <stddef.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -57,6 +58,28 @@ void *xmremap(void *addr, size_t old, size_t new);
  */
 void xmunmap(void *addr, size_t len);
 
+/*
+ * xarena - a bump allocator for memory that is released all at once.
+ * The chunks are obtained with xmmap_anon, so it does not call libc
+ * either, and each arena is meant to be used by one thread at a time.
+ * A zero initialized struct xarena is an empty arena.
+ */
+struct xarena_chunk;
+
+struct xarena {
+	struct xarena_chunk *chunk;
+};
+
+/*
+ * xarena_alloc - no fail allocation from an arena, aligned to 16 bytes
+ */
+void *xarena_alloc(struct xarena *arena, size_t size);
+
+/*
+ * xarena_release - unmaps every chunk of the arena, leaving it empty
+ */
+void xarena_release(struct xarena *arena);
+
 /*
  * xlseek - no fail lseek
  *
@@ -80,4 +103,17 @@ void xread(long fd, void *buffer, size_t size);
  */
 const char *strerror_no_intercept(long errnum);
 
+/*
+ * vsnprintf_no_intercept, snprintf_no_intercept - the subset of snprintf
+ * used for the debug dump and the messages of the analysis, which runs on
+ * threads that must not call libc (analysis_workers.c).
+ * Supported: the flags '-' and '0', a field width, the length modifiers l,
+ * ll and z, and the conversions d, i, u, x, p, s, c and %. Returns the
+ * length of the whole output, like snprintf, even when it is truncated.
+ */
+int vsnprintf_no_intercept(char *buf, size_t size, const char *fmt,
+			va_list ap);
+int snprintf_no_intercept(char *buf, size_t size, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
 #endif
@@ -3,7 +3,9 @@
 /*
  * sp is reduced by this offset in glibc due to patching. Before executing
  * relocated instructions, sp is increased by this constant to restore the
- * original value. All other offsets refer to this sp.
+ * original value. In place of ecall, the relocated instructions reduce sp by
+ * the same offset again for asm_entry_point. All other offsets refer to this
+ * sp.
  */
 #define PATCH_SP_OFF	48
 /*
@@ -12,25 +14,33 @@
  */
 #define ORIG_RA_OFF	0
 /*
- * Reserved spot for the TYPE_GW original ra value offset. Used in patcher.c, but
- * not in intercept_irq_entry.S. Mostly a placeholder.
+ * At this offset, TYPE_MID stores the original ra value, the per-site
+ * prologue loads it from here, and the relocated instructions store it here
+ * again before jumping back to TYPE_MID.
  */
 #define MID_ORIG_RA_OFF	8
 /*
- * At this offset, the return address is stored (address of the instruction in glibc
- * after the jump). This is used in intercept_irq_entry.S to identify the patch (aside
- * from being the address to return to)
+ * At this offset, the relocated instructions store the index of the patch
+ * (patch_desc) in the site table before jumping to asm_entry_point. This is
+ * passed to intercept_routine to identify the patch.
  */
-#define RET_ADDR_OFF	16
+#define SITE_IDX_OFF	16
 /*
- * Used only by intercept_irq_entry.S to jump back and forth between relocated
- * instructions. These instructions are generated at runtime by patcher.c.
+ * Free to use. The clone path of asm_entry_point keeps the clone_args pointer
+ * of clone3 here, so the parent can undo the changes of stack_size.
  */
-#define RELOC_ADDR_OFF	24
-/* 
- * Free to use after detect_cur_patch_wrapper() in intercept_irq_entry.S;
- * the trampoline uses it to store ra before overwriting it.
+#define UNUSED_OFF0	24
+/*
+ * Free to use. The trampoline uses it to store ra before overwriting it, the
+ * GW dispatch and asm_entry_point use it to spill t0.
  */
 #define UNUSED_OFF1	32
-// Free to use, typically for a fake prologue/epilogue.
+// Free to use, the GW dispatch and asm_entry_point use it to spill t1.
 #define UNUSED_OFF2	40
+
+/*
+ * Not an offset, but shared the same way: the number of 64-bit words in
+ * asm_syscall_mask, the syscall subscription bitmap tested before entering C.
+ * Syscall numbers past the end of it always go to the hook.
+ */
+#define SYSCALL_MASK_WORDS	8
@@ -54,33 +54,50 @@
  *  |  |   |                | trampoline |  generated by activate_patches()
  *  |  |   |                `------------|
  *  |  |   sd      ra, UNUSED_OFF1(sp)   |  The trampoline allows glibc (or
- *  |  |   la      ra, asm_entry_point   |  any other patched library) and
+ *  |  |   la      ra, GW_dispatch       |  any other patched library) and
  *  |  |   jalr    zero, 0(ra)           |  libsyscall_intercept.so to be
  *  |  |   |                             |  farther than 2 GB from each other.
- *  |  `---|-----------------------------'
+ *  |  `---|-----------------------------'  There is one for each TYPE_GW.
  *  |      |
  *  |  ,---|-----------------------------.
- *  |  |   |   | libsyscall_intercept.so |
- *  |  |   |   `-------------------------|
- *  |  | asm_entry_point:                |  routine in intercept_irq_entry.S
- *  |  |   call    detect_cur_patch    ---> 1. detect_cur_patch in intercept.c
- *  |  |   call    exec_relocated_instrs |  2. patched instructions before ecall
- *  |  |   call    intercept_routine   ---> 3. intercept_routine calls C hooks
- *  |  |   call    exec_relocated_instrs |  4. patched instructions after ecall
- *  |  |   la      REG, return_address   |  5. REG depends on the patch type
- *  |  |   jalr    zero, 0(REG)          |  6. jump back to patch (glibc)
+ *  |  |   |        | relocation space   |  generated by create_patch()
+ *  |  |   |        `--------------------|
+ *  |  | GW_dispatch:                    |  which patch went through the GW?
+ *  |  |   beq     a7/0(sp), ret_addr    |  compare with each MID/SML using it
+ *  |  |   |                             |
+ *  |  | site_prologue:                  |  one for each patch, see
+ *  |  |   ld      ra, ORIG_RA_OFF(sp)   |  relocate_instrs()
+ *  |  |   addi    sp, sp, PATCH_SP_OFF  |  1. the original context again
+ *  |  |   ...                           |  2. patched instructions before ecall
+ *  |  |   addi    sp, sp, -PATCH_SP_OFF |
+ *  |  |   sd      ra, ORIG_RA_OFF(sp)   |
+ *  |  |   li      ra, site_idx          |
+ *  |  |   sd      ra, SITE_IDX_OFF(sp)  |
+ *  |  |   jal     ra, asm_entry_point ---> 3. ecall or the C hooks
+ *  |  |   ld      ra, ORIG_RA_OFF(sp) <---
+ *  |  |   addi    sp, sp, PATCH_SP_OFF  |
+ *  |  |   ...                           |  4. patched instructions after ecall
+ *  |  |   la      REG, return_address   |  REG depends on the patch type
+ *  |  |   jalr    zero, 0(REG)          |  5. jump back to patch (glibc)
  *  |  |   |                             |
  *  |  `---|-----------------------------'
  *  |      |
  *  `------'
  *
+ * A TYPE_GW patch can link with a temporary register that is dead at the
+ * site instead of ra (see find_dead_register()), when no other patch goes
+ * through it. Such a frameless GW is just the auipc and the jalr, neither
+ * the patch nor its site prologue touch the stack.
  */
 
 #include "intercept.h"
 #include "intercept_util.h"
 #include "intercept_log.h"
+#include "intercept_stats.h"
+#include "rv_decode.h"
 #include "rv_encode.h"
 #include "patch_offsets.h"
+#include "syscall_mask.h"
 
 #include <assert.h>
 #include <stdint.h>
@@ -92,36 +109,137 @@
 #include <stdio.h>
 
 /*
- * While executing patched instructions, these global variables are used in the
- * relocation space (intercept_irq_entry) in case the patched instructions use
- * ra. The ra register is the only one that lacks the original value from glibc
- * during patch execution, as it's needed for jumps within intercept_irq_entry.
- * These globals serve to temporarily load and store the original ra when it's
- * required by the patched instructions.
+ * The registers a patch can link with instead of ra, t0-t6. They are not
+ * preserved across calls, nor used for arguments or return values.
  */
-extern __thread uint64_t asm_ra_orig;
-extern __thread uint64_t asm_ra_temp;
+#define LINK_REGISTERS	((1u << REG_T0) | (1u << REG_T1) | (1u << REG_T2) | \
+			(1u << REG_T3) | (1u << REG_T4) | (1u << REG_T5) | \
+			(1u << REG_T6))
 
-struct tls_offset_table {
-	ptrdiff_t asm_ra_orig;
-	ptrdiff_t asm_ra_temp;
-} tls_offset_table;
+// jalr zero, imm(ra) or c.jr ra
+static bool
+is_return(const struct intercept_disasm_result *ins)
+{
+	return ins->is_abs_jump && ins->regs_written == 0 &&
+		ins->regs_read == 1u << REG_RA;
+}
 
-void
-init_tls_offset_table(void)
+static uint8_t
+lowest_register(uint32_t regs)
 {
-	uintptr_t tp_addr = (uintptr_t)__builtin_thread_pointer();
+	if (regs == 0)
+		return 0;
 
-	tls_offset_table.asm_ra_orig =
-		(uintptr_t)&asm_ra_orig - tp_addr;
-	tls_offset_table.asm_ra_temp =
-		(uintptr_t)&asm_ra_temp - tp_addr;
+	return (uint8_t)__builtin_ctz(regs);
+}
+
+/*
+ * liveness_step - one instruction of a forward liveness pass: a candidate
+ * read before written is live, one written before read is dead. At a return
+ * all the undecided candidates are dead. Returns false where the pass stops:
+ * at a jump or branch, or when no candidate is left undecided.
+ */
+static bool
+liveness_step(const struct intercept_disasm_result *ins,
+		uint32_t *candidates, uint32_t *dead)
+{
+	*candidates &= ~(ins->regs_read & ~*dead);
+	*dead |= ins->regs_written & *candidates;
+
+	if (is_return(ins)) {
+		*dead = *candidates;
+		return false;
+	}
+
+	if (ins->is_abs_jump || ins->rip_ref_addr != NULL)
+		return false;
+
+	return (*candidates & ~*dead) != 0;
+}
+
+/*
+ * find_dead_register - a forward liveness pass over the decoded window of a
+ * site. Looks for one of the candidates not accessed by the instructions
+ * between start and end, and dead at end. The registers not known to be dead
+ * when the pass stops, or at the end of the window, are live. The branches
+ * between start and end are up to the caller, see dead_at_target(). Returns
+ * zero if there is no dead register.
+ */
+static uint8_t
+find_dead_register(const struct intercept_disasm_result *window,
+			const uint8_t *start, const uint8_t *end,
+			uint32_t candidates)
+{
+	uint32_t dead = 0;
+	uint8_t i = 0;
+
+	while (i < SURROUNDING_INSTRS_NUM && window[i].address != start)
+		++i;
+
+	for (; i < SURROUNDING_INSTRS_NUM && window[i].is_set &&
+	    window[i].address < end; ++i) {
+		const struct intercept_disasm_result *ins = window + i;
+
+		candidates &= ~(ins->regs_read | ins->regs_written);
+
+		if (is_return(ins))
+			return lowest_register(candidates);
+
+		// jr somewhere
+		if (ins->is_abs_jump)
+			return 0;
+	}
+
+	if (i == SURROUNDING_INSTRS_NUM || window[i].address != end)
+		return 0;
+
+	for (; i < SURROUNDING_INSTRS_NUM && window[i].is_set; ++i) {
+		if (!liveness_step(window + i, &candidates, &dead))
+			break;
+	}
+
+	return lowest_register(dead);
+}
+
+/*
+ * dead_at_target - the temporary registers dead at the target of a branch or
+ * jump, decoding the instructions there for the same forward pass.
+ */
+static uint32_t
+dead_at_target(const struct intercept_desc *desc, const uint8_t *target)
+{
+	uint32_t candidates = LINK_REGISTERS;
+	uint32_t dead = 0;
+	const uint8_t *code = target;
+
+	if (target < desc->text_start || target > desc->text_end)
+		return 0;
+
+	for (uint8_t i = 0; i < SURROUNDING_INSTRS_NUM &&
+	    code <= desc->text_end; ++i) {
+		struct intercept_disasm_result ins = {
+			.address = code,
+			.a7_set = -1
+		};
+
+		if (rv_decode(&ins, code,
+				(size_t)(desc->text_end - code + 1)) == 0)
+			break;
+
+		if (!liveness_step(&ins, &candidates, &dead))
+			break;
+
+		code += ins.length;
+	}
+
+	return dead;
 }
 
 /*
  * is_copiable_before_syscall
  * checks if an instruction found before a syscall instruction
- * can be copied (and thus overwritten).
+ * can be copied (and thus overwritten). An auipc is, relocate_auipc()
+ * loads the same address in the relocation space.
  */
 static bool
 is_copiable_before_syscall(struct intercept_disasm_result ins)
@@ -129,7 +247,8 @@ is_copiable_before_syscall(struct intercept_disasm_result ins)
 	if (!ins.is_set)
 		return false;
 
-	return !(ins.has_ip_relative_opr || ins.is_abs_jump || ins.is_syscall);
+	return !(ins.rip_ref_addr != NULL || ins.is_abs_jump ||
+		ins.is_syscall);
 }
 
 /*
@@ -138,14 +257,35 @@ is_copiable_before_syscall(struct intercept_disasm_result ins)
  * can be copied (and thus overwritten).
  *
  * Notice: we allow the copy of ret instructions.
+ *
+ * A branch, or a jump that doesn't link, is copied when a temporary register
+ * is dead at its target, relocate_jump() jumps there through it. One that is
+ * dead at all the targets is needed, patch->branch_dead_regs is narrowed to
+ * those.
  */
 static bool
-is_copiable_after_syscall(struct intercept_disasm_result ins)
+is_copiable_after_syscall(const struct intercept_desc *desc,
+			struct patch_desc *patch,
+			struct intercept_disasm_result ins)
 {
-	if (!ins.is_set)
+	if (!ins.is_set || ins.is_syscall)
 		return false;
 
-	return !(ins.has_ip_relative_opr || ins.is_syscall);
+	if (ins.rip_ref_addr == NULL)
+		return true;
+
+	if (ins.regs_written != 0)
+		return false;
+
+	uint32_t dead = patch->branch_dead_regs &
+			dead_at_target(desc, ins.rip_ref_addr);
+
+	if (dead == 0)
+		return false;
+
+	patch->branch_dead_regs = dead;
+
+	return true;
 }
 
 static bool
@@ -220,6 +360,8 @@ check_surrounding_instructions(struct intercept_desc *desc,
 	uint8_t patch_end_idx = instrs_num;
 	uint8_t patchable_size = 0;
 
+	patch->branch_dead_regs = LINK_REGISTERS;
+
 	// check if the instruction after the ecall sets a register
 	if (instrs[syscall_idx + 1].reg_set)
 		patch->return_register = instrs[syscall_idx + 1].reg_set;
@@ -242,8 +384,9 @@ check_surrounding_instructions(struct intercept_desc *desc,
 				patch_end_idx = check_two_ecalls(patch,
 						syscall_idx, patch_start_idx, i);
 				break;
-			} else if (!is_copiable_after_syscall(instrs[i]) ||
-					has_jump(desc, instrs[i].address)) {
+			} else if (has_jump(desc, instrs[i].address) ||
+					!is_copiable_after_syscall(desc, patch,
+							instrs[i])) {
 				patch_end_idx = i;
 				break;
 			}
@@ -261,50 +404,197 @@ check_surrounding_instructions(struct intercept_desc *desc,
 	memmove(patch->surrounding_instrs, instrs + patch_start_idx,
 		instrs_num * sizeof(struct intercept_disasm_result));
 
-	// get final patchable size, and check if ra is used before ecall
-	for (uint8_t i = 0; i < instrs_num; ++i) {
+	// get final patchable size
+	for (uint8_t i = 0; i < instrs_num; ++i)
 		patchable_size += instrs[i].length;
 
-		if (instrs[i].is_ra_used) {
-			if (i < syscall_idx)
-				patch->is_ra_used_before = true;
-			else
-				patch->is_ra_used_after = true;
-		}
-	}
-
 	return patchable_size;
 }
 
-static void
-find_GW(struct intercept_desc *desc, struct patch_desc *patch)
+/*
+ * The number of TYPE_SML patches claim_island() places on one stub island,
+ * and how much closer than JAL_AVG_REACH it must be to the syscall, as the
+ * jal of the patch is not positioned yet.
+ */
+#define ISLAND_MAX_USERS	8
+#define ISLAND_REACH_MARGIN	0x100
+
+// TYPE_MID and TYPE_SML jump address and offset (TYPE_MID)
+static const uint8_t *
+get_jump_from(const struct patch_desc *patch)
 {
-	// TYPE_MID and TYPE_SML jump address and offset (TYPE_MID)
-	const uint8_t *jump_from;
 	if (patch->syscall_num == TYPE_MID)
-		jump_from = patch->return_address - JAL_INS_SIZE -
+		return patch->return_address - JAL_INS_SIZE -
 				MODIFY_SP_INS_SIZE;
 	else // TYPE_SML
-		jump_from = patch->return_address - JAL_INS_SIZE;
+		return patch->return_address - JAL_INS_SIZE;
+}
 
-	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i) {
+/*
+ * get_patch_start - the first byte of the site overwritten by the patch,
+ * not counting the c.nop aligning it. This is dst_jmp_patch for a TYPE_GW,
+ * while find_GW() points the dst_jmp_patch of the TYPE_MID and TYPE_SML
+ * patches to their gateway, so theirs is derived from the return address.
+ */
+static uint8_t *
+get_patch_start(const struct patch_desc *patch)
+{
+	switch (patch->syscall_num) {
+	case TYPE_GW:
+		return patch->dst_jmp_patch;
+	case TYPE_MID:
+		return (uint8_t *)patch->return_address - JAL_INS_SIZE -
+			STORE_LOAD_INS_SIZE - MODIFY_SP_INS_SIZE;
+	default: // TYPE_SML
+		return (uint8_t *)patch->return_address - JAL_INS_SIZE;
+	}
+}
+
+/*
+ * get_patch_end - the byte following the ones overwritten by the patch, the
+ * code relocated from the site jumps back there
+ */
+static uint8_t *
+get_patch_end(const struct patch_desc *patch)
+{
+	uint8_t *end = get_patch_start(patch) + patch->patch_size_bytes;
+#ifdef __riscv_c
+	if (patch->end_with_c_nop)
+		end += C_NOP_INS_SIZE;
+#endif
+	return end;
+}
+
+/* the syscalls of two sites are closer than this if their windows overlap */
+#define WINDOW_OVERLAP_DISTANCE	(2 * SURROUNDING_INSTRS_NUM * RV_INS_SIZE)
+
+/* is_overlapping - whether two patches overwrite a common byte */
+static bool
+is_overlapping(const struct patch_desc *a, const struct patch_desc *b)
+{
+	const uint8_t *a_start = get_patch_start(a);
+	const uint8_t *b_start = get_patch_start(b);
+
+#ifdef __riscv_c
+	if (a->start_with_c_nop)
+		a_start -= C_NOP_INS_SIZE;
+	if (b->start_with_c_nop)
+		b_start -= C_NOP_INS_SIZE;
+#endif
+
+	return a_start < get_patch_end(b) && b_start < get_patch_end(a);
+}
+
+/*
+ * overlaps_patched - a skipped site positioned as a TYPE_GW is not marked as
+ * a jump destination (see prepare_patches), the sites following it might
+ * overwrite a part of it. It can only become a GW if it overlaps none of
+ * the sites that are patched. The sites are sorted by address, only the
+ * nearby ones are checked.
+ */
+static bool
+overlaps_patched(const struct intercept_desc *desc,
+		const struct patch_desc *gw)
+{
+	const struct patch_desc *patch;
+
+	for (patch = gw; patch-- != desc->items &&
+	    gw->syscall_addr - patch->syscall_addr < WINDOW_OVERLAP_DISTANCE;) {
+		if (!patch->is_skipped && is_overlapping(patch, gw))
+			return true;
+	}
+
+	for (patch = gw + 1; patch != desc->items + desc->count &&
+	    patch->syscall_addr - gw->syscall_addr < WINDOW_OVERLAP_DISTANCE;
+	    ++patch) {
+		if (!patch->is_skipped && is_overlapping(patch, gw))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * claim_island - a site that fits a TYPE_SML patch uses it through a stub
+ * island nearby, instead of a TYPE_GW or TYPE_MID patch, which adjust the
+ * stack in the patched code. The dispatch of the island compares the return
+ * address with that of every patch using it, so only a few are placed on
+ * one island.
+ */
+static bool
+claim_island(struct intercept_desc *desc, struct patch_desc *patch)
+{
+	for (struct stub_island *island = desc->islands; island != NULL;
+	    island = island->next) {
+		if (island->users >= ISLAND_MAX_USERS)
+			continue;
+
+		if (labs(island->gw.dst_jmp_patch - patch->syscall_addr) >=
+		    JAL_AVG_REACH - ISLAND_REACH_MARGIN)
+			continue;
+
+		++island->users;
+		patch->gateway = &island->gw;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * find_GW - a TYPE_GW patch, or else a stub island, in reach of the jal of
+ * a TYPE_MID or TYPE_SML patch. The gateway is left NULL if there is none,
+ * see place_missing_islands().
+ */
+static void
+find_GW(struct intercept_desc *desc, struct patch_desc *patch)
+{
+	const uint8_t *jump_from = get_jump_from(patch);
+
+	for (uint32_t patch_i = 0;
+	    patch->gateway == NULL && patch_i < desc->count; ++patch_i) {
 		struct patch_desc *patch_GW = desc->items + patch_i;
 
-		// not a TYPE_GW, skip
-		if (patch_GW->syscall_num != TYPE_GW)
+		// not a TYPE_GW, or one without a dispatch, skip
+		if (patch_GW->syscall_num != TYPE_GW ||
+		    is_frameless_GW(patch_GW))
 			continue;
 
-		if (labs(patch_GW->dst_jmp_patch - jump_from) < JAL_AVG_REACH) {
-			patch->dst_jmp_patch = patch_GW->dst_jmp_patch;
-			break;
-		}
+		if (patch_GW->is_skipped && overlaps_patched(desc, patch_GW))
+			continue;
+
+		if (labs(patch_GW->dst_jmp_patch - jump_from) < JAL_AVG_REACH)
+			patch->gateway = patch_GW;
 	}
 
+	for (struct stub_island *island = desc->islands;
+	    patch->gateway == NULL && island != NULL; island = island->next) {
+		if (labs(island->gw.dst_jmp_patch - jump_from) < JAL_AVG_REACH)
+			patch->gateway = &island->gw;
+	}
+
+	if (patch->gateway == NULL)
+		return;
+
+	patch->dst_jmp_patch = patch->gateway->dst_jmp_patch;
+
 	// offsetting TYPE_MID to skip `addi sp, sp, -PATCH_SP_OFF`
 	if (patch->syscall_num == TYPE_MID)
 		patch->dst_jmp_patch += MODIFY_SP_INS_SIZE;
 }
 
+/* has_users - whether a TYPE_MID or TYPE_SML patch goes through gw */
+static bool
+has_users(const struct intercept_desc *desc, const struct patch_desc *gw)
+{
+	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i) {
+		if (desc->items[patch_i].gateway == gw)
+			return true;
+	}
+
+	return false;
+}
+
 #ifdef __riscv_c
 static void
 check_patch_alignment(struct patch_desc *patch, const uint8_t *start_addr,
@@ -333,25 +623,32 @@ position_patch(struct patch_desc *patch)
 	uint8_t up_to_ecall_size = 0;
 	const uint8_t *start_addr;
 	uint8_t required_size;
+	uint8_t frame_size;
 
 	for (uint8_t i = 0; i <= patch->syscall_idx; ++i)
 		up_to_ecall_size += instrs[i].length;
 
 	switch (patch->syscall_num) {
 	case TYPE_GW:
-		required_size = TYPE_GW_SIZE;
+		if (is_frameless_GW(patch)) {
+			required_size = JUMP_2GB_INS_SIZE;
+			frame_size = 0;
+		} else {
+			required_size = TYPE_GW_SIZE;
+			frame_size = MODIFY_SP_INS_SIZE + STORE_LOAD_INS_SIZE;
+		}
 
 		if (up_to_ecall_size >= required_size)
 			patch->return_address =
 				patch->syscall_addr + ECALL_INS_SIZE -
-				MODIFY_SP_INS_SIZE - STORE_LOAD_INS_SIZE;
+				frame_size;
 		else
 			patch->return_address =
-				instrs[0].address + MODIFY_SP_INS_SIZE +
-				STORE_LOAD_INS_SIZE + JUMP_2GB_INS_SIZE;
+				instrs[0].address + frame_size +
+				JUMP_2GB_INS_SIZE;
 
 		start_addr = patch->return_address - JUMP_2GB_INS_SIZE -
-				STORE_LOAD_INS_SIZE - MODIFY_SP_INS_SIZE;
+				frame_size;
 		break;
 	case TYPE_MID:
 		required_size = TYPE_MID_SIZE;
@@ -415,169 +712,501 @@ align_start_addr_and_size(struct patch_desc *patch,
 }
 #endif
 
-static void
-load_orig_ra_temp(uint8_t **dst)
+/*
+ * check_frameless - the register a frameless TYPE_GW patch could link with
+ * at this site, or zero. The patch is positioned as one to see which
+ * instructions it would overwrite, the caller positions it again. The window
+ * is the one decoded around the site, before check_surrounding_instructions()
+ * dropped the instructions that can't be relocated.
+ */
+static uint8_t
+check_frameless(struct patch_desc *patch,
+		const struct intercept_disasm_result *window, uint8_t length)
 {
-	uint8_t instrs_buff[MAX_PC_INS_SIZE * 2];
-	uint8_t instrs_size = 0;
+	int16_t syscall_num = patch->syscall_num;
+	uint8_t return_register = patch->return_register;
+	uint8_t reg = 0;
 
-	instrs_size += rvpc_sd(instrs_buff + instrs_size, REG_RA, REG_TP,
-				(int32_t)tls_offset_table.asm_ra_temp);
-	instrs_size += rvpc_ld(instrs_buff + instrs_size, REG_RA, REG_TP,
-				(int32_t)tls_offset_table.asm_ra_orig);
+	patch->syscall_num = TYPE_GW;
+	patch->return_register = REG_T0; // anything but ra
+	position_patch(patch);
 
-	memcpy(*dst, instrs_buff, instrs_size);
-	*dst += instrs_size;
+	uint8_t *start_addr = get_patch_start(patch);
+	size_t patch_size = patch->patch_size_bytes;
+
+#ifdef __riscv_c
+	align_start_addr_and_size(patch, &start_addr, &patch_size);
+#endif
+
+	const uint8_t *end_addr = start_addr + patch_size;
+
+	if (end_addr <= patch->surrounding_instrs[0].address + length)
+		reg = find_dead_register(window, start_addr, end_addr,
+					patch->branch_dead_regs);
+
+	patch->syscall_num = syscall_num;
+	patch->return_register = return_register;
+
+	return reg;
 }
 
+/*
+ * jump_to_addr - encode a jump to an address known at patching time, the
+ * shortest one that reaches. rs is used as a temporary register.
+ */
+static uint8_t
+jump_to_addr(uint8_t *instrs_buff, uint8_t rd, uint8_t rs,
+		uintptr_t from, uintptr_t to)
+{
+	uint8_t instrs_size;
+
+	instrs_size = rvp_jal(instrs_buff, rd, from, to);
+
+	if (instrs_size == 0)
+		instrs_size = rvp_jump_2GB(instrs_buff, rd, rs, from, to);
+
+	if (instrs_size == 0)
+		instrs_size = rvp_jump_abs(instrs_buff, rd, rs, to);
+
+	if (instrs_size == 0)
+		xabort("jump destination out of reach");
+
+	return instrs_size;
+}
+
+/*
+ * copy_site_prologue - the first instructions executed in the relocation
+ * space for every patch. Brings back the original ra and sp, so the
+ * relocated instructions run in the original context of the patched
+ * library. Nothing is kept below sp from here on, signal handlers are free
+ * to use the stack (and to make syscalls) at any point. A frameless GW
+ * changed neither.
+ */
 static void
-store_new_ra_temp(uint8_t **dst)
+copy_site_prologue(uint8_t **dst, struct patch_desc *patch)
 {
-	uint8_t instrs_buff[MAX_PC_INS_SIZE * 2];
+	uint8_t instrs_buff[LI_32_INS_SIZE + MAX_PC_INS_SIZE * 2];
 	uint8_t instrs_size = 0;
+	int16_t orig_ra_off = ORIG_RA_OFF;
+
+	if (is_frameless_GW(patch))
+		return;
+
+	/* TYPE_SML jumped with a7, it holds the return address */
+	if (patch->syscall_num >= 0)
+		instrs_size += rvp_li(instrs_buff + instrs_size, REG_A7,
+					patch->syscall_num);
 
-	instrs_size += rvpc_sd(instrs_buff + instrs_size, REG_RA, REG_TP,
-				(int32_t)tls_offset_table.asm_ra_orig);
-	instrs_size += rvpc_ld(instrs_buff + instrs_size, REG_RA, REG_TP,
-				(int32_t)tls_offset_table.asm_ra_temp);
+	/* TYPE_MID stored its return address at ORIG_RA_OFF by going to GW */
+	if (patch->syscall_num == TYPE_MID)
+		orig_ra_off = MID_ORIG_RA_OFF;
+
+	instrs_size += rvpc_ld(instrs_buff + instrs_size,
+				REG_RA, REG_SP, orig_ra_off);
+	instrs_size += rvpc_addisp(instrs_buff + instrs_size, PATCH_SP_OFF);
 
 	memcpy(*dst, instrs_buff, instrs_size);
 	*dst += instrs_size;
 }
 
+/*
+ * copy_syscall_entry - replaces the ecall in the relocated instructions.
+ * Allocates the stack space asm_entry_point expects, with the original ra
+ * and the index of the patch in the site table (so intercept_routine doesn't
+ * need to look for it). asm_entry_point returns right after the jump, where
+ * the original ra and sp are restored again.
+ */
 static void
-copy_jump(uint8_t **dst, uint8_t rd, uint8_t rs, int16_t offset)
+copy_syscall_entry(uint8_t **dst, struct patch_desc *patch)
 {
-	uint8_t instr_buff[MAX_PC_INS_SIZE];
-	uint8_t instr_size;
+	/* This function (destination) is part of intercept_irq_entry.S */
+	extern void asm_entry_point(void);
+
+	uint8_t instrs_buff[LI_32_INS_SIZE + MAX_PC_INS_SIZE * 6 +
+				MAX_P_INS_SIZE];
+	uint8_t instrs_size = 0;
 
-	instr_size = rvpc_jalr(instr_buff, rd, rs, offset);
+	instrs_size += rvpc_addisp(instrs_buff + instrs_size, -PATCH_SP_OFF);
+	instrs_size += rvpc_sd(instrs_buff + instrs_size,
+				REG_RA, REG_SP, ORIG_RA_OFF);
+
+	instrs_size += rvp_li(instrs_buff + instrs_size, REG_RA,
+				(int32_t)patch->site_idx);
+	instrs_size += rvpc_sd(instrs_buff + instrs_size,
+				REG_RA, REG_SP, SITE_IDX_OFF);
+
+	instrs_size += jump_to_addr(instrs_buff + instrs_size, REG_RA, REG_RA,
+				(uintptr_t)*dst + instrs_size,
+				(uintptr_t)asm_entry_point);
+
+	instrs_size += rvpc_ld(instrs_buff + instrs_size,
+				REG_RA, REG_SP, ORIG_RA_OFF);
+	instrs_size += rvpc_addisp(instrs_buff + instrs_size, PATCH_SP_OFF);
 
-	memcpy(*dst, instr_buff, instr_size);
-	*dst += instr_size;
+	memcpy(*dst, instrs_buff, instrs_size);
+	*dst += instrs_size;
 }
 
+/*
+ * finalize_and_jump_back - the last part of the relocated instructions,
+ * jumps back to the patch in the patched library. TYPE_GW and TYPE_MID
+ * pop their stack space and load ra once back in the patched library, so it
+ * is prepared for them here again. TYPE_SML returns directly to the code
+ * following the patch.
+ */
 static void
 finalize_and_jump_back(uint8_t **dst, struct patch_desc *patch)
 {
-	uint8_t instrs_buff[MAX_PC_INS_SIZE * 5];
+	uint8_t instrs_buff[MAX_PC_INS_SIZE * 2 + MAX_P_INS_SIZE];
 	uint8_t instrs_size = 0;
 	uint8_t ret_reg = patch->return_register;
 
-	// load original ra value if it's not used for jumping back
-	if (ret_reg != REG_RA)
-		instrs_size += rvpc_ld(instrs_buff + instrs_size,
-					REG_RA, REG_SP, ORIG_RA_OFF);
-
 	switch (patch->syscall_num) {
 	case TYPE_GW:
-		// load the return address into the register used for jumping back
-		instrs_size += rvpc_ld(instrs_buff + instrs_size,
-					ret_reg, REG_SP, RET_ADDR_OFF);
+		// jumps back with its dead link register
+		if (is_frameless_GW(patch))
+			break;
+
+		instrs_size += rvpc_addisp(instrs_buff + instrs_size,
+					-PATCH_SP_OFF);
+		instrs_size += rvpc_sd(instrs_buff + instrs_size,
+					REG_RA, REG_SP, ORIG_RA_OFF);
 		break;
 	case TYPE_MID:
-		/*
-		 * TYPE_MID expects the original ra value at a different offset
-		 * than TYPE_GW, so reorganize the stack by moving the value at
-		 * offset ORIG_RA_OFF to offset MID_ORIG_RA_OFF.
-		 */
-		instrs_size += rvpc_ld(instrs_buff + instrs_size,
-					ret_reg, REG_SP, ORIG_RA_OFF);
+		instrs_size += rvpc_addisp(instrs_buff + instrs_size,
+					-PATCH_SP_OFF);
 		instrs_size += rvpc_sd(instrs_buff + instrs_size,
-					ret_reg, REG_SP, MID_ORIG_RA_OFF);
-
-		// load the return address into the register used for jumping back
-		instrs_size += rvpc_ld(instrs_buff + instrs_size,
-					ret_reg, REG_SP, RET_ADDR_OFF);
+					REG_RA, REG_SP, MID_ORIG_RA_OFF);
 		break;
 	default: // TYPE_SML
 		// if not specified, TYPE_SML uses REG_A7 to jump back to glibc
 		if (!ret_reg)
 			ret_reg = REG_A7;
+		break;
+	}
 
-		// load the return address into the register used for jumping back
-		instrs_size += rvpc_ld(instrs_buff + instrs_size,
-					ret_reg, REG_SP, RET_ADDR_OFF);
+	/*
+	 * The return address is known at this point, and the register used
+	 * for jumping back is overwritten at the return address anyway.
+	 */
+	instrs_size += jump_to_addr(instrs_buff + instrs_size, REG_ZERO, ret_reg,
+				(uintptr_t)*dst + instrs_size,
+				(uintptr_t)patch->return_address);
 
-		/*
-		 * The TYPE_SML patch doesn't allocate any stack space in glibc,
-		 * but sp gets reduced by PATCH_SP_OFF in GW, so deallocate the
-		 * stack here before jumping back to TYPE_SML.
-		 */
-		instrs_size += rvpc_addisp(instrs_buff + instrs_size, PATCH_SP_OFF);
-		break;
+	memcpy(*dst, instrs_buff, instrs_size);
+	*dst += instrs_size;
+}
+
+static uint32_t
+read_instr(const uint8_t *code, unsigned length)
+{
+	uint32_t ins = 0;
+
+	for (unsigned i = 0; i < length; ++i)
+		ins |= (uint32_t)code[i] << (i * 8);
+
+	return ins;
+}
+
+/*
+ * relocate_auipc - loads the address the auipc at ins computes in the patched
+ * library, pc relative if the relocation space is in reach.
+ */
+static void
+relocate_auipc(uint8_t **dst, const struct intercept_disasm_result *ins)
+{
+	uint8_t instrs_buff[MAX_P_INS_SIZE];
+	uint8_t instrs_size;
+	uint32_t raw = read_instr(ins->address, RV_INS_SIZE);
+	uint8_t rd = (raw >> 7) & 0x1f;
+	int32_t offset = (int32_t)(raw & 0xfffff000);
+	uintptr_t address = (uintptr_t)(ins->address + offset);
+
+	instrs_size = rvp_la(instrs_buff, rd, (uintptr_t)*dst, address);
+	if (instrs_size == 0)
+		xabort("auipc address out of reach");
+
+	memcpy(*dst, instrs_buff, instrs_size);
+	*dst += instrs_size;
+}
+
+/*
+ * invert_branch - the branch at ins with the opposite condition, to offset.
+ * Returns zero if ins is an unconditional jump (jal zero or c.j).
+ */
+static uint8_t
+invert_branch(uint8_t *instrs_buff, const struct intercept_disasm_result *ins,
+		int32_t offset)
+{
+	uint32_t raw = read_instr(ins->address, ins->length);
+
+	if (ins->length == RVC_INS_SIZE) {
+		// c.beqz and c.bnez, funct3 110 and 111 in the quadrant 1
+		if ((raw & 0xc003) != 0xc001)
+			return 0;
+
+		uint8_t rs1 = 8 + ((raw >> 7) & 0x7);
+
+		if (raw & 0x2000)
+			return rv_beq(instrs_buff, rs1, REG_ZERO, offset);
+		else
+			return rv_bne(instrs_buff, rs1, REG_ZERO, offset);
 	}
 
-	// copy the jump instruction to return to glibc
-	instrs_size += rvpc_jalr(instrs_buff + instrs_size, REG_ZERO, ret_reg, 0);
+	if ((raw & 0x7f) != 0x63)
+		return 0;
+
+	// beq/bne, blt/bge and bltu/bgeu only differ in the lowest bit
+	return rv_branch(instrs_buff, ((raw >> 12) & 0x7) ^ 1,
+			(raw >> 15) & 0x1f, (raw >> 20) & 0x1f, offset);
+}
+
+/*
+ * relocate_jump - a branch or jump to its original target, through one of the
+ * registers dead there. A branch becomes the opposite branch, skipping the
+ * jump when it is not taken.
+ */
+static void
+relocate_jump(uint8_t **dst, const struct patch_desc *patch,
+		const struct intercept_disasm_result *ins)
+{
+	uint8_t instrs_buff[BRANCH_INS_SIZE + MAX_P_INS_SIZE];
+	uint8_t jump_buff[MAX_P_INS_SIZE];
+	uint8_t instrs_size;
+	uint8_t jump_size;
+	uint8_t reg = lowest_register(patch->branch_dead_regs);
+
+	if (reg == 0)
+		xabort("no register to relocate a jump with");
+
+	jump_size = jump_to_addr(jump_buff, REG_ZERO, reg,
+				(uintptr_t)*dst + BRANCH_INS_SIZE,
+				(uintptr_t)ins->rip_ref_addr);
+
+	instrs_size = invert_branch(instrs_buff, ins,
+				BRANCH_INS_SIZE + jump_size);
+
+	// an unconditional one, placed without the branch
+	if (instrs_size == 0)
+		jump_size = jump_to_addr(jump_buff, REG_ZERO, reg,
+				(uintptr_t)*dst, (uintptr_t)ins->rip_ref_addr);
+
+	memcpy(instrs_buff + instrs_size, jump_buff, jump_size);
+	instrs_size += jump_size;
 
 	memcpy(*dst, instrs_buff, instrs_size);
 	*dst += instrs_size;
 }
 
+/*
+ * copy_relocated - copies the patched instructions from start to end into
+ * the relocation space, rewriting the ones that use the pc.
+ */
+static void
+copy_relocated(uint8_t **dst, const struct patch_desc *patch,
+		const uint8_t *start, const uint8_t *end)
+{
+	while (start < end) {
+		struct intercept_disasm_result ins = {
+			.address = start,
+			.a7_set = -1
+		};
+
+		if (rv_decode(&ins, start, (size_t)(end - start)) == 0)
+			xabort("relocating an unknown instruction");
+
+		if (ins.rip_ref_addr != NULL) {
+			relocate_jump(dst, patch, &ins);
+		} else if (ins.has_ip_relative_opr) {
+			relocate_auipc(dst, &ins);
+		} else {
+			memcpy(*dst, start, ins.length);
+			*dst += ins.length;
+		}
+
+		start += ins.length;
+	}
+}
+
 static void
 relocate_instrs(struct patch_desc *patch, uint8_t **dst)
 {
 	patch->relocation_address = *dst;
 
-	uint8_t *start_addr = patch->dst_jmp_patch;
+	copy_site_prologue(dst, patch);
+
+	uint8_t *start_addr = get_patch_start(patch);
 	size_t patch_size = patch->patch_size_bytes;
-	size_t before_ecall_size;
-	size_t after_ecall_size;
 
 #ifdef __riscv_c
 	align_start_addr_and_size(patch, &start_addr, &patch_size);
 #endif
-	if (patch->is_ra_used_before)
-		load_orig_ra_temp(dst);
 
 	/* copy patched instructions before ecall */
-	before_ecall_size = patch->syscall_addr - start_addr;
-	memcpy(*dst, start_addr, before_ecall_size);
-	*dst += before_ecall_size;
+	copy_relocated(dst, patch, start_addr, patch->syscall_addr);
 
-	if (patch->is_ra_used_before)
-		store_new_ra_temp(dst);
-
-	/*
-	 * the instructions before ecall are copied,
-	 * copy jump instruction to go back to asm_entry_point
-	 */
-	copy_jump(dst, REG_RA, REG_RA, 0);
+	/* the ecall itself, or the hooks */
+	copy_syscall_entry(dst, patch);
 
 	/* copy patched instructions after ecall */
-	after_ecall_size = patch_size - before_ecall_size - ECALL_INS_SIZE;
-	if (after_ecall_size > 0) {
-		if (patch->is_ra_used_after)
-			load_orig_ra_temp(dst);
+	copy_relocated(dst, patch, patch->syscall_addr + ECALL_INS_SIZE,
+			start_addr + patch_size);
+
+	/* prepare for jump and go back to glibc */
+	finalize_and_jump_back(dst, patch);
+}
 
-		memcpy(*dst, patch->syscall_addr + ECALL_INS_SIZE,
-			after_ecall_size);
-		*dst += after_ecall_size;
+/*
+ * copy_dispatch_case - jump to the per-site prologue of the patch when t0
+ * holds its return address relative to the GW's return address. Both t0 and
+ * t1 are restored before the jump, the prologue expects the original values.
+ */
+static void
+copy_dispatch_case(uint8_t **dst, const struct patch_desc *gw,
+			const struct patch_desc *patch)
+{
+	uint8_t instrs_buff[LI_32_INS_SIZE + BRANCH_INS_SIZE +
+				MAX_PC_INS_SIZE * 2 + MAX_P_INS_SIZE];
+	uint8_t instrs_size = 0;
+	uint8_t branch_idx;
+	ptrdiff_t delta = patch->return_address - gw->return_address;
+
+	instrs_size += rvp_li(instrs_buff + instrs_size, REG_T1,
+				(int32_t)delta);
 
-		if (patch->is_ra_used_after)
-			store_new_ra_temp(dst);
+	// the branch skips the restore and the jump below, encoded afterwards
+	branch_idx = instrs_size;
+	instrs_size += BRANCH_INS_SIZE;
+
+	instrs_size += rvpc_ld(instrs_buff + instrs_size,
+				REG_T0, REG_SP, UNUSED_OFF1);
+	instrs_size += rvpc_ld(instrs_buff + instrs_size,
+				REG_T1, REG_SP, UNUSED_OFF2);
+
+	/* ra is free to use, only the dispatch needs the GW's return address */
+	instrs_size += jump_to_addr(instrs_buff + instrs_size, REG_ZERO, REG_RA,
+				(uintptr_t)*dst + instrs_size,
+				(uintptr_t)patch->relocation_address);
+
+	rv_bne(instrs_buff + branch_idx, REG_T0, REG_T1,
+		instrs_size - branch_idx);
+
+	memcpy(*dst, instrs_buff, instrs_size);
+	*dst += instrs_size;
+}
+
+/*
+ * copy_GW_dispatch - where TYPE_GW jumps to (directly or through the
+ * trampoline). Every TYPE_MID and TYPE_SML patch jumps to a nearby TYPE_GW,
+ * and it is up to the dispatch to figure out which one of the patches went
+ * through the GW. The table shows where the return addresses are:
+ *
+ *                 *     GW     *     MID     *     SML     *
+ *   ***************************************************************
+ *   ra            *  GW ret    *   GW ret    *   GW ret    *
+ *   ORIG_RA_OFF   *  orig ra   *   MID ret   *   orig ra   *
+ *   a7            *  a7        *   a7        *   SML ret   *
+ *
+ * Only the patches depending on this particular GW are compared (usually
+ * just a few), by their distance from the GW's return address.
+ */
+static void
+copy_GW_dispatch(struct intercept_desc *desc, struct patch_desc *gw,
+			uint8_t **dst)
+{
+	uint8_t instrs_buff[MAX_PC_INS_SIZE * 4 + SUB_INS_SIZE + MAX_P_INS_SIZE];
+	uint8_t instrs_size = 0;
+	bool has_SML = false;
+	bool has_MID = false;
+
+	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i) {
+		struct patch_desc *patch = desc->items + patch_i;
+
+		if (patch->gateway != gw)
+			continue;
+
+		if (patch->syscall_num == TYPE_MID)
+			has_MID = true;
+		else
+			has_SML = true;
 	}
 
-	/*
-	 * the instructions after ecall are copied,
-	 * copy jump instruction to return to asm_entry_point
-	 */
-	copy_jump(dst, REG_RA, REG_RA, 0);
+	/* no other patch uses this GW, jump directly to its prologue */
+	if (!has_SML && !has_MID) {
+		gw->dispatch_address = gw->relocation_address;
+		return;
+	}
 
-	/* prepare for jump and go back to glibc */
-	finalize_and_jump_back(dst, patch);
+	gw->dispatch_address = *dst;
+
+	// the trampoline stored the GW's return address before overwriting ra
+	if (desc->uses_trampoline)
+		instrs_size += rvpc_ld(instrs_buff + instrs_size,
+					REG_RA, REG_SP, UNUSED_OFF1);
+
+	instrs_size += rvpc_sd(instrs_buff + instrs_size,
+				REG_T0, REG_SP, UNUSED_OFF1);
+	instrs_size += rvpc_sd(instrs_buff + instrs_size,
+				REG_T1, REG_SP, UNUSED_OFF2);
+
+	if (has_SML)
+		instrs_size += rv_sub(instrs_buff + instrs_size,
+					REG_T0, REG_A7, REG_RA);
+
+	memcpy(*dst, instrs_buff, instrs_size);
+	*dst += instrs_size;
+
+	for (uint32_t patch_i = 0; has_SML && patch_i < desc->count; ++patch_i) {
+		struct patch_desc *patch = desc->items + patch_i;
+
+		if (patch->gateway == gw && patch->syscall_num >= 0)
+			copy_dispatch_case(dst, gw, patch);
+	}
+
+	if (has_MID) {
+		instrs_size = 0;
+		instrs_size += rvpc_ld(instrs_buff + instrs_size,
+					REG_T0, REG_SP, ORIG_RA_OFF);
+		instrs_size += rv_sub(instrs_buff + instrs_size,
+					REG_T0, REG_T0, REG_RA);
+
+		memcpy(*dst, instrs_buff, instrs_size);
+		*dst += instrs_size;
+	}
+
+	for (uint32_t patch_i = 0; has_MID && patch_i < desc->count; ++patch_i) {
+		struct patch_desc *patch = desc->items + patch_i;
+
+		if (patch->gateway == gw && patch->syscall_num == TYPE_MID)
+			copy_dispatch_case(dst, gw, patch);
+	}
+
+	/* a stub island has no site, the all zero illegal instruction */
+	if (gw->relocation_address == NULL) {
+		memset(*dst, 0, RV_INS_SIZE);
+		*dst += RV_INS_SIZE;
+		return;
+	}
+
+	/* none of the above, it's the GW itself */
+	instrs_size = 0;
+	instrs_size += rvpc_ld(instrs_buff + instrs_size,
+				REG_T0, REG_SP, UNUSED_OFF1);
+	instrs_size += rvpc_ld(instrs_buff + instrs_size,
+				REG_T1, REG_SP, UNUSED_OFF2);
 
-	return;
+	instrs_size += jump_to_addr(instrs_buff + instrs_size, REG_ZERO, REG_RA,
+				(uintptr_t)*dst + instrs_size,
+				(uintptr_t)gw->relocation_address);
+
+	memcpy(*dst, instrs_buff, instrs_size);
+	*dst += instrs_size;
 }
 
 /*
- * create_patch - create the custom assembly wrappers
- * around each syscall to be intercepted. Well, actually, the
- * function create_wrapper does that, so perhaps this function
- * deserves a better name.
- * What this function actually does, is figure out how to create
- * a jump instruction in libc ( which bytes to overwrite ).
+ * prepare_patches - figure out how to create a jump instruction
+ * in libc ( which bytes to overwrite ) around each syscall to be
+ * intercepted.
  * If it successfully finds suitable bytes for hotpatching,
  * then it determines the exact bytes to overwrite, and the exact
  * address for jumping back to libc.
@@ -585,18 +1214,52 @@ relocate_instrs(struct patch_desc *patch, uint8_t **dst)
  * This is all based on the information collected by the routine
  * find_syscalls, which does the disassembling, finding jump destinations,
  * finding padding bytes, etc..
+ *
+ * Nothing outside of desc is written here, the objects are prepared on the
+ * analysis workers (analysis_workers.c), so this must not call libc either.
  */
 void
-create_patch(struct intercept_desc *desc, uint8_t **dst)
+prepare_patches(struct intercept_desc *desc)
 {
 	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i) {
 		struct patch_desc *patch = desc->items + patch_i;
+		struct intercept_disasm_result window[SURROUNDING_INSTRS_NUM];
 		debug_dump("patching %s:0x%lx\n", desc->path,
 				patch->syscall_addr - desc->base_addr);
 
+		memcpy(window, patch->surrounding_instrs, sizeof(window));
+
 		uint8_t length = check_surrounding_instructions(desc, patch);
 
-		if (length >= TYPE_GW_SIZE) {
+		if (patch->syscall_num >= 0 &&
+				!is_syscall_patched(patch->syscall_num)) {
+			patch->is_skipped = true;
+			debug_dump("skipping, syscall %d is not selected\n",
+					patch->syscall_num);
+
+			/* only the ones that could serve as a GW go on */
+			if (length < TYPE_GW_SIZE)
+				continue;
+		}
+
+		patch->dead_register = 0;
+		if (!patch->is_skipped && length >= JUMP_2GB_INS_SIZE)
+			patch->dead_register =
+				check_frameless(patch, window, length);
+
+		/* the rest is left for the TYPE_GW patches, see below */
+		if (patch->dead_register != 0 && length < TYPE_GW_SIZE) {
+			patch->syscall_num = TYPE_GW;
+			patch->return_register = patch->dead_register;
+			debug_dump("frameless TYPE_GW, links with x%u\n",
+					patch->dead_register);
+
+		} else if (!patch->is_skipped &&
+		    is_SML_patchable(patch, length) &&
+		    claim_island(desc, patch)) {
+			debug_dump("TYPE_SML through a stub island\n");
+
+		} else if (length >= TYPE_GW_SIZE) {
 			patch->syscall_num = TYPE_GW;
 			patch->return_register = REG_RA;
 
@@ -607,7 +1270,7 @@ create_patch(struct intercept_desc *desc, uint8_t **dst)
 		} else if (!is_SML_patchable(patch, length)) {
 			char buffer[0x1000];
 
-			int l = snprintf(buffer, sizeof(buffer),
+			int l = snprintf_no_intercept(buffer, sizeof(buffer),
 				"unintercepted syscall at: %s 0x%lx\n",
 				desc->path,
 				patch->syscall_offset);
@@ -618,58 +1281,161 @@ create_patch(struct intercept_desc *desc, uint8_t **dst)
 
 		position_patch(patch);
 
-		uint8_t *last_instr_addr =
-			patch->dst_jmp_patch + patch->patch_size_bytes;
-#ifdef __riscv_c
-		if (patch->end_with_c_nop)
-			last_instr_addr += C_NOP_INS_SIZE;
-#endif
-		mark_jump(desc, last_instr_addr);
-
-		relocate_instrs(patch, dst);
-
 		/*
-		 * All valuable info from the surrounding instrs is gathered,
-		 * free all intercept_disasm_result structs.
+		 * A skipped site is only a candidate GW, it does not limit
+		 * the windows of the sites following it, see
+		 * overlaps_patched().
 		 */
-		free(patch->surrounding_instrs);
-		patch->surrounding_instrs = NULL;
+		if (!patch->is_skipped)
+			mark_jump(desc, get_patch_end(patch));
+	}
+
+	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i) {
+		struct patch_desc *patch = desc->items + patch_i;
+
+		if (patch->syscall_num == TYPE_GW || patch->is_skipped)
+			continue;
+
+		find_GW(desc, patch);
+
+		if (patch->gateway != NULL)
+			patch->gateway->is_skipped = false;
 	}
 
+	/*
+	 * The TYPE_GW patches no other patch goes through drop their stack
+	 * frame, positioned again they overwrite a part of what they would
+	 * have overwritten with one.
+	 */
 	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i) {
 		struct patch_desc *patch = desc->items + patch_i;
 
-		if (patch->syscall_num != TYPE_GW)
-			find_GW(desc, patch);
+		if (patch->syscall_num != TYPE_GW || patch->is_skipped ||
+		    patch->dead_register == 0 || is_frameless_GW(patch) ||
+		    has_users(desc, patch))
+			continue;
+
+		patch->return_register = patch->dead_register;
+		position_patch(patch);
 	}
+
+	/*
+	 * All valuable info from the surrounding instrs is gathered,
+	 * release all intercept_disasm_result structs.
+	 */
+	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i)
+		desc->items[patch_i].surrounding_instrs = NULL;
+
+	xarena_release(&desc->surr_arena);
 }
 
-static void
-copy_trampoline(uint8_t *trampoline_address)
+/*
+ * place_missing_islands - a stub island is mapped next to the patches, that
+ * have no TYPE_GW nor an island in the padding in reach.
+ */
+void
+place_missing_islands(struct intercept_desc *desc)
 {
-	/* This function (destination) is part of intercept_irq_entry.S */
-	extern void asm_entry_point(void);
-	uintptr_t destination = (uintptr_t)asm_entry_point + TRAMPOLINE_JUMP_OFFSET;
+	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i) {
+		struct patch_desc *patch = desc->items + patch_i;
+
+		if (patch->syscall_num == TYPE_GW || patch->is_skipped ||
+		    patch->gateway != NULL)
+			continue;
+
+		/* the island mapped for a previous patch might be in reach */
+		find_GW(desc, patch);
+
+		if (patch->gateway == NULL) {
+			uint8_t *address = map_island(get_jump_from(patch));
+
+			if (address != NULL) {
+				add_island(desc, address);
+				find_GW(desc, patch);
+			}
+		}
+
+		if (patch->gateway == NULL) {
+			char buffer[0x1000];
+
+			int l = snprintf(buffer, sizeof(buffer),
+				"no TYPE_GW in reach of syscall at: %s 0x%lx\n",
+				desc->path,
+				patch->syscall_offset);
+
+			intercept_log(buffer, (size_t)l);
+			xabort("no TYPE_GW in reach for patching around syscall");
+		}
+
+		patch->gateway->is_skipped = false;
+	}
+}
+
+/*
+ * create_patch - create the custom assembly wrappers
+ * around each syscall to be intercepted, in the relocation space,
+ * as decided by prepare_patches.
+ */
+void
+create_patch(struct intercept_desc *desc, uint8_t **dst)
+{
+	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i) {
+		struct patch_desc *patch = desc->items + patch_i;
+
+		/* not selected, nor used as a GW by a selected site */
+		if (patch->is_skipped)
+			continue;
+
+		relocate_instrs(patch, dst);
+	}
+
+	for (uint32_t patch_i = 0; patch_i < desc->count; ++patch_i) {
+		struct patch_desc *patch = desc->items + patch_i;
+
+		if (patch->syscall_num == TYPE_GW && !patch->is_skipped)
+			copy_GW_dispatch(desc, patch, dst);
+	}
+
+	for (struct stub_island *island = desc->islands; island != NULL;
+	    island = island->next) {
+		if (!island->gw.is_skipped)
+			copy_GW_dispatch(desc, &island->gw, dst);
+	}
+}
+
+_Static_assert(TRAMPOLINE_CODE_SIZE <= TRAMPOLINE_LITERAL_OFF,
+		"the trampoline code overlaps its literal");
 
-	uint8_t instrs_buff[MAX_PC_INS_SIZE + MAX_P_INS_SIZE];
+static void
+copy_trampoline(uint8_t *trampoline_address, uintptr_t destination,
+		uint8_t link_reg)
+{
+	uint8_t instrs_buff[TRAMPOLINE_CODE_SIZE];
 	uint8_t instrs_size = 0;
+	uint8_t *literal = trampoline_address + TRAMPOLINE_LITERAL_OFF;
 
-	instrs_size += rvpc_sd(instrs_buff + instrs_size,
-				REG_RA, REG_SP, UNUSED_OFF1);
+	// only a dispatch needs the return address, see copy_GW_dispatch()
+	if (link_reg == REG_RA)
+		instrs_size += rvpc_sd(instrs_buff + instrs_size,
+					REG_RA, REG_SP, UNUSED_OFF1);
 
-	instrs_size += rvp_jump_abs(instrs_buff + instrs_size, REG_ZERO,
-					REG_RA, destination);
+	instrs_size += rvp_ld_from_sym(instrs_buff + instrs_size, link_reg,
+				(uintptr_t)trampoline_address + instrs_size,
+				(uintptr_t)literal);
+
+	instrs_size += rvpc_jalr(instrs_buff + instrs_size,
+				REG_ZERO, link_reg, 0);
 
 	for (uint8_t i = 0; i < instrs_size; ++i)
 		trampoline_address[i] = instrs_buff[i];
+
+	for (uint8_t i = 0; i < sizeof(uint64_t); ++i)
+		literal[i] = (uint8_t)(destination >> (i * 8));
 }
 
 static void
-copy_GW(struct intercept_desc *desc, const struct patch_desc *patch)
+copy_GW(const struct patch_desc *patch, uintptr_t destination)
 {
-	/* This function (destination) is part of intercept_irq_entry.S */
-	extern void asm_entry_point(void);
-
 	uint8_t instrs_buff[MAX_PC_INS_SIZE * 6 + MAX_P_INS_SIZE];
 	uint8_t instrs_size = 0;
 
@@ -678,12 +1444,6 @@ copy_GW(struct intercept_desc *desc, const struct patch_desc *patch)
 	uintptr_t jalr_addr = (uintptr_t)patch->return_address -
 				JUMP_2GB_INS_SIZE;
 
-	uintptr_t destination;
-	if (desc->uses_trampoline)
-		destination = (uintptr_t)desc->trampoline_address;
-	else
-		destination = (uintptr_t)asm_entry_point;
-
 #ifdef __riscv_c
 	if (patch->start_with_c_nop) {
 		instrs_size += rvc_nop(instrs_buff + instrs_size);
@@ -691,16 +1451,22 @@ copy_GW(struct intercept_desc *desc, const struct patch_desc *patch)
 	}
 #endif
 
-	instrs_size += rvpc_addisp(instrs_buff + instrs_size, -PATCH_SP_OFF);
-	instrs_size += rvpc_sd(instrs_buff + instrs_size,
-				ret_reg, REG_SP, ORIG_RA_OFF);
+	if (!is_frameless_GW(patch)) {
+		instrs_size += rvpc_addisp(instrs_buff + instrs_size,
+					-PATCH_SP_OFF);
+		instrs_size += rvpc_sd(instrs_buff + instrs_size,
+					ret_reg, REG_SP, ORIG_RA_OFF);
+	}
 
 	instrs_size += rvp_jump_2GB(instrs_buff + instrs_size, ret_reg, ret_reg,
 					jalr_addr, destination);
 
-	instrs_size += rvpc_ld(instrs_buff + instrs_size,
-				ret_reg, REG_SP, ORIG_RA_OFF);
-	instrs_size += rvpc_addisp(instrs_buff + instrs_size, PATCH_SP_OFF);
+	if (!is_frameless_GW(patch)) {
+		instrs_size += rvpc_ld(instrs_buff + instrs_size,
+					ret_reg, REG_SP, ORIG_RA_OFF);
+		instrs_size += rvpc_addisp(instrs_buff + instrs_size,
+					PATCH_SP_OFF);
+	}
 
 #ifdef __riscv_c
 	if (patch->end_with_c_nop)
@@ -717,10 +1483,7 @@ copy_MID(const struct patch_desc *patch)
 {
 	uint8_t instrs_buff[MAX_PC_INS_SIZE * 6 + MAX_P_INS_SIZE];
 	uint8_t instrs_size = 0;
-	uint8_t *patch_start_addr = (uint8_t *)patch->return_address -
-						JAL_INS_SIZE -
-						STORE_LOAD_INS_SIZE -
-						MODIFY_SP_INS_SIZE;
+	uint8_t *patch_start_addr = get_patch_start(patch);
 	uint8_t ret_reg = patch->return_register;
 	uintptr_t GW_entry_addr = (uintptr_t)patch->dst_jmp_patch;
 	uintptr_t jal_addr = (uintptr_t)patch->return_address - JAL_INS_SIZE;
@@ -758,8 +1521,7 @@ copy_SML(const struct patch_desc *patch)
 {
 	uint8_t instrs_buff[MAX_PC_INS_SIZE * 3 + MAX_P_INS_SIZE];
 	uint8_t instrs_size = 0;
-	uint8_t *patch_start_addr = (uint8_t *)patch->return_address -
-							JAL_INS_SIZE;
+	uint8_t *patch_start_addr = get_patch_start(patch);
 	uintptr_t GW_entry_addr = (uintptr_t)patch->dst_jmp_patch;
 	uintptr_t jal_addr = (uintptr_t)patch->return_address - JAL_INS_SIZE;
 
@@ -787,6 +1549,24 @@ copy_SML(const struct patch_desc *patch)
 		patch_start_addr[i] = instrs_buff[i];
 }
 
+/*
+ * activate_GW - write a TYPE_GW patch or a stub island, jumping to its
+ * dispatch directly, or through the next trampoline.
+ */
+static void
+activate_GW(const struct intercept_desc *desc, const struct patch_desc *gw,
+		uint8_t **trampoline)
+{
+	if (desc->uses_trampoline) {
+		copy_trampoline(*trampoline, (uintptr_t)gw->dispatch_address,
+				gw->return_register);
+		copy_GW(gw, (uintptr_t)*trampoline);
+		*trampoline += TRAMPOLINE_SIZE;
+	} else {
+		copy_GW(gw, (uintptr_t)gw->dispatch_address);
+	}
+}
+
 /*
  * activate_patches()
  * Loop over all the patches, and and overwrite each syscall.
@@ -797,12 +1577,11 @@ activate_patches(struct intercept_desc *desc)
 	unsigned char *first_page;
 	size_t size;
 
+	uint8_t *trampoline = desc->trampoline_address;
+
 	if (desc->count == 0)
 		return;
 
-	if (desc->uses_trampoline)
-		copy_trampoline(desc->trampoline_address);
-
 	first_page = round_down_address(desc->text_start);
 	size = (size_t)(desc->text_end - first_page);
 
@@ -813,13 +1592,22 @@ activate_patches(struct intercept_desc *desc)
 	for (unsigned i = 0; i < desc->count; ++i) {
 		const struct patch_desc *patch = desc->items + i;
 
-		if (patch->dst_jmp_patch < desc->text_start ||
-		    patch->dst_jmp_patch > desc->text_end)
+		if (patch->is_skipped)
+			continue;
+
+		/* TYPE_MID and TYPE_SML can jump to a mapped stub island */
+		if (patch->syscall_num == TYPE_GW &&
+		    (patch->dst_jmp_patch < desc->text_start ||
+		    patch->dst_jmp_patch > desc->text_end))
 			xabort("dst_jmp_patch outside text");
 
+		if (patch->return_address < desc->text_start ||
+		    patch->return_address > desc->text_end)
+			xabort("return_address outside text");
+
 		switch (patch->syscall_num) {
 		case TYPE_GW:
-			copy_GW(desc, patch);
+			activate_GW(desc, patch, &trampoline);
 			break;
 		case TYPE_MID:
 			copy_MID(patch);
@@ -830,8 +1618,33 @@ activate_patches(struct intercept_desc *desc)
 		}
 	}
 
+	for (const struct stub_island *island = desc->islands; island != NULL;
+	    island = island->next) {
+		if (!island->gw.is_skipped)
+			activate_GW(desc, &island->gw, &trampoline);
+	}
+
+	uint64_t start = intercept_stats_time();
+
 	__builtin___clear_cache((char *)first_page, (char *)(first_page + size));
 
+	/* the islands in the padding are in the text, the rest are mapped */
+	for (const struct stub_island *island = desc->islands; island != NULL;
+	    island = island->next) {
+		uint8_t *address = island->gw.dst_jmp_patch;
+
+		if (!island->gw.is_skipped &&
+		    (address < desc->text_start || address > desc->text_end))
+			__builtin___clear_cache((char *)address,
+					(char *)(address + ISLAND_SIZE));
+	}
+
+	if (desc->uses_trampoline)
+		__builtin___clear_cache((char *)desc->trampoline_address,
+					(char *)trampoline);
+
+	intercept_stats_phase(STATS_CLEAR_CACHE, start);
+
 	mprotect_no_intercept(first_page, size,
 	    PROT_READ | PROT_EXEC,
 	    "mprotect PROT_READ | PROT_EXEC");
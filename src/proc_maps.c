@@ -0,0 +1,292 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * proc_maps.c -- a snapshot of /proc/self/maps
+ *
+ * Finding the path of an object that dl_iterate_phdr does not name, and
+ * finding room for a trampoline near each patched text section both need
+ * the mappings of the process. Instead of reading and parsing the maps file
+ * with stdio once for each library, it is read once with raw syscalls into
+ * an array sorted by address (the kernel lists the mappings in order), and
+ * the trampolines mapped later are added to it.
+ *
+ * The file is kept in memory, the paths in the array point into it.
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <syscall.h>
+
+#include "intercept.h"
+#include "intercept_util.h"
+#include "proc_maps.h"
+
+/*
+ * For simplicity, declare syscall_no_intercept() with return value 'long'
+ * because nothing in this TU needs the a1 register, only a0 is checked.
+ */
+extern long
+syscall_no_intercept(long syscall_number, ...);
+
+#define MAPS_READ_SIZE ((size_t)0x10000)
+
+static struct {
+	bool is_loaded;
+
+	/* the contents of /proc/self/maps */
+	char *text;
+	size_t text_size;
+
+	struct vma *vmas;
+	size_t count;
+	size_t capacity;
+} maps;
+
+/*
+ * read_maps_file -- the whole file, the size of /proc files is not known
+ * in advance, the buffer grows until a read returns nothing.
+ */
+static void
+read_maps_file(void)
+{
+	int fd = (int)syscall_no_intercept(SYS_openat, AT_FDCWD,
+				"/proc/self/maps", O_RDONLY | O_CLOEXEC);
+
+	xabort_on_syserror(fd, "open /proc/self/maps");
+
+	size_t used = 0;
+
+	maps.text_size = MAPS_READ_SIZE;
+	maps.text = xmmap_anon(maps.text_size);
+
+	for (;;) {
+		if (maps.text_size - used < MAPS_READ_SIZE / 4) {
+			maps.text = xmremap(maps.text, maps.text_size,
+						2 * maps.text_size);
+			maps.text_size *= 2;
+		}
+
+		/* one byte is kept for the terminating null */
+		long r = syscall_no_intercept(SYS_read, fd, maps.text + used,
+						maps.text_size - used - 1);
+
+		xabort_on_syserror(r, "read /proc/self/maps");
+
+		if (r == 0)
+			break;
+
+		used += (size_t)r;
+	}
+
+	maps.text[used] = '\0';
+
+	syscall_no_intercept(SYS_close, fd);
+}
+
+static uintptr_t
+parse_hex(char **str)
+{
+	uintptr_t value = 0;
+	char *c = *str;
+
+	for (;; ++c) {
+		if (*c >= '0' && *c <= '9')
+			value = value * 16 + (uintptr_t)(*c - '0');
+		else if (*c >= 'a' && *c <= 'f')
+			value = value * 16 + (uintptr_t)(*c - 'a' + 10);
+		else
+			break;
+	}
+
+	*str = c;
+
+	return value;
+}
+
+static void
+skip_field(char **str)
+{
+	while (**str == ' ')
+		++*str;
+	while (**str != ' ' && **str != '\n' && **str != '\0')
+		++*str;
+}
+
+/*
+ * append_vma -- add a mapping at the end of the array, growing it if needed
+ */
+static struct vma *
+append_vma(void)
+{
+	if (maps.count == maps.capacity) {
+		size_t size = maps.capacity * sizeof(maps.vmas[0]);
+
+		if (maps.capacity == 0) {
+			maps.capacity = 0x100;
+			maps.vmas = xmmap_anon(
+				maps.capacity * sizeof(maps.vmas[0]));
+		} else {
+			maps.vmas = xmremap(maps.vmas, size, 2 * size);
+			maps.capacity *= 2;
+		}
+	}
+
+	return &maps.vmas[maps.count++];
+}
+
+/*
+ * parse_maps_file -- each line is "start-end perms offset dev inode path",
+ * the lines are turned into null terminated paths in place
+ */
+static void
+parse_maps_file(void)
+{
+	char *line = maps.text;
+
+	while (*line != '\0') {
+		char *c = line;
+		char *eol = strchr(line, '\n');
+
+		if (eol == NULL)
+			eol = line + strlen(line);
+
+		struct vma *vma = append_vma();
+
+		vma->start = parse_hex(&c);
+		if (*c == '-')
+			++c;
+		vma->end = parse_hex(&c);
+
+		/* perms, offset, dev, inode */
+		for (int i = 0; i < 4; ++i)
+			skip_field(&c);
+
+		while (*c == ' ')
+			++c;
+
+		vma->path = c;
+
+		line = (*eol == '\0') ? eol : eol + 1;
+		*eol = '\0';
+	}
+}
+
+void
+proc_maps_load(void)
+{
+	if (maps.is_loaded)
+		xmunmap(maps.text, maps.text_size);
+
+	maps.count = 0;
+	read_maps_file();
+	parse_maps_file();
+	maps.is_loaded = true;
+
+	debug_dump("read %zu mappings from /proc/self/maps\n", maps.count);
+}
+
+static void
+load_once(void)
+{
+	if (!maps.is_loaded)
+		proc_maps_load();
+}
+
+/*
+ * first_vma_ending_after -- binary search for the index of the first
+ * mapping with addr < end, maps.count if there is none
+ */
+static size_t
+first_vma_ending_after(uintptr_t addr)
+{
+	size_t low = 0;
+	size_t high = maps.count;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		if (maps.vmas[mid].end <= addr)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+const struct vma *
+proc_maps_find(uintptr_t addr)
+{
+	load_once();
+
+	size_t i = first_vma_ending_after(addr);
+
+	if (i < maps.count && maps.vmas[i].start <= addr)
+		return &maps.vmas[i];
+
+	return NULL;
+}
+
+uintptr_t
+proc_maps_find_gap(uintptr_t from, size_t size)
+{
+	load_once();
+
+	for (size_t i = first_vma_ending_after(from); i < maps.count; ++i) {
+		if (maps.vmas[i].start >= from + size)
+			break; /* fits before this mapping */
+
+		from = maps.vmas[i].end;
+	}
+
+	return from;
+}
+
+void
+proc_maps_add(uintptr_t start, uintptr_t end)
+{
+	load_once();
+
+	size_t i = first_vma_ending_after(start);
+
+	append_vma();
+
+	memmove(maps.vmas + i + 1, maps.vmas + i,
+		(maps.count - 1 - i) * sizeof(maps.vmas[0]));
+
+	maps.vmas[i].start = start;
+	maps.vmas[i].end = end;
+	maps.vmas[i].path = "";
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * proc_maps.h - a snapshot of /proc/self/maps, read without libc and kept
+ * sorted, used for finding the path of an object and for finding free
+ * address ranges near a text section
+ */
+
+#ifndef INTERCEPT_PROC_MAPS_H
+#define INTERCEPT_PROC_MAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct vma {
+	uintptr_t start;
+	uintptr_t end;
+	/* empty string for anonymous mappings */
+	const char *path;
+};
+
+/*
+ * proc_maps_load - read /proc/self/maps, replacing the current snapshot.
+ * The other routines load it on first use, reloading is only needed after
+ * mappings were made that are not added with proc_maps_add.
+ */
+void proc_maps_load(void);
+
+/*
+ * proc_maps_find - the mapping containing addr, or NULL
+ */
+const struct vma *proc_maps_find(uintptr_t addr);
+
+/*
+ * proc_maps_find_gap - the lowest address at or above from, where size bytes
+ * are not mapped according to the snapshot
+ */
+uintptr_t proc_maps_find_gap(uintptr_t from, size_t size);
+
+/*
+ * proc_maps_add - tell the snapshot about a new anonymous mapping
+ */
+void proc_maps_add(uintptr_t start, uintptr_t end);
+
+#endif
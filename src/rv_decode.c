@@ -0,0 +1,448 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * rv_decode.c -- a table driven decoder for RV64GC, Zba, Zbb and Zcb.
+ *
+ * The major opcode (or the quadrant and funct3 of a compressed instruction)
+ * selects an entry that tells which register operands an instruction uses.
+ * Only a handful of encodings are looked at more closely: ecall, li a7,
+ * jumps, branches and auipc. Everything else is just a length and maybe
+ * a destination register. The extensions do not add new major opcodes,
+ * Zba and Zbb live in OP, OP-32, OP-IMM and OP-IMM-32, and Zcb in the
+ * reserved slot of the quadrant 0 and in the c.misc-alu group.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rv_decode.h"
+#include "rv_encode.h"
+
+/* properties of a major opcode */
+enum {
+	RD = 1 << 0,		// writes the integer rd
+	RS1 = 1 << 1,		// reads the integer rs1
+	RS2 = 1 << 2,		// reads the integer rs2
+	BRANCH = 1 << 3,
+	JAL = 1 << 4,
+	JALR = 1 << 5,
+	AUIPC = 1 << 6,
+	SYSTEM = 1 << 7,
+	OP_FP = 1 << 8,
+	OP_V = 1 << 9,
+	ILLEGAL = 1 << 10
+};
+
+struct rv_op {
+	uint16_t flags;
+	const char *name;
+};
+
+/* indexed by the bits [6:2] of a 32-bit instruction */
+static const struct rv_op rv_ops[32] = {
+	[0x00] = {RD | RS1, "load"},
+	[0x01] = {RS1 | RS2, "load-fp"},
+	[0x02] = {ILLEGAL, "custom-0"},
+	[0x03] = {RS1, "fence"},
+	[0x04] = {RD | RS1, "op-imm"},
+	[0x05] = {RD | AUIPC, "auipc"},
+	[0x06] = {RD | RS1, "op-imm-32"},
+	[0x07] = {ILLEGAL, "48-bit"},
+	[0x08] = {RS1 | RS2, "store"},
+	[0x09] = {RS1 | RS2, "store-fp"},
+	[0x0a] = {ILLEGAL, "custom-1"},
+	[0x0b] = {RD | RS1 | RS2, "amo"},
+	[0x0c] = {RD | RS1 | RS2, "op"},
+	[0x0d] = {RD, "lui"},
+	[0x0e] = {RD | RS1 | RS2, "op-32"},
+	[0x0f] = {ILLEGAL, "64-bit"},
+	[0x10] = {0, "fmadd"},
+	[0x11] = {0, "fmsub"},
+	[0x12] = {0, "fnmsub"},
+	[0x13] = {0, "fnmadd"},
+	[0x14] = {OP_FP, "op-fp"},
+	[0x15] = {OP_V, "op-v"},
+	[0x16] = {ILLEGAL, "custom-2"},
+	[0x17] = {ILLEGAL, "48-bit"},
+	[0x18] = {RS1 | RS2 | BRANCH, "branch"},
+	[0x19] = {RD | RS1 | JALR, "jalr"},
+	[0x1a] = {ILLEGAL, "reserved"},
+	[0x1b] = {RD | JAL, "jal"},
+	[0x1c] = {SYSTEM, "system"},
+	[0x1d] = {ILLEGAL, "reserved"},
+	[0x1e] = {ILLEGAL, "custom-3"},
+	[0x1f] = {ILLEGAL, "80-bit"}
+};
+
+static inline int32_t
+sign_extend(uint32_t value, unsigned bits)
+{
+	uint32_t sign = 1u << (bits - 1);
+
+	return (int32_t)((value ^ sign) - sign);
+}
+
+static inline void
+set_name(struct intercept_disasm_result *result, const char *name)
+{
+#ifndef NDEBUG
+	strncpy(result->mnemonic, name, sizeof(result->mnemonic) - 1);
+#else
+	(void) result;
+	(void) name;
+#endif
+}
+
+static inline void
+set_rel_jump(struct intercept_disasm_result *result, int32_t disp)
+{
+	result->has_ip_relative_opr = true;
+	result->rip_disp = disp;
+	result->rip_ref_addr = result->address + disp;
+}
+
+/* set_rs - records a read of the integer register rs */
+static inline void
+set_rs(struct intercept_disasm_result *result, uint8_t rs)
+{
+	result->regs_read |= 1u << rs;
+}
+
+/*
+ * set_rd - records a write to the integer register rd. The register is
+ * reported in reg_set only if its old value is certainly dead, i.e., when
+ * the same instruction does not also read it.
+ */
+static inline void
+set_rd(struct intercept_disasm_result *result, uint8_t rd, bool rd_is_read)
+{
+	if (rd == REG_ZERO)
+		return;
+
+	result->regs_written |= 1u << rd;
+	if (rd_is_read)
+		set_rs(result, rd);
+
+	if (rd == REG_A7)
+		result->is_a7_modified = true;
+
+	if (!rd_is_read)
+		result->reg_set = rd;
+}
+
+static unsigned
+decode_32(struct intercept_disasm_result *result, uint32_t ins)
+{
+	const struct rv_op *op = &rv_ops[(ins >> 2) & 0x1f];
+	uint8_t rd = (ins >> 7) & 0x1f;
+	uint8_t funct3 = (ins >> 12) & 0x7;
+	uint8_t rs1 = (ins >> 15) & 0x1f;
+	uint8_t rs2 = (ins >> 20) & 0x1f;
+	uint16_t flags = op->flags;
+
+	if (flags & ILLEGAL)
+		return 0;
+
+	set_name(result, op->name);
+
+	if (flags & SYSTEM) {
+		if (ins == 0x00000073) {
+			result->is_syscall = true;
+			set_name(result, "ecall");
+			// the arguments, the kernel only writes a0
+			result->regs_read |= 0xffu << REG_A0;
+			result->regs_written |= 1u << REG_A0;
+		} else if (funct3 != 0) {
+			// csrr* and hlv*, rs1 is an immediate in csrr*i
+			flags |= RD | (funct3 < 5 ? RS1 : 0);
+		} else {
+			// sfence.vma and friends
+			flags |= RS1 | RS2;
+		}
+	} else if (flags & OP_FP) {
+		// feq/flt/fle, fcvt.int.fp and fmv.x/fclass write an integer rd
+		uint8_t funct5 = (uint8_t)(ins >> 27);
+		if (funct5 == 0x14 || funct5 == 0x18 || funct5 == 0x1c)
+			flags |= RD;
+		// fcvt.fp.int and fmv.fp.x read an integer rs1
+		else if (funct5 == 0x1a || funct5 == 0x1e)
+			flags |= RS1;
+	} else if (flags & OP_V) {
+		/*
+		 * vsetvl* and a few OPMVV instructions (vmv.x.s, vcpop.m,
+		 * vfirst.m) write an integer rd. Not worth decoding further,
+		 * just assume the rd field is written and read, and that the
+		 * rs1 and rs2 fields are integer registers read.
+		 */
+		if (funct3 == 7 || funct3 == 2)
+			set_rd(result, rd, true);
+		flags |= RS1 | RS2;
+	}
+
+	if (flags & RS1)
+		set_rs(result, rs1);
+	if (flags & RS2)
+		set_rs(result, rs2);
+
+	if (flags & BRANCH) {
+		uint32_t imm = ((ins >> 19) & 0x1000) | ((ins << 4) & 0x800) |
+				((ins >> 20) & 0x7e0) | ((ins >> 7) & 0x1e);
+		set_rel_jump(result, sign_extend(imm, 13));
+	} else if (flags & JAL) {
+		uint32_t imm = ((ins >> 11) & 0x100000) | (ins & 0xff000) |
+				((ins >> 9) & 0x800) | ((ins >> 20) & 0x7fe);
+		set_rel_jump(result, sign_extend(imm, 21));
+	} else if (flags & JALR) {
+		result->is_abs_jump = true;
+	} else if (flags & AUIPC) {
+		/*
+		 * Without rip_ref_addr, the address is not a jump target.
+		 * The patcher loads the same address into rd when it
+		 * relocates the auipc, see relocate_auipc() in patcher.c.
+		 */
+		result->has_ip_relative_opr = true;
+	}
+
+	if (flags & RD) {
+		// addi a7, zero, imm -- li a7, imm
+		if (rd == REG_A7 && rs1 == REG_ZERO &&
+				(ins & 0x707f) == 0x0013) {
+			result->a7_set = (int16_t)((int32_t)ins >> 20);
+			result->reg_set = rd;
+			result->regs_written |= 1u << rd;
+			set_name(result, "li");
+		} else {
+			set_rd(result, rd,
+				((flags & RS1) && rs1 == rd) ||
+				((flags & RS2) && rs2 == rd));
+		}
+	}
+
+	return RV_INS_SIZE;
+}
+
+#ifdef __riscv_c
+/* kinds of compressed instructions, as far as the patcher cares */
+enum {
+	C_ILLEGAL,
+	C_NONE,		// no integer destination outside of x8-x15
+	C_ADDI4SPN,	// rd' = sp + imm
+	C_LOAD,		// rd' = mem[rs1' + imm]
+	C_ZCB_MEM,	// c.lbu, c.lhu, c.lh, c.sb, c.sh
+	C_RW,		// rd = rd op imm
+	C_LI,
+	C_LUI,		// also c.addi16sp
+	C_J,
+	C_BZ,		// c.beqz, c.bnez
+	C_LDSP,		// rd = mem[sp + imm]
+	C_CR		// c.jr, c.mv, c.ebreak, c.jalr, c.add
+};
+
+struct rvc_op {
+	uint8_t kind;
+	const char *name;
+};
+
+/* indexed by the quadrant in bits [1:0] and the funct3 in bits [15:13] */
+static const struct rvc_op rvc_ops[24] = {
+	{C_ADDI4SPN, "c.addi4spn"},
+	{C_NONE, "c.fld"},
+	{C_LOAD, "c.lw"},
+	{C_LOAD, "c.ld"},
+	{C_ZCB_MEM, "c.zcb"},
+	{C_NONE, "c.fsd"},
+	{C_NONE, "c.sw"},
+	{C_NONE, "c.sd"},
+
+	{C_RW, "c.addi"},
+	{C_RW, "c.addiw"},
+	{C_LI, "c.li"},
+	{C_LUI, "c.lui"},
+	{C_NONE, "c.misc-alu"},
+	{C_J, "c.j"},
+	{C_BZ, "c.beqz"},
+	{C_BZ, "c.bnez"},
+
+	{C_RW, "c.slli"},
+	{C_NONE, "c.fldsp"},
+	{C_LDSP, "c.lwsp"},
+	{C_LDSP, "c.ldsp"},
+	{C_CR, "c.cr"},
+	{C_NONE, "c.fsdsp"},
+	{C_NONE, "c.swsp"},
+	{C_NONE, "c.sdsp"}
+};
+
+static unsigned
+decode_16(struct intercept_disasm_result *result, uint16_t ins)
+{
+	const struct rvc_op *op = &rvc_ops[((ins & 0x3) << 3) | (ins >> 13)];
+	uint8_t rd = (ins >> 7) & 0x1f;
+	uint8_t rs2 = (ins >> 2) & 0x1f;
+	// the 3-bit register fields address x8-x15
+	uint8_t rd_p = 8 + ((ins >> 2) & 0x7);
+	uint8_t rs1_p = 8 + ((ins >> 7) & 0x7);
+	uint32_t imm;
+
+	set_name(result, op->name);
+
+	switch (op->kind) {
+	case C_ILLEGAL:
+		return 0;
+	case C_NONE:
+		// the loads, stores and c.misc-alu, any of these might be read
+		set_rs(result, rs1_p);
+		set_rs(result, rd_p);
+		set_rs(result, rs2);
+		set_rs(result, REG_SP);
+		break;
+	case C_ADDI4SPN:
+		// all zeros is the defined illegal instruction
+		if ((ins & 0x1fe0) == 0)
+			return 0;
+		set_rs(result, REG_SP);
+		set_rd(result, rd_p, false);
+		break;
+	case C_LOAD:
+		set_rs(result, rs1_p);
+		set_rd(result, rd_p, rd_p == rs1_p);
+		break;
+	case C_ZCB_MEM:
+		set_rs(result, rs1_p);
+		switch ((ins >> 10) & 0x7) {
+		case 0: // c.lbu
+		case 1: // c.lhu, c.lh
+			set_rd(result, rd_p, rd_p == rs1_p);
+			break;
+		case 2: // c.sb
+		case 3: // c.sh
+			set_rs(result, rd_p);
+			break;
+		default:
+			return 0;
+		}
+		break;
+	case C_RW:
+		set_rd(result, rd, true);
+		break;
+	case C_LI:
+		if (rd == REG_A7) {
+			imm = ((ins >> 7) & 0x20) | ((ins >> 2) & 0x1f);
+			result->a7_set = (int16_t)sign_extend(imm, 6);
+			result->reg_set = rd;
+			result->regs_written |= 1u << rd;
+		} else {
+			set_rd(result, rd, false);
+		}
+		break;
+	case C_LUI:
+		// c.addi16sp when rd is sp
+		set_rd(result, rd, rd == REG_SP);
+		break;
+	case C_J:
+		imm = ((ins >> 1) & 0x800) | ((ins >> 7) & 0x10) |
+			((ins >> 1) & 0x300) | ((ins << 2) & 0x400) |
+			((ins >> 1) & 0x40) | ((ins << 1) & 0x80) |
+			((ins >> 2) & 0xe) | ((ins << 3) & 0x20);
+		set_rel_jump(result, sign_extend(imm, 12));
+		break;
+	case C_BZ:
+		imm = ((ins >> 4) & 0x100) | ((ins >> 7) & 0x18) |
+			((ins << 1) & 0xc0) | ((ins >> 2) & 0x6) |
+			((ins << 3) & 0x20);
+		set_rel_jump(result, sign_extend(imm, 9));
+		set_rs(result, rs1_p);
+		break;
+	case C_LDSP:
+		if (rd == REG_ZERO)
+			return 0;
+		set_rs(result, REG_SP);
+		set_rd(result, rd, rd == REG_SP);
+		break;
+	case C_CR:
+		if (rs2 != REG_ZERO) {
+			// c.mv rd, rs2 or c.add rd, rs2
+			bool is_add = ins & 0x1000;
+			set_rs(result, rs2);
+			set_rd(result, rd, is_add || rd == rs2);
+			set_name(result, is_add ? "c.add" : "c.mv");
+		} else if (rd == REG_ZERO) {
+			// c.ebreak, c.jr zero is reserved
+			if (!(ins & 0x1000))
+				return 0;
+			set_name(result, "c.ebreak");
+		} else {
+			result->is_abs_jump = true;
+			set_rs(result, rd);
+			if (ins & 0x1000) {
+				// ra implicitly overwritten
+				result->regs_written |= 1u << REG_RA;
+				if (rd != REG_RA)
+					result->reg_set = REG_RA;
+				set_name(result, "c.jalr");
+			} else {
+				set_name(result, "c.jr");
+			}
+		}
+		break;
+	}
+
+	return RVC_INS_SIZE;
+}
+#endif
+
+unsigned
+rv_decode(struct intercept_disasm_result *result,
+		const uint8_t *code, size_t size)
+{
+	unsigned length = 0;
+
+	if (size < RVC_INS_SIZE)
+		return 0;
+
+	uint16_t lo = (uint16_t)(code[0] | code[1] << 8);
+
+	if ((lo & 0x3) != 0x3) {
+#ifdef __riscv_c
+		length = decode_16(result, lo);
+#endif
+	} else if (size >= RV_INS_SIZE) {
+		uint32_t ins = lo | (uint32_t)(code[2] | code[3] << 8) << 16;
+		length = decode_32(result, ins);
+	}
+
+	result->length = length;
+
+	return length;
+}
@@ -428,6 +428,51 @@ rv_jalr(uint8_t *instr_buff, uint8_t rd, uint8_t rs, int32_t imm)
 	return RV_INS_SIZE;
 }
 
+uint8_t
+rv_sub(uint8_t *instr_buff, uint8_t rd, uint8_t rs1, uint8_t rs2)
+{
+	if (rd == REG_ZERO)
+		return 0;
+
+	uint32_t instr = 0;
+
+	instr = 0x20 << 25 | rs2 << 20 | rs1 << 15 | rd << 7 | 0x33;
+
+	reverse_byte_order(instr_buff, instr, RV_INS_SIZE);
+
+	return RV_INS_SIZE;
+}
+
+uint8_t
+rv_branch(uint8_t *instr_buff, uint8_t funct3, uint8_t rs1, uint8_t rs2,
+		int32_t imm)
+{
+	if (imm < -0x1000 || imm >= 0x1000 || imm % 2 != 0)
+		return 0;
+
+	uint32_t instr = 0;
+
+	instr = (imm >> 12 & 0x1) << 31 | (imm >> 5 & 0x3f) << 25;
+	instr |= rs2 << 20 | rs1 << 15 | funct3 << 12;
+	instr |= (imm >> 1 & 0xf) << 8 | (imm >> 11 & 0x1) << 7 | 0x63;
+
+	reverse_byte_order(instr_buff, instr, RV_INS_SIZE);
+
+	return RV_INS_SIZE;
+}
+
+uint8_t
+rv_beq(uint8_t *instr_buff, uint8_t rs1, uint8_t rs2, int32_t imm)
+{
+	return rv_branch(instr_buff, 0x0, rs1, rs2, imm);
+}
+
+uint8_t
+rv_bne(uint8_t *instr_buff, uint8_t rs1, uint8_t rs2, int32_t imm)
+{
+	return rv_branch(instr_buff, 0x1, rs1, rs2, imm);
+}
+
 uint8_t
 rvpc_addi(uint8_t *instr_buff, uint8_t rd, uint8_t rs, int32_t imm)
 {
@@ -562,9 +607,46 @@ uint8_t
 rvp_jal(uint8_t *instr_buff, uint8_t rd, uintptr_t from, uintptr_t to)
 {
 	uint8_t total_size;
-	int32_t offset = to - from;
+	ptrdiff_t offset = to - from;
+
+	// don't let the truncation to int32_t bring far addresses in reach
+	if (offset < -JAL_AVG_REACH - 1 || offset >= JAL_AVG_REACH)
+		return 0;
+
+	total_size = rv_jal(instr_buff, rd, (int32_t)offset);
+
+	return total_size;
+}
+
+/*
+ * rvp_li - load a 32-bit immediate, the same way as the li pseudo instruction
+ * (lui + addiw), but only one instruction is used when the immediate fits.
+ */
+uint8_t
+rvp_li(uint8_t *instrs_buff, uint8_t rd, int32_t imm)
+{
+	uint8_t total_size = 0;
+	int32_t imm_hi = (int32_t)((uint32_t)imm >> 12);
+	int32_t imm_lo = imm & 0xfff;
+
+	if (imm >= -0x800 && imm < 0x800)
+		return rvpc_li(instrs_buff, rd, imm);
+
+	if (imm_lo >= 0x800) {
+		++imm_hi;
+		imm_lo -= 0x1000;
+	}
+
+	// sign-extends 20 bits
+	imm_hi &= 0xfffff;
+	if (imm_hi & 0x80000)
+		imm_hi |= (int32_t)0xfff00000;
 
-	total_size = rv_jal(instr_buff, rd, offset);
+	total_size += rv_lui(instrs_buff + total_size, rd, imm_hi);
+
+	if (imm_lo != 0)
+		total_size += rvpc_addiw(instrs_buff + total_size,
+						rd, rd, imm_lo);
 
 	return total_size;
 }
@@ -625,13 +707,14 @@ rvp_jump_2GB(uint8_t *instrs_buff, uint8_t rd, uint8_t rs,
 	return total_size;
 }
 
-uint8_t
-rvp_jump_abs(uint8_t *instrs_buff, uint8_t rd, uint8_t rs, uintptr_t to)
+/*
+ * load_abs_upper - loads the address without its lowest 12 bits into rs,
+ * those are left for the instruction that uses rs, in addr_lo12.
+ */
+static uint8_t
+load_abs_upper(uint8_t *instrs_buff, uint8_t rs, uintptr_t to,
+		int16_t *addr_lo12)
 {
-	// either kernel space or just too big address, return 0
-	if (to >> 48 & 0xfff)
-		return 0;
-
 	uint8_t total_size = 0;
 
 	int32_t addr_hi = to >> 28;
@@ -651,7 +734,7 @@ rvp_jump_abs(uint8_t *instrs_buff, uint8_t rd, uint8_t rs, uintptr_t to)
 
 	if (addr_lo == 0) {
 		total_size += rvpc_slli(instrs_buff + total_size, rs, rs, 16);
-		total_size += rvpc_jalr(instrs_buff + total_size, rd, rs, 0);
+		*addr_lo12 = 0;
 
 		return total_size;
 	}
@@ -671,9 +754,61 @@ rvp_jump_abs(uint8_t *instrs_buff, uint8_t rd, uint8_t rs, uintptr_t to)
 					addr_lo_upper4);
 
 	total_size += rvpc_slli(instrs_buff + total_size, rs, rs, 12);
+	*addr_lo12 = addr_lo_lower12;
 
-	total_size += rvpc_jalr(instrs_buff + total_size,
-				rd, rs, addr_lo_lower12);
+	return total_size;
+}
+
+uint8_t
+rvp_jump_abs(uint8_t *instrs_buff, uint8_t rd, uint8_t rs, uintptr_t to)
+{
+	// either kernel space or just too big address, return 0
+	if (to >> 48 & 0xfff)
+		return 0;
+
+	uint8_t total_size = 0;
+	int16_t addr_lo12;
+
+	total_size += load_abs_upper(instrs_buff + total_size, rs, to,
+					&addr_lo12);
+	total_size += rvpc_jalr(instrs_buff + total_size, rd, rs, addr_lo12);
+
+	return total_size;
+}
+
+/*
+ * rvp_la - load an address into rd, relative to from (where the code is
+ * placed) when it is in reach, as an absolute address otherwise.
+ */
+uint8_t
+rvp_la(uint8_t *instrs_buff, uint8_t rd, uintptr_t from, uintptr_t addr)
+{
+	uint8_t total_size = 0;
+	offsets_2GB offs;
+	int16_t addr_lo12;
+
+	offs = get_auipc_offsets(from, addr);
+	if (offs.offset_hi != 0 || offs.offset_lo != 0) {
+		total_size += rv_auipc(instrs_buff + total_size,
+					rd, offs.offset_hi);
+
+		if (offs.offset_lo != 0)
+			total_size += rvpc_addi(instrs_buff + total_size,
+						rd, rd, offs.offset_lo);
+
+		return total_size;
+	}
+
+	// either kernel space or just too big address, return 0
+	if (addr >> 48 & 0xfff)
+		return 0;
+
+	total_size += load_abs_upper(instrs_buff + total_size, rd, addr,
+					&addr_lo12);
+
+	if (addr_lo12 != 0)
+		total_size += rvpc_addi(instrs_buff + total_size,
+					rd, rd, addr_lo12);
 
 	return total_size;
 }
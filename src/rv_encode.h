@@ -58,9 +58,13 @@
 #define JAL_INS_SIZE		RV_INS_SIZE
 #define JALR_INS_SIZE		RV_INS_SIZE
 #define AUIPC_INS_SIZE		RV_INS_SIZE
+#define SUB_INS_SIZE		RV_INS_SIZE
+#define BRANCH_INS_SIZE		RV_INS_SIZE
 
 #define JUMP_2GB_INS_SIZE	(AUIPC_INS_SIZE + \
 				JALR_INS_SIZE)
+#define LI_32_INS_SIZE		(LUI_INS_SIZE + \
+				ADDIW_INS_SIZE)
 /*
  * Size of this varies quite a bit, depending on the destination address
  * and compression. This size is for the worst case scenario. The final size
@@ -140,6 +144,11 @@ uint8_t rv_ld(uint8_t *instr_buff, uint8_t rd, uint8_t rs, int32_t imm);
 uint8_t rv_auipc(uint8_t *instr_buff, uint8_t rd, int32_t imm);
 uint8_t rv_jal(uint8_t *instr_buff, uint8_t rd, int32_t imm);
 uint8_t rv_jalr(uint8_t *instr_buff, uint8_t rd, uint8_t rs, int32_t imm);
+uint8_t rv_sub(uint8_t *instr_buff, uint8_t rd, uint8_t rs1, uint8_t rs2);
+uint8_t rv_beq(uint8_t *instr_buff, uint8_t rs1, uint8_t rs2, int32_t imm);
+uint8_t rv_bne(uint8_t *instr_buff, uint8_t rs1, uint8_t rs2, int32_t imm);
+uint8_t rv_branch(uint8_t *instr_buff, uint8_t funct3, uint8_t rs1,
+			uint8_t rs2, int32_t imm);
 
 /* Compressed Instructions */
 #ifdef __riscv_c
@@ -175,6 +184,7 @@ uint8_t rvpc_jalr(uint8_t *instr_buff, uint8_t rd, uint8_t rs, int32_t imm);
  *       These are here to serve mostly the purpose of syscall_intercept.
  */
 uint8_t rvp_jal(uint8_t *instr_buff, uint8_t rd, uintptr_t from, uintptr_t to);
+uint8_t rvp_li(uint8_t *instrs_buff, uint8_t rd, int32_t imm);
 uint8_t rvp_sd_to_sym(uint8_t *instrs_buff, uint8_t tmp_reg, uint8_t rs,
 			uintptr_t from, uintptr_t sym_addr);
 uint8_t rvp_ld_from_sym(uint8_t *instrs_buff, uint8_t rd,
@@ -183,3 +193,5 @@ uint8_t rvp_jump_2GB(uint8_t *instrs_buff, uint8_t rd, uint8_t rs,
 			uintptr_t from, uintptr_t to);
 uint8_t rvp_jump_abs(uint8_t *instrs_buff, uint8_t rd,
 			uint8_t rs, uintptr_t to);
+uint8_t rvp_la(uint8_t *instrs_buff, uint8_t rd,
+			uintptr_t from, uintptr_t addr);
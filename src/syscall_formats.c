@@ -34,6 +34,7 @@
 #include "intercept_util.h"
 
 #include <fcntl.h>
+#include <string.h>
 #include <sys/syscall.h>
 
 #define SARGS(name, r, ...) [SYS_##name] = {#name, r, {__VA_ARGS__}}
@@ -557,3 +558,20 @@ get_syscall_format(const struct syscall_desc *desc)
 
 	return formats + desc->nr;
 }
+
+/*
+ * get_syscall_number - look up a syscall number by name, e.g. "openat"
+ * Returns -1 for names not known to this table.
+ */
+long
+get_syscall_number(const char *name, size_t len)
+{
+	for (size_t nr = 0; nr < ARRAY_SIZE(formats); ++nr) {
+		if (formats[nr].name != NULL &&
+		    strlen(formats[nr].name) == len &&
+		    strncmp(formats[nr].name, name, len) == 0)
+			return (long)nr;
+	}
+
+	return -1;
+}
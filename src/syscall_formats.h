@@ -89,4 +89,6 @@ struct syscall_format {
 const struct syscall_format *
 get_syscall_format(const struct syscall_desc *desc);
 
+long get_syscall_number(const char *name, size_t len);
+
 #endif
@@ -0,0 +1,399 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * syscall_hooks.c -- registered hooks
+ *
+ * The syscall_hooks table is indexed by the syscall number, intercept_routine
+ * reads it without taking any lock. An entry (fn and user pointer) is never
+ * changed or freed once published, a new registration of the same syscall
+ * number publishes a new entry, since other threads might still be using the
+ * old one. Entries are small and registrations are rare, the replaced ones
+ * are simply not reused.
+ *
+ * The hook chain is an array sorted by priority, also never changed once
+ * published (RCU style). Adding or removing a hook publishes a new copy, and
+ * retires the old one. Each thread running the chain notes the current
+ * chain_epoch in its own chain_reader, on its own cache line, so readers
+ * never write shared memory. A retired chain is tagged with the epoch it was
+ * retired in, and unmapped by a registration once every active reader
+ * started in a later epoch, thus nobody waits for anybody, and a reader
+ * that never finishes only holds back the chains retired after it started.
+ * The chain_reader of a thread is never freed, threads are not followed
+ * until their exit, a cache line per thread is leaked.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libsyscall_intercept_hook_point.h"
+#include "intercept_util.h"
+#include "syscall_hooks.h"
+#include "syscall_mask.h"
+
+#define ENTRIES_PER_CHUNK	(0x1000 / sizeof(struct syscall_hook))
+
+#define READER_SIZE		64
+/* a page per chunk, the header of the chunk takes the first line */
+#define READERS_PER_CHUNK	(0x1000 / READER_SIZE - 1)
+
+const struct syscall_hook *syscall_hooks[SYSCALL_HOOKS_COUNT];
+
+/* serializes the registrations, never taken by intercept_routine */
+static int registry_lock;
+
+static struct syscall_hook *free_entries;
+static size_t free_entries_count;
+
+const struct hook_chain *hook_chain;
+
+struct chain_reader {
+	/* the chain_epoch seen before loading hook_chain, zero when idle */
+	unsigned long epoch;
+} __attribute__((aligned(READER_SIZE)));
+
+struct reader_chunk {
+	struct reader_chunk *next;
+	size_t used;
+	struct chain_reader readers[READERS_PER_CHUNK];
+};
+
+/* every chain_reader claimed so far, chunks are only ever added */
+static struct reader_chunk *reader_chunks;
+
+static __thread struct chain_reader *chain_reader
+	__attribute__((tls_model("initial-exec")));
+
+/* incremented by each chain retired, zero is left for idle readers */
+static unsigned long chain_epoch = 1;
+
+/* replaced chains, possibly still in use */
+static struct hook_chain *retired_chains;
+
+static void
+registry_lock_acquire(void)
+{
+	while (__atomic_exchange_n(&registry_lock, 1, __ATOMIC_ACQUIRE) != 0)
+		;
+}
+
+static void
+registry_lock_release(void)
+{
+	__atomic_store_n(&registry_lock, 0, __ATOMIC_RELEASE);
+}
+
+static struct syscall_hook *
+new_entry(intercept_syscall_hook_fn fn, void *user)
+{
+	if (free_entries_count == 0) {
+		free_entries = xmmap_anon(ENTRIES_PER_CHUNK *
+						sizeof(*free_entries));
+		free_entries_count = ENTRIES_PER_CHUNK;
+	}
+
+	struct syscall_hook *entry = free_entries++;
+	--free_entries_count;
+
+	entry->fn = fn;
+	entry->user = user;
+
+	return entry;
+}
+
+/*
+ * intercept_register_syscall_hook - set the hook of a syscall number
+ * This is part of syscall_intercept's public API.
+ */
+__attribute__((visibility("default")))
+int
+intercept_register_syscall_hook(long nr, intercept_syscall_hook_fn fn,
+				void *user)
+{
+	if (nr < 0 || nr >= SYSCALL_HOOKS_COUNT)
+		return -1;
+
+	registry_lock_acquire();
+
+	struct syscall_hook *entry = NULL;
+
+	if (fn != NULL)
+		entry = new_entry(fn, user);
+
+	/* the entry must be complete before any thread can see it */
+	__atomic_store_n(&syscall_hooks[nr], entry, __ATOMIC_RELEASE);
+	set_syscall_hooked(nr, fn != NULL);
+
+	registry_lock_release();
+
+	return 0;
+}
+
+/*
+ * claim_reader - a chain_reader for the calling thread, from the first chunk,
+ * or from a new one when that is full
+ */
+static struct chain_reader *
+claim_reader(void)
+{
+	for (;;) {
+		struct reader_chunk *chunk =
+			__atomic_load_n(&reader_chunks, __ATOMIC_SEQ_CST);
+
+		if (chunk != NULL) {
+			size_t i = __atomic_fetch_add(&chunk->used, 1,
+							__ATOMIC_SEQ_CST);
+
+			if (i < READERS_PER_CHUNK)
+				return chunk->readers + i;
+		}
+
+		struct reader_chunk *new_chunk = xmmap_anon(sizeof(*new_chunk));
+
+		new_chunk->next = chunk;
+
+		if (!__atomic_compare_exchange_n(&reader_chunks, &chunk,
+					new_chunk, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			xmunmap(new_chunk, sizeof(*new_chunk));
+	}
+}
+
+/*
+ * run_hook_chain - call the hooks of the chain in the order of their
+ * priority, until one of them takes over the syscall (returns zero)
+ */
+int
+run_hook_chain(struct intercept_ctx *ctx)
+{
+	int forward_to_kernel = 1;
+
+	if (chain_reader == NULL)
+		chain_reader = claim_reader();
+
+	struct chain_reader *reader = chain_reader;
+
+	/*
+	 * A signal handler interrupting the hooks of this thread finds the
+	 * epoch already set, the chain it loads is retired no earlier.
+	 */
+	bool is_outermost =
+		__atomic_load_n(&reader->epoch, __ATOMIC_RELAXED) == 0;
+
+	if (is_outermost)
+		__atomic_store_n(&reader->epoch,
+			__atomic_load_n(&chain_epoch, __ATOMIC_SEQ_CST),
+			__ATOMIC_SEQ_CST);
+
+	const struct hook_chain *chain =
+		__atomic_load_n(&hook_chain, __ATOMIC_SEQ_CST);
+
+	for (size_t i = 0; chain != NULL && i < chain->count; ++i) {
+		const struct hook_chain_entry *entry = chain->entries + i;
+
+		forward_to_kernel = entry->fn(ctx, entry->user);
+		if (!forward_to_kernel)
+			break;
+	}
+
+	if (is_outermost)
+		__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+
+	return forward_to_kernel;
+}
+
+static size_t
+chain_mapping_size(size_t count)
+{
+	return sizeof(struct hook_chain) +
+		count * sizeof(struct hook_chain_entry);
+}
+
+static struct hook_chain *
+new_chain(size_t count)
+{
+	struct hook_chain *chain = xmmap_anon(chain_mapping_size(count));
+
+	chain->count = count;
+	chain->next_retired = NULL;
+	chain->retired_epoch = 0;
+
+	return chain;
+}
+
+/*
+ * oldest_reader_epoch - the smallest epoch among the threads running the
+ * hook chain, zero if there is none
+ */
+static unsigned long
+oldest_reader_epoch(void)
+{
+	unsigned long oldest = 0;
+	struct reader_chunk *chunk =
+		__atomic_load_n(&reader_chunks, __ATOMIC_SEQ_CST);
+
+	for (; chunk != NULL; chunk = chunk->next) {
+		size_t used = __atomic_load_n(&chunk->used, __ATOMIC_SEQ_CST);
+
+		if (used > READERS_PER_CHUNK)
+			used = READERS_PER_CHUNK;
+
+		for (size_t i = 0; i < used; ++i) {
+			unsigned long epoch = __atomic_load_n(
+				&chunk->readers[i].epoch, __ATOMIC_SEQ_CST);
+
+			if (epoch != 0 && (oldest == 0 || epoch < oldest))
+				oldest = epoch;
+		}
+	}
+
+	return oldest;
+}
+
+/*
+ * publish_chain - replace the hook chain, called with registry_lock held
+ *
+ * The chain published before is retired, tagged with the current epoch. A
+ * reader that noted an epoch not later than that one might still use it, but
+ * a reader starting in a later epoch loads hook_chain after the replacement,
+ * and can not see it.
+ */
+static void
+publish_chain(struct hook_chain *chain)
+{
+	struct hook_chain *old = (struct hook_chain *)
+		__atomic_exchange_n(&hook_chain, chain, __ATOMIC_SEQ_CST);
+
+	if (old != NULL) {
+		old->retired_epoch = __atomic_fetch_add(&chain_epoch, 1,
+							__ATOMIC_SEQ_CST);
+		old->next_retired = retired_chains;
+		retired_chains = old;
+	}
+
+	update_runtime_mask();
+
+	unsigned long oldest = oldest_reader_epoch();
+	struct hook_chain **link = &retired_chains;
+
+	while (*link != NULL) {
+		struct hook_chain *retired = *link;
+
+		if (oldest != 0 && retired->retired_epoch >= oldest) {
+			link = &retired->next_retired;
+			continue;
+		}
+
+		*link = retired->next_retired;
+		xmunmap(retired, chain_mapping_size(retired->count));
+	}
+}
+
+/*
+ * intercept_add_hook - add a hook to the hook chain
+ * This is part of syscall_intercept's public API.
+ */
+__attribute__((visibility("default")))
+int
+intercept_add_hook(intercept_syscall_hook_fn fn, void *user, int priority)
+{
+	if (fn == NULL)
+		return -1;
+
+	registry_lock_acquire();
+
+	const struct hook_chain *old = hook_chain;
+	size_t count = (old == NULL) ? 0 : old->count;
+	struct hook_chain *chain = new_chain(count + 1);
+	size_t i = 0;
+
+	/* the new hook goes after the ones with the same priority */
+	for (; i < count && old->entries[i].priority <= priority; ++i)
+		chain->entries[i] = old->entries[i];
+
+	chain->entries[i] = (struct hook_chain_entry){
+		.fn = fn,
+		.user = user,
+		.priority = priority
+	};
+
+	for (; i < count; ++i)
+		chain->entries[i + 1] = old->entries[i];
+
+	publish_chain(chain);
+
+	registry_lock_release();
+
+	return 0;
+}
+
+/*
+ * intercept_remove_hook - remove a hook from the hook chain
+ * This is part of syscall_intercept's public API.
+ */
+__attribute__((visibility("default")))
+int
+intercept_remove_hook(intercept_syscall_hook_fn fn, void *user)
+{
+	registry_lock_acquire();
+
+	const struct hook_chain *old = hook_chain;
+	size_t count = (old == NULL) ? 0 : old->count;
+	size_t found = 0;
+
+	while (found < count && (old->entries[found].fn != fn ||
+				old->entries[found].user != user))
+		++found;
+
+	if (found == count) {
+		registry_lock_release();
+		return -1;
+	}
+
+	struct hook_chain *chain = NULL;
+
+	if (count > 1) {
+		chain = new_chain(count - 1);
+
+		for (size_t i = 0, j = 0; i < count; ++i) {
+			if (i != found)
+				chain->entries[j++] = old->entries[i];
+		}
+	}
+
+	publish_chain(chain);
+
+	registry_lock_release();
+
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * syscall_hooks.h - registered hooks
+ * - hooks of a single syscall number, see intercept_register_syscall_hook()
+ * - the hook chain, see intercept_add_hook()
+ */
+
+#ifndef INTERCEPT_SYSCALL_HOOKS_H
+#define INTERCEPT_SYSCALL_HOOKS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "libsyscall_intercept_hook_point.h"
+#include "patch_offsets.h"
+
+/* the same syscall numbers as the ones covered by the syscall masks */
+#define SYSCALL_HOOKS_COUNT	(SYSCALL_MASK_WORDS * 64)
+
+struct syscall_hook {
+	intercept_syscall_hook_fn fn;
+	void *user;
+};
+
+extern const struct syscall_hook *syscall_hooks[SYSCALL_HOOKS_COUNT];
+
+/*
+ * get_syscall_hook - the hook registered for the syscall number nr,
+ * NULL if there is none
+ */
+static inline const struct syscall_hook *
+get_syscall_hook(long nr)
+{
+	if ((unsigned long)nr >= SYSCALL_HOOKS_COUNT)
+		return NULL;
+
+	return __atomic_load_n(&syscall_hooks[nr], __ATOMIC_ACQUIRE);
+}
+
+struct hook_chain_entry {
+	intercept_syscall_hook_fn fn;
+	void *user;
+	int priority;
+};
+
+struct hook_chain {
+	size_t count;
+	struct hook_chain *next_retired;
+	/* the chain_epoch it was retired in (syscall_hooks.c) */
+	unsigned long retired_epoch;
+	struct hook_chain_entry entries[];
+};
+
+/* NULL while there is no hook in the chain */
+extern const struct hook_chain *hook_chain;
+
+static inline bool
+has_hook_chain(void)
+{
+	return __atomic_load_n(&hook_chain, __ATOMIC_RELAXED) != NULL;
+}
+
+/*
+ * run_hook_chain - returns zero if a hook of the chain took over the
+ * syscall, non-zero otherwise
+ */
+int run_hook_chain(struct intercept_ctx *ctx);
+
+#endif
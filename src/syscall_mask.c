@@ -0,0 +1,308 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * syscall_mask.c -- selecting the syscalls that go through syscall_intercept
+ *
+ * The runtime mask is stored in asm_syscall_mask (intercept_irq_entry.S),
+ * the patch mask is only used by create_patch(). Whenever the patch mask is
+ * set, the runtime mask is set to the same value, so the sites where a7 is
+ * only known at runtime filter the same syscalls.
+ *
+ * The runtime mask is the union of the syscalls selected by the user and
+ * the ones with a hook registered by intercept_register_syscall_hook().
+ * Without a selection, it selects every syscall, unless the hooks of single
+ * syscall numbers are the only ones in use: then it is derived from those,
+ * the rest of the syscalls have nothing to go through.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+
+#include "libsyscall_intercept_hook_point.h"
+#include "intercept.h"
+#include "intercept_log.h"
+#include "patch_offsets.h"
+#include "syscall_formats.h"
+#include "syscall_hooks.h"
+#include "syscall_mask.h"
+
+#define SYSCALL_MASK_BITS	(SYSCALL_MASK_WORDS * 64)
+
+extern uint64_t asm_syscall_mask[SYSCALL_MASK_WORDS];
+
+static uint64_t patch_mask[SYSCALL_MASK_WORDS];
+static bool is_patch_mask_set;
+
+/* selected by the user, every syscall until is_selected_mask_set */
+static uint64_t selected_mask[SYSCALL_MASK_WORDS];
+static bool is_selected_mask_set;
+
+/* syscalls with a hook in the syscall_hooks table */
+static uint64_t hooked_mask[SYSCALL_MASK_WORDS];
+
+/* set by init_syscall_masks(), the patch mask is final from then on */
+static bool is_patching_started;
+
+static void
+set_mask_bit(uint64_t *mask, long nr)
+{
+	mask[nr / 64] |= UINT64_C(1) << (nr % 64);
+}
+
+static void
+clear_mask_bit(uint64_t *mask, long nr)
+{
+	mask[nr / 64] &= ~(UINT64_C(1) << (nr % 64));
+}
+
+/*
+ * The clone syscalls are always selected, their child/parent hooks and the
+ * stack switch of the child are handled by intercept_routine().
+ */
+static void
+set_forced_bits(uint64_t *mask)
+{
+	set_mask_bit(mask, SYS_clone);
+#ifdef SYS_clone3
+	set_mask_bit(mask, SYS_clone3);
+#endif
+}
+
+/*
+ * copy_mask - copy the first nbits bits of a user provided bitmap
+ * A NULL bitmap selects every syscall.
+ */
+static void
+copy_mask(uint64_t *mask, const uint64_t *bitmap, size_t nbits)
+{
+	for (size_t i = 0; i < SYSCALL_MASK_WORDS; ++i) {
+		size_t first_bit = i * 64;
+
+		if (bitmap == NULL)
+			mask[i] = UINT64_MAX;
+		else if (first_bit >= nbits)
+			mask[i] = 0;
+		else if (nbits - first_bit < 64)
+			mask[i] = bitmap[i] &
+				((UINT64_C(1) << (nbits - first_bit)) - 1);
+		else
+			mask[i] = bitmap[i];
+	}
+
+	set_forced_bits(mask);
+}
+
+/*
+ * is_only_hooked_used - are the hooks of single syscall numbers the only
+ * ones that want to see syscalls
+ * The hook pointers can be assigned at any time, they are only checked when
+ * the runtime mask is stored. A client assigning them later selects its
+ * syscalls with intercept_set_syscall_mask().
+ */
+static bool
+is_only_hooked_used(void)
+{
+	bool is_any_hooked = false;
+
+	for (size_t i = 0; i < SYSCALL_MASK_WORDS; ++i)
+		is_any_hooked = is_any_hooked || hooked_mask[i] != 0;
+
+	return is_any_hooked &&
+		intercept_hook_point == NULL &&
+		intercept_hook_ctx == NULL &&
+		intercept_hook_point_post == NULL &&
+		!has_hook_chain() &&
+		!intercept_log_is_enabled();
+}
+
+static void
+store_runtime_mask(void)
+{
+	uint64_t derived[SYSCALL_MASK_WORDS];
+	bool is_derived = !is_selected_mask_set && is_only_hooked_used();
+
+	if (is_derived) {
+		memcpy(derived, hooked_mask, sizeof(derived));
+		set_forced_bits(derived);
+		/* the magic syscalls of handle_magic_syscalls() */
+		set_mask_bit(derived, SYS_write);
+	}
+
+	/* other threads might be in the middle of a syscall, keep words whole */
+	for (size_t i = 0; i < SYSCALL_MASK_WORDS; ++i) {
+		uint64_t word = UINT64_MAX;
+
+		if (is_selected_mask_set)
+			word = selected_mask[i] | hooked_mask[i];
+		else if (is_derived)
+			word = derived[i];
+
+		__atomic_store_n(&asm_syscall_mask[i], word, __ATOMIC_RELAXED);
+	}
+}
+
+static void
+set_selected_mask(const uint64_t *mask, bool is_set)
+{
+	memcpy(selected_mask, mask, sizeof(selected_mask));
+	is_selected_mask_set = is_set;
+	store_runtime_mask();
+}
+
+/*
+ * intercept_set_syscall_mask - select the syscalls that reach the hooks
+ * This is part of syscall_intercept's public API.
+ *
+ * Syscall numbers that do not fit in asm_syscall_mask always reach the hooks.
+ */
+__attribute__((visibility("default")))
+void
+intercept_set_syscall_mask(const uint64_t *bitmap, size_t nbits)
+{
+	uint64_t mask[SYSCALL_MASK_WORDS];
+
+	copy_mask(mask, bitmap, nbits);
+	set_selected_mask(mask, true);
+}
+
+/*
+ * intercept_set_patch_syscall_mask - select the syscalls to patch
+ * This is part of syscall_intercept's public API.
+ */
+__attribute__((visibility("default")))
+int
+intercept_set_patch_syscall_mask(const uint64_t *bitmap, size_t nbits)
+{
+	if (is_patching_started)
+		return -1;
+
+	copy_mask(patch_mask, bitmap, nbits);
+	is_patch_mask_set = (bitmap != NULL);
+	set_selected_mask(patch_mask, is_patch_mask_set);
+
+	return 0;
+}
+
+/*
+ * parse_syscall_list - parse a comma separated list of syscall names or
+ * numbers, e.g. "read,write,56", calling the callback with each number.
+ */
+static void
+parse_syscall_list(const char *list, const char *env_name,
+			void (*callback)(uint64_t *mask, long nr))
+{
+	while (*list != '\0') {
+		size_t len = strcspn(list, ",");
+		char *end;
+		long nr = strtol(list, &end, 10);
+
+		if (len == 0 || end != list + len)
+			nr = get_syscall_number(list, len);
+
+		if (nr < 0 || nr >= SYSCALL_MASK_BITS) {
+			char buffer[0x100];
+
+			snprintf(buffer, sizeof(buffer),
+				"invalid syscall \"%.*s\" in %s",
+				(int)len, list, env_name);
+			xabort(buffer);
+		}
+
+		callback(patch_mask, nr);
+
+		list += len;
+		if (*list == ',')
+			++list;
+	}
+}
+
+void
+init_syscall_masks(void)
+{
+	const char *selected = getenv("INTERCEPT_SYSCALLS");
+	const char *skipped = getenv("INTERCEPT_SKIP_SYSCALLS");
+
+	is_patching_started = true;
+
+	if (selected == NULL && skipped == NULL) {
+		/* the log might have been enabled since the last store */
+		store_runtime_mask();
+		return;
+	}
+
+	if (selected != NULL) {
+		memset(patch_mask, 0, sizeof(patch_mask));
+		parse_syscall_list(selected, "INTERCEPT_SYSCALLS",
+					set_mask_bit);
+	} else if (!is_patch_mask_set) {
+		memset(patch_mask, 0xff, sizeof(patch_mask));
+	}
+
+	if (skipped != NULL)
+		parse_syscall_list(skipped, "INTERCEPT_SKIP_SYSCALLS",
+					clear_mask_bit);
+
+	set_forced_bits(patch_mask);
+	is_patch_mask_set = true;
+	set_selected_mask(patch_mask, true);
+}
+
+void
+set_syscall_hooked(long nr, bool is_hooked)
+{
+	if (is_hooked)
+		set_mask_bit(hooked_mask, nr);
+	else
+		clear_mask_bit(hooked_mask, nr);
+
+	store_runtime_mask();
+}
+
+void
+update_runtime_mask(void)
+{
+	store_runtime_mask();
+}
+
+bool
+is_syscall_patched(long nr)
+{
+	if (!is_patch_mask_set || nr < 0 || nr >= SYSCALL_MASK_BITS)
+		return true;
+
+	return (patch_mask[nr / 64] >> (nr % 64)) & 1;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * syscall_mask.h - selecting the syscalls that go through syscall_intercept
+ *
+ * Two bitmaps, one bit per syscall number:
+ * - the runtime mask (asm_syscall_mask), tested in intercept_irq_entry.S
+ *   before entering C, syscalls not selected are executed without the hooks,
+ *   syscalls with a registered hook are always selected, and without a
+ *   selection by the user, only those are selected if nothing else hooks
+ *   syscalls
+ * - the patch mask, used while hotpatching, syscall sites with a statically
+ *   known syscall number that is not selected are not patched at all
+ */
+
+#ifndef INTERCEPT_SYSCALL_MASK_H
+#define INTERCEPT_SYSCALL_MASK_H
+
+#include <stdbool.h>
+
+/*
+ * init_syscall_masks - apply INTERCEPT_SYSCALLS / INTERCEPT_SKIP_SYSCALLS
+ * Must be called once, before create_patch(). The patch mask can not be
+ * changed after this.
+ */
+void init_syscall_masks(void);
+
+/*
+ * is_syscall_patched - should a site with the syscall number nr be patched
+ * Always true for negative numbers (a7 not known statically).
+ */
+bool is_syscall_patched(long nr);
+
+/*
+ * set_syscall_hooked - keep the syscall nr selected in the runtime mask,
+ * regardless of the mask set by the user, while a hook is registered for it
+ * (syscall_hooks.c). The caller serializes the calls.
+ */
+void set_syscall_hooked(long nr, bool is_hooked);
+
+/*
+ * update_runtime_mask - store the runtime mask again, after the hook chain
+ * changed, the caller serializes the calls like above
+ */
+void update_runtime_mask(void);
+
+#endif
@@ -0,0 +1,73 @@
+#
+# Copyright 2017, Intel Corporation
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+#     * Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#
+#     * Redistributions in binary form must reproduce the above copyright
+#       notice, this list of conditions and the following disclaimer in
+#       the documentation and/or other materials provided with the
+#       distribution.
+#
+#     * Neither the name of the copyright holder nor the names of its
+#       contributors may be used to endorse or promote products derived
+#       from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Runs TEST_PROG twice with the same INTERCEPT_CACHE_DIR, the second run
+# must find the analysis of the patched libraries in the cache, and still
+# pass.
+
+set(CACHE_DIR ${CMAKE_CURRENT_BINARY_DIR}/.cache.${TEST_NAME})
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E remove_directory ${CACHE_DIR})
+execute_process(COMMAND ${CMAKE_COMMAND} -E make_directory ${CACHE_DIR})
+
+set(ENV{INTERCEPT_CACHE_DIR} ${CACHE_DIR})
+set(ENV{INTERCEPT_DEBUG_DUMP} 1)
+if(TEST_EXTRA_PRELOAD)
+	set(ENV{LD_PRELOAD} ${TEST_EXTRA_PRELOAD})
+endif()
+
+foreach(run store hit)
+	execute_process(COMMAND ${TEST_PROG}
+		RESULT_VARIABLE HAD_ERROR
+		OUTPUT_VARIABLE OUTPUT
+		ERROR_VARIABLE DEBUG_DUMP)
+
+	if(HAD_ERROR)
+		message(FATAL_ERROR "Error in the ${run} run: ${HAD_ERROR}")
+	endif()
+
+	if(run STREQUAL "store")
+		set(EXPECTED "analysis cache stored")
+	else()
+		set(EXPECTED "analysis cache hit")
+	endif()
+
+	string(FIND "${DEBUG_DUMP}" "${EXPECTED}" FOUND)
+	if(FOUND EQUAL -1)
+		message(FATAL_ERROR "\"${EXPECTED}\" missing in the ${run} run")
+	endif()
+endforeach()
+
+unset(ENV{LD_PRELOAD})
+unset(ENV{INTERCEPT_DEBUG_DUMP})
+unset(ENV{INTERCEPT_CACHE_DIR})
+
+message("${OUTPUT}")
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * hook_chain_test.c -- intercept_add_hook, intercept_remove_hook
+ *
+ * Three hooks in a chain for getppid: the first one rewrites nothing and
+ * passes, the second one takes over the syscall, the third one must not be
+ * called. Removing the second one lets the third one take over.
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "libsyscall_intercept_hook_point.h"
+
+static int calls[3];
+
+static int
+count_hook(struct intercept_ctx *ctx, void *user)
+{
+	(void) ctx;
+
+	++calls[(long)user];
+
+	return 1;
+}
+
+static int
+claim_hook(struct intercept_ctx *ctx, void *user)
+{
+	++calls[(long)user];
+
+	if (ctx->nr != SYS_getppid)
+		return 1;
+
+	ctx->args[0] = 100 + (long)user;
+	return 0;
+}
+
+int
+main()
+{
+	/* added out of order, called in the order of priority */
+	assert(intercept_add_hook(claim_hook, (void *)2L, 30) == 0);
+	assert(intercept_add_hook(count_hook, (void *)0L, 10) == 0);
+	assert(intercept_add_hook(claim_hook, (void *)1L, 20) == 0);
+	assert(intercept_add_hook(NULL, NULL, 0) == -1);
+
+	assert(syscall(SYS_getppid) == 101);
+	assert(calls[0] == 1 && calls[1] == 1 && calls[2] == 0);
+
+	assert(intercept_remove_hook(claim_hook, (void *)1L) == 0);
+	assert(intercept_remove_hook(claim_hook, (void *)1L) == -1);
+
+	assert(syscall(SYS_getppid) == 102);
+	assert(calls[0] == 2 && calls[1] == 1 && calls[2] == 1);
+
+	assert(intercept_remove_hook(count_hook, (void *)0L) == 0);
+	assert(intercept_remove_hook(claim_hook, (void *)2L) == 0);
+
+	assert(syscall(SYS_getppid) != 102);
+
+	puts("hook chain ok");
+
+	return 0;
+}
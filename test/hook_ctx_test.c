@@ -0,0 +1,95 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * hook_ctx_test.c -- intercept_hook_ctx
+ *
+ * The hook takes over getppid returning both a0 and a1, rewrites the
+ * argument of a forwarded write, and keeps a counter in the per-thread
+ * user pointer.
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "libsyscall_intercept_hook_point.h"
+#include "fake_pid_hook.h"
+
+static const char msg[] = "hook ctx ok\n";
+
+static long counter;
+
+static int
+hook(struct intercept_ctx *ctx)
+{
+	assert(ctx->lib != NULL);
+
+	if (ctx->user == NULL)
+		ctx->user = &counter;
+
+	++*(long *)ctx->user;
+
+	if (ctx->nr == SYS_getppid) {
+		ctx->args[0] = FAKE_PID;
+		ctx->args[1] = 0;
+		return 0;
+	}
+
+	/* the length is zero, the hook makes it print the message */
+	if (ctx->nr == SYS_write && ctx->args[1] == (long)msg)
+		ctx->args[2] = (long)strlen(msg);
+
+	return 1;
+}
+
+int
+main()
+{
+	intercept_hook_ctx = hook;
+
+	assert(syscall(SYS_getppid) == FAKE_PID);
+	assert(counter == 1);
+
+	assert(syscall(SYS_write, 1, msg, 0) == (long)strlen(msg));
+	assert(counter == 2);
+
+	intercept_hook_ctx = NULL;
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * island_mid_test.c -- a TYPE_MID patch going through a stub island
+ *
+ * island_mid_syscall (island_mid_site.S) is patched with INTERCEPT_ALL_OBJS.
+ * Its relocated instructions must be the ones of the site itself: the
+ * syscall number loaded from the stack reaches the hook, and the result
+ * the site returns is the one of the syscall.
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "libsyscall_intercept_hook_point.h"
+#include "fake_pid_hook.h"
+
+long island_mid_syscall(long number);
+
+int
+main()
+{
+	intercept_hook_point = fake_pid_hook;
+
+	assert(island_mid_syscall(SYS_getppid) == FAKE_PID);
+	assert(island_mid_syscall(SYS_gettid) == syscall(SYS_gettid));
+
+	intercept_hook_point = NULL;
+
+	assert(island_mid_syscall(SYS_getppid) == getppid());
+
+	puts("island mid ok");
+
+	return 0;
+}
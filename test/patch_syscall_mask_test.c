@@ -0,0 +1,85 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * patch_syscall_mask_test.c -- intercept_set_patch_syscall_mask
+ *
+ * Only getppid is selected from .preinit_array, before syscall_intercept
+ * patches the process. The hook fakes the result of both getpid and
+ * getppid, but getpid must reach the kernel, whether its syscall
+ * instruction was left untouched or filtered at runtime.
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "libsyscall_intercept_hook_point.h"
+#include "fake_pid_hook.h"
+
+static uint64_t mask[(SYS_getppid / 64) + 1];
+
+static void
+select_syscalls(void)
+{
+	mask[SYS_getppid / 64] |= UINT64_C(1) << (SYS_getppid % 64);
+
+	assert(intercept_set_patch_syscall_mask(mask, SYS_getppid + 1) == 0);
+}
+
+__attribute__((section(".preinit_array"), used))
+static void (*preinit)(void) = select_syscalls;
+
+int
+main()
+{
+	/* too late, the process is already patched */
+	assert(intercept_set_patch_syscall_mask(NULL, 0) == -1);
+
+	intercept_hook_point = fake_pid_hook;
+
+	assert(getppid() == FAKE_PID);
+	assert(syscall(SYS_getppid) == FAKE_PID);
+	assert(getpid() != FAKE_PID);
+	assert(syscall(SYS_getpid) != FAKE_PID);
+
+	intercept_hook_point = NULL;
+
+	puts("patch syscall mask ok");
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * post_hook_test.c -- intercept_hook_point_post
+ *
+ * The post hook must see the result of gettid executed by the library,
+ * and must not be called for getppid, which the hook takes over.
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "libsyscall_intercept_hook_point.h"
+#include "fake_pid_hook.h"
+
+static long post_nr = -1;
+static long post_arg0;
+static long post_result;
+
+static void
+post_hook(long syscall_number, const long args[6], long result,
+		uint64_t cycles)
+{
+	(void) cycles;
+
+	post_nr = syscall_number;
+	post_arg0 = args[0];
+	post_result = result;
+}
+
+int
+main()
+{
+	intercept_hook_point = fake_pid_hook;
+	intercept_hook_point_post = post_hook;
+
+	long tid = syscall(SYS_gettid, 0x1234L);
+
+	assert(post_nr == SYS_gettid);
+	assert(post_arg0 == 0x1234L);
+	assert(post_result == tid);
+
+	post_nr = -1;
+	assert(syscall(SYS_getppid) == FAKE_PID);
+	assert(post_nr == -1);
+
+	intercept_hook_point_post = NULL;
+	intercept_hook_point = NULL;
+
+	puts("post hook ok");
+
+	return 0;
+}
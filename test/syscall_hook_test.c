@@ -0,0 +1,99 @@
+/*
+ * Copyright 2024, Petar Andrić
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * syscall_hook_test.c -- intercept_register_syscall_hook
+ *
+ * Without a syscall mask, while only the hook of getppid is in use, and with
+ * an empty syscall mask, only the syscall with a registered hook reaches the
+ * hooks: getppid is faked by its own hook, getpid reaches the kernel although
+ * the catch-all hook would fake it.
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "libsyscall_intercept_hook_point.h"
+#include "fake_pid_hook.h"
+
+static long fake_ppid = FAKE_PID;
+
+static int
+getppid_hook(struct intercept_ctx *ctx, void *user)
+{
+	assert(ctx->nr == SYS_getppid);
+
+	ctx->args[0] = *(long *)user;
+	return 0;
+}
+
+int
+main()
+{
+	uint64_t none = 0;
+
+	assert(intercept_register_syscall_hook(-1, getppid_hook, NULL) == -1);
+
+	/* the runtime mask is derived from the registered hook */
+	assert(intercept_register_syscall_hook(SYS_getppid, getppid_hook,
+						&fake_ppid) == 0);
+	intercept_hook_point = fake_pid_hook;
+
+	assert(syscall(SYS_getppid) == FAKE_PID);
+	assert(syscall(SYS_getpid) != FAKE_PID);
+
+	/* until every syscall is selected */
+	intercept_set_syscall_mask(NULL, 0);
+	assert(syscall(SYS_getpid) == FAKE_PID);
+
+	intercept_set_syscall_mask(&none, 0);
+
+	assert(syscall(SYS_getppid) == FAKE_PID);
+	assert(syscall(SYS_getpid) != FAKE_PID);
+
+	/* without its own hook, getppid is not selected either */
+	assert(intercept_register_syscall_hook(SYS_getppid, NULL, NULL) == 0);
+	assert(syscall(SYS_getppid) != FAKE_PID);
+
+	intercept_hook_point = NULL;
+	intercept_set_syscall_mask(NULL, 0);
+
+	puts("syscall hook ok");
+
+	return 0;
+}